@@ -0,0 +1,326 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _ATOMIC_CACHE_MAP_HPP_
+#define _ATOMIC_CACHE_MAP_HPP_
+
+#include "cache_table.hpp"
+#include "hash_fun.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <stdint.h>
+#include <type_traits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace mm
+{
+
+/**
+ * Atomic operations on the words that hold a whole slot of an
+ * atomic_cache_map: 8 bytes words use plain atomic instructions, 16 bytes
+ * words use @p cmpxchg16b (compile with @p -mcx16). 16 bytes words are
+ * read with a plain load on processors with AVX (compile with @p -mavx),
+ * and with a @p cmpxchg16b otherwise.
+ */
+template <size_t Size>
+struct atomic_word;
+
+template <>
+struct atomic_word<8>
+{
+    typedef uint64_t type;
+
+    static type load( const type* p )
+    {
+        return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+    }
+
+    static void store( type* p, type w )
+    {
+        __atomic_store_n( p, w, __ATOMIC_RELEASE );
+    }
+
+    static bool cas( type* p, type expected, type desired )
+    {
+        return __atomic_compare_exchange_n( p, &expected, desired, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE );
+    }
+};
+
+template <>
+struct atomic_word<16>
+{
+    typedef unsigned __int128 type;
+
+    static type load( const type* p )
+    {
+#if defined(__AVX__)
+        // Aligned 16 bytes loads are atomic on processors with AVX
+        type w;
+        const __m128i v = _mm_load_si128(
+            reinterpret_cast<const __m128i*>( p ) );
+        std::memcpy( &w, &v, sizeof(w) );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        return w;
+#elif defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+        return __sync_val_compare_and_swap( const_cast<type*>( p ), 0, 0 );
+#else
+        return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+#endif
+    }
+
+    static bool cas( type* p, type expected, type desired )
+    {
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+        return __sync_bool_compare_and_swap( p, expected, desired );
+#else
+        return __atomic_compare_exchange_n( p, &expected, desired, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE );
+#endif
+    }
+
+    static void store( type* p, type w )
+    {
+        type old = load( p );
+        while ( ! cas( p, old, w ) )
+            old = load( p );
+    }
+};
+
+/** Lock-free cache map for small integer keys and data.
+ *
+ *  Every slot of the table holds both the key and the data in a single
+ *  word of 8 or 16 bytes, which is read and written atomically: find() is
+ *  a single atomic load, insert() a single atomic store (a @p cmpxchg16b
+ *  with 16 bytes words), erase() a compare-and-swap. Any number of threads
+ *  can use the map at the same time without locks.
+ *
+ *  With 8 bytes words, and with 16 bytes words on processors with AVX,
+ *  readers never write to shared memory. Without AVX, a 16 bytes word can
+ *  only be read atomically by a @p cmpxchg16b, which takes the cache line
+ *  in exclusive state: concurrent lookups of the same slot then bounce its
+ *  cache line among processors, as writers do.
+ *
+ *  The table is direct-mapped: each key maps to a single slot, and a new
+ *  key always replaces the item in its slot.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  - @a Key : An integral type.
+ *  - @a T : A trivially copyable type, such that key and data together fit
+ *     in 16 bytes.
+ *  - @a HashFunction : Callable hasher.
+ *
+ *  One key value (0 by default, see set_empty_key()) is reserved to mark
+ *  empty slots and cannot be stored in the map.
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template < class Key,
+           class T,
+           class HashFunction = hash<Key>
+>
+class atomic_cache_map
+{
+    static_assert( std::is_integral<Key>::value,
+                   "The key of atomic_cache_map must be an integral type" );
+    static_assert( std::is_trivially_copyable<T>::value,
+                   "The data of atomic_cache_map must be trivially copyable" );
+    static_assert( sizeof(Key) + sizeof(T) <= 16,
+                   "Key and data of atomic_cache_map must fit in 16 bytes" );
+
+    typedef atomic_word< sizeof(Key) + sizeof(T) <= 8 ? 8 : 16 > word_ops;
+    typedef typename word_ops::type word;
+
+public:
+    typedef Key          key_type;
+    typedef T            data_type;
+    typedef T            mapped_type;
+    typedef HashFunction hasher;
+    typedef size_t       size_type;
+
+    /** Constructor.
+     *
+     *  @param n the number of slots (rounded to the next power of 2)
+     *  @param hash the hasher function
+     */
+    explicit atomic_cache_map( size_type n = MM_DEFAULT_TABLE_SIZE,
+                               const hasher& hash = hasher() )
+        : m_hasher( hash ),
+          m_empty_key( 0 )
+    {
+        m_buckets = 1;
+        while ( m_buckets < n )
+            m_buckets <<= 1;
+
+        m_mask = m_buckets - 1;
+        m_table = new word[ m_buckets ]();
+    }
+
+    ~atomic_cache_map() { delete[] m_table; }
+
+    /** Sets the key value reserved to mark empty slots.
+     *
+     *  @attention Must be called before inserting items.
+     */
+    void set_empty_key( const key_type& key ) { m_empty_key = key; }
+
+    /// Get the key value reserved to mark empty slots.
+    const key_type& get_empty_key() const { return m_empty_key; }
+
+    /** Finds the item with the given key and copies its data.
+     *
+     *  @param key  the key of the item
+     *  @param data receives a copy of the data of the item, if found
+     *  @return true if the key was found
+     */
+    bool find( const key_type& key, data_type& data ) const
+    {
+        const word w = word_ops::load( slot( key ) );
+        if ( w == 0 || key_of( w ) != key )
+            return false;
+
+        std::memcpy( &data, reinterpret_cast<const char*>( &w ) + sizeof(Key),
+                     sizeof(T) );
+        return true;
+    }
+
+    /** Inserts an item, replacing whatever item was in its slot.
+     *
+     *  @param key the key of the item, it must not be the empty key
+     *  @param data the data of the item
+     */
+    void insert( const key_type& key, const data_type& data )
+    {
+        assert( key != m_empty_key );
+        word_ops::store( slot( key ), encode( key, data ) );
+    }
+
+    /** Erases the item with the given key.
+     *
+     *  @return the number of deleted items, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        word* p = slot( key );
+        word w = word_ops::load( p );
+        while ( w != 0 && key_of( w ) == key )
+        {
+            if ( word_ops::cas( p, w, 0 ) )
+                return 1;
+
+            w = word_ops::load( p );
+        }
+
+        return 0;
+    }
+
+    /** Erases all of the elements.
+     *
+     *  Items inserted by other threads during the clear may survive.
+     */
+    void clear()
+    {
+        for ( size_type i = 0; i < m_buckets; ++i )
+            word_ops::store( m_table + i, 0 );
+    }
+
+    /** Counts the items in the map.
+     *
+     *  @attention No counter is kept, to avoid a contended cache line: the
+     *  whole table is scanned.
+     */
+    size_type size() const
+    {
+        size_type n = 0;
+        for ( size_type i = 0; i < m_buckets; ++i )
+            n += ( word_ops::load( m_table + i ) != 0 );
+
+        return n;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_type bucket_count() const { return m_buckets; }
+    size_type max_size()     const { return m_buckets; }
+
+    hasher hash_funct() const { return m_hasher; }
+
+private:
+    atomic_cache_map( const atomic_cache_map& );
+    atomic_cache_map& operator= ( const atomic_cache_map& );
+
+    word* slot( const key_type& key ) const
+    {
+        return m_table + ( m_hasher( key ) & m_mask );
+    }
+
+    /// Packs key and data in a word. The key is xor-ed with the empty key,
+    /// so that an empty slot is all zero bits.
+    word encode( const key_type& key, const data_type& data ) const
+    {
+        word w = 0;
+        const key_type k = key ^ m_empty_key;
+        std::memcpy( &w, &k, sizeof(Key) );
+        std::memcpy( reinterpret_cast<char*>( &w ) + sizeof(Key), &data,
+                     sizeof(T) );
+        return w;
+    }
+
+    key_type key_of( const word& w ) const
+    {
+        key_type k;
+        std::memcpy( &k, &w, sizeof(Key) );
+        return k ^ m_empty_key;
+    }
+
+    HashFunction m_hasher;    ///< The hash function
+    key_type     m_empty_key; ///< The key reserved for empty slots
+    size_type    m_buckets;   ///< Number of slots
+    size_type    m_mask;      ///< Mask used to calculate the slot
+    word*        m_table;     ///< The slots
+};
+
+} // namespace mm
+
+#endif // _ATOMIC_CACHE_MAP_HPP_
@@ -40,6 +40,7 @@
 #include "cache_table.hpp"
 #include "hash_fun.hpp"
 
+#include <tuple>
 #include <utility>
 
 /**
@@ -61,6 +62,10 @@ struct DiscardIgnore
     /** This operator is called when the map need to discard an
      * item due to a key collision.
      * 
+     * The discarded element is passed as an rvalue, right before being
+     * destroyed: a discard function taking @a old_value by rvalue
+     * reference or by value can move it away instead of copying it.
+     *
      * @param old_value a reference to the element discarded
      * @param new_value a reference to the element that will enter 
      *                  in the map
@@ -86,6 +91,15 @@ struct DiscardIgnore
  *
  *  - @a DiscardFunction : Discarded item manager.
  *
+ *  - @a Ways : Number of buckets in each set. A key can be stored in any
+ *     bucket of its set, so keys that map to the same set only evict each
+ *     other when the set is full. Must be a power of 2, up to MM_MAX_WAYS.
+ *     The default is 1 (each key maps to a single bucket).
+ *
+ *  - @a EvictionPolicy : Chooses the item to be replaced when a set is
+ *     full. Available policies are EvictRandom (the default), EvictClock,
+ *     EvictLRU and EvictLFU.
+ *
  *  @author Matteo Merli
  *  @date $Date$
  */
@@ -94,17 +108,19 @@ template < class Key,
            class HashFunction = hash<Key>,
            class KeyEqual = std::equal_to<Key>,
            class DiscardFunction = DiscardIgnore< pair<Key,T> >,
-           class Allocator = std::allocator< pair<Key,T> > 
+           class Allocator = std::allocator< pair<Key,T> >,
+           size_t Ways = 1,
+           class EvictionPolicy = EvictRandom
 >
 class cache_map
 {
 private:
     /// The actual hash table
     typedef cache_table< pair<Key,T>, Key,
-                         DiscardFunction,
+                         DiscardFunction, EvictionPolicy,
                          HashFunction, KeyEqual,
                          _Select1st< pair<Key,T> >,
-                         Allocator
+                         Allocator, Ways
                        > HT;
     HT m_ht;
         
@@ -147,6 +163,9 @@ public:
     /// Const reference to value_type.
     typedef typename HT::const_reference const_reference;
 
+    /// The allocator of the items.
+    typedef typename HT::allocator_type allocator_type;
+
     /// Iterator used to iterate through a cache_map. 
     typedef typename HT::iterator iterator;
     
@@ -162,6 +181,14 @@ public:
      */
     key_equal key_eq() const  { return m_ht.key_eq(); }
 
+    /// Returns the allocator of the items
+    allocator_type get_allocator() const { return m_ht.get_allocator(); }
+
+    /// Returns the discard function, to configure it after construction
+    DiscardFunction& discard_funct() { return m_ht.discard_funct(); }
+    const DiscardFunction& discard_funct() const
+    { return m_ht.discard_funct(); }
+
     /// Get an iterator to first item
     iterator begin()             { return m_ht.begin(); }
     /// Get an iterator to the end of the table
@@ -181,11 +208,7 @@ public:
     /** Constructor.  You have to specify the size of the underlying table,
      *  in terms of the maximum number of allowed elements.
      * 
-     *  @attention After the cache_map is constructed, you have to call the
-     *  set_empty_key() method to set the value of an unused key.
-     *
      *  @param n The (fixed) size of table.
-     *  @see set_empty_key
      */
     cache_map( size_type n )
         : m_ht( n, hasher(), key_equal() )
@@ -212,6 +235,20 @@ public:
         : m_ht( n, hash, ke )
     {}
 
+    /** Constructor.
+     *
+     * @param n     the number of item buckets to allocate
+     * @param hash  the hasher function
+     * @param ke    the key comparison function
+     * @param alloc the allocator of the buckets
+     */
+    cache_map( size_type n,
+               const hasher& hash,
+               const key_equal& ke,
+               const allocator_type& alloc )
+        : m_ht( n, hash, ke, alloc )
+    {}
+
     /** Creates a cache_map with a copy of a range.
      * 
      * @param first iterator pointing to the first item
@@ -297,6 +334,11 @@ public:
     }
 
     /** Sets the value of the empty key.
+     *
+     *  The map keeps track of its empty buckets by itself, so calling this
+     *  method is not required, and any key (including this one) can be
+     *  stored in the map. It is kept for compatibility, as the key
+     *  returned by get_empty_key().
      *   
      *  @param key the key value that will be used to identify empty items.
      */
@@ -317,19 +359,109 @@ public:
     /** Insert an item in the map.
      *
      *  The item, the pair(key, data), will be inserted in the hash table.
-     *  In case of a key hash collision, the inserted item will replace the
-     *  existing one.
+     *  If an item with the same key is present, it is assigned the new
+     *  value in place. In case of a key hash collision with another key,
+     *  the inserted item will replace the existing one.
      *
      *  Following the @a DiscardFunction policy there will be a notification
-     *  that old item has been replaced.
+     *  that old item has been replaced. Overwriting the value of a key does
+     *  not count as a collision and does not call the discard function.
      * 
      *  @return A @p pair<iterator,bool> which contain an #iterator to the
      *  inserted item and @p true if the item was correctly inserted, or @p
-     *  false if the item was not inserted.
+     *  end() and @p false if the item was not inserted (the eviction policy
+     *  did not admit it).
      */
     pair<iterator,bool> insert( const value_type& obj )
     { return m_ht.insert( obj ); }
 
+    /** Inserts an item in the map, moving it in.
+     *  @see insert( const value_type& )
+     */
+    pair<iterator,bool> insert( value_type&& obj )
+    { return m_ht.insert( std::move( obj ) ); }
+
+    /** Inserts an item constructed in place from @a args.
+     *
+     *  The item is constructed before its key is looked up: use
+     *  try_emplace() to avoid constructing it when the key is present.
+     *
+     *  @see insert( const value_type& )
+     */
+    template <class... Args>
+    pair<iterator,bool> emplace( Args&&... args )
+    { return m_ht.emplace( std::forward<Args>( args )... ); }
+
+    /** Inserts an item with key @a key and data constructed from @a args,
+     *  if the key is not present.
+     *
+     *  If the key is present, nothing is constructed and @a key and
+     *  @a args are left untouched.
+     *
+     *  @return A @p pair<iterator,bool> which contain an #iterator to the
+     *  inserted item and @p true, or to the item with the same key and
+     *  @p false. The iterator is @p end() if the eviction policy did not
+     *  admit the new item.
+     */
+    template <class... Args>
+    pair<iterator,bool> try_emplace( const key_type& key, Args&&... args )
+    {
+        return m_ht.emplace_absent( key, m_ht.hash_funct()( key ),
+                                    std::piecewise_construct,
+                                    std::forward_as_tuple( key ),
+                                    std::forward_as_tuple(
+                                        std::forward<Args>( args )... ) );
+    }
+
+    /** @see try_emplace( const key_type&, Args&&... ) */
+    template <class... Args>
+    pair<iterator,bool> try_emplace( key_type&& key, Args&&... args )
+    {
+        return m_ht.emplace_absent( key, m_ht.hash_funct()( key ),
+                                    std::piecewise_construct,
+                                    std::forward_as_tuple( std::move( key ) ),
+                                    std::forward_as_tuple(
+                                        std::forward<Args>( args )... ) );
+    }
+
+    /** Inserts an item, or assigns @a obj to the data of the item with the
+     *  same key.
+     *
+     *  Unlike insert(), an item with the same key is updated in place
+     *  rather than destroyed and rebuilt. Either way, the update is
+     *  counted by num_overwrites().
+     *
+     *  @return A @p pair<iterator,bool> which contain an #iterator to the
+     *  item and @p true if it was inserted, or @p false if it was assigned.
+     *  The iterator is @p end() if the eviction policy did not admit the
+     *  new item.
+     */
+    template <class M>
+    pair<iterator,bool> insert_or_assign( const key_type& key, M&& obj )
+    {
+        pair<iterator,bool> res = try_emplace( key, std::forward<M>( obj ) );
+        if ( ! res.second && res.first != end() )
+        {
+            res.first->second = std::forward<M>( obj );
+            m_ht.count_overwrite();
+        }
+        return res;
+    }
+
+    /** @see insert_or_assign( const key_type&, M&& ) */
+    template <class M>
+    pair<iterator,bool> insert_or_assign( key_type&& key, M&& obj )
+    {
+        pair<iterator,bool> res = try_emplace( std::move( key ),
+                                               std::forward<M>( obj ) );
+        if ( ! res.second && res.first != end() )
+        {
+            res.first->second = std::forward<M>( obj );
+            m_ht.count_overwrite();
+        }
+        return res;
+    }
+
     /** Non-stardard insert method.
      *  Insert an (key,data) pair in the map.
      *
@@ -360,6 +492,19 @@ public:
     iterator insert( iterator it, const value_type& obj )
     { return m_ht.insert( obj ).first; }
 
+    /** Inserts @a n items at once.
+     *
+     *  Faster than inserting the items one by one when the map is much
+     *  bigger than the cache, because the buckets of the whole batch are
+     *  prefetched before storing the items.
+     *
+     *  @param objs the items to be inserted
+     *  @param n the number of items
+     *  @return the number of items inserted
+     */
+    size_type insert_batch( const value_type* objs, size_type n )
+    { return m_ht.insert_batch( objs, n ); }
+
     /** Finds an element whose key is @a key
      *
      *  @param key the key of the item
@@ -380,6 +525,56 @@ public:
     const_iterator find( const key_type& key ) const
     { return m_ht.find( key ); }
 
+    /** Finds the elements of @a n keys at once.
+     *
+     *  Faster than @p n calls to find() when the map is much bigger than
+     *  the cache, because the buckets of the whole batch are prefetched
+     *  before looking at them.
+     *
+     *  @param keys the keys of the items
+     *  @param n the number of keys
+     *  @param out receives an #iterator for each key, pointing to the item
+     *         or to @p end()
+     */
+    void find_batch( const key_type* keys, size_type n, iterator* out )
+    { m_ht.find_batch( keys, n, out ); }
+
+    /** Finds the elements of @a n keys at once.
+     *  @see find_batch( const key_type*, size_type, iterator* )
+     */
+    void find_batch( const key_type* keys, size_type n,
+                     const_iterator* out ) const
+    { m_ht.find_batch( keys, n, out ); }
+
+    /** Finds an element whose key hash value is already known.
+     *
+     *  @param key the key of the item
+     *  @param hash the hash value of the key, computed by hash_funct()
+     *  @see find( const key_type& )
+     */
+    iterator find( const key_type& key, size_t hash )
+    { return m_ht.find( key, hash ); }
+
+    /** Finds an element whose key hash value is already known.
+     *  @see find( const key_type&, size_t )
+     */
+    const_iterator find( const key_type& key, size_t hash ) const
+    { return m_ht.find( key, hash ); }
+
+    /** Prefetches the buckets where the key with the given hash value
+     *  can be stored.
+     *
+     *  The prefetch methods allow callers to overlap the cache misses of
+     *  independent lookups (see find_interleaved()). prefetch_matches() is
+     *  to be called after prefetch(), and returns true if it has
+     *  prefetched more buckets the lookup should wait for.
+     */
+    void prefetch( size_t hash ) const { m_ht.prefetch( hash ); }
+
+    /** @see prefetch() */
+    bool prefetch_matches( size_t hash ) const
+    { return m_ht.prefetch_matches( hash ); }
+
     /** Reference operator.
      *
      *  Returns a reference to the object that is associated with a
@@ -391,6 +586,12 @@ public:
     data_type& operator[]( const key_type& key )
     { return m_ht.find_or_insert( key ).second; }
 
+    /** Reference operator, moving the key in when the item is created.
+     *  @see operator[]( const key_type& )
+     */
+    data_type& operator[]( key_type&& key )
+    { return m_ht.find_or_insert( std::move( key ) ).second; }
+
     /** Erases the element identified by the key. 
      *
      *  @param key The key of the item to be deleted.
@@ -419,6 +620,68 @@ public:
     /** Erases all of the elements. */
     void clear() { m_ht.clear(); }
 
+    /** Makes clear() O(1).
+     *
+     *  The items erased by clear() are then destroyed lazily, when their
+     *  bucket is needed again, or by sweep(). Lookups read an additional
+     *  per-set epoch number.
+     */
+    void enable_lazy_clear() { m_ht.enable_lazy_clear(); }
+
+    /** Destroys the items left by a lazy clear(), a few at a time.
+     *
+     *  @param max_sets the maximum number of sets to be swept
+     *  @return true if there are no more items to be destroyed
+     *  @see enable_lazy_clear()
+     */
+    bool sweep( size_type max_sets ) { return m_ht.sweep( max_sets ); }
+
+    /** Writes all the items to a file, to warm up a cache with load()
+     *  after a restart.
+     *
+     *  The items are written with serializer<value_type>: by default,
+     *  this only works with trivially copyable types and std::string.
+     *
+     *  @param path the file to be written
+     *  @return false on I/O errors
+     */
+    bool save( const char* path ) const
+    {
+        return m_ht.save( path, serializer<value_type>() );
+    }
+
+    /** Writes all the items to a file, with the given serializer (see
+     *  snapshot.hpp).
+     */
+    template <class Serializer>
+    bool save( const char* path, const Serializer& s ) const
+    {
+        return m_ht.save( path, s );
+    }
+
+    /** Replaces the items with those of a file written by save().
+     *
+     *  The cache_map can have a different number of buckets than the saved
+     *  one: the items are then rehashed.
+     *
+     *  @param path the file to be read
+     *  @return false if the file cannot be read or is not a snapshot of
+     *          the same type of items
+     */
+    bool load( const char* path )
+    {
+        return m_ht.load( path, serializer<value_type>() );
+    }
+
+    /** Replaces the items with those of a file written by save(), with
+     *  the given serializer (see snapshot.hpp).
+     */
+    template <class Serializer>
+    bool load( const char* path, const Serializer& s )
+    {
+        return m_ht.load( path, s );
+    }
+
     /** Increases the bucket count to at least @a size.
      *
      *  @param size the new maximum number of elements.
@@ -483,14 +746,24 @@ public:
      */
     size_type num_collisions() const { return m_ht.num_collisions(); }
 
+    /** Get the number of items overwritten by an item with the same key.
+     *
+     *  @return the number of in-place updates done by insert() and
+     *  insert_or_assign(). The data assigned through the reference
+     *  returned by operator[] is not counted.
+     */
+    size_type num_overwrites() const { return m_ht.num_overwrites(); }
+
     /** Swap the content of two cache_map instances.
      *
      *  @param m1 a cache_map
      *  @param m2 another cache_map
      */
     friend inline void swap(
-        cache_map<Key,T,HashFunction,KeyEqual,DiscardFunction,Allocator>& m1,
-        cache_map<Key,T,HashFunction,KeyEqual,DiscardFunction,Allocator>& m2 )
+        cache_map<Key,T,HashFunction,KeyEqual,DiscardFunction,Allocator,
+                  Ways,EvictionPolicy>& m1,
+        cache_map<Key,T,HashFunction,KeyEqual,DiscardFunction,Allocator,
+                  Ways,EvictionPolicy>& m2 )
     {
         m1.swap( m2 );
     }
@@ -53,6 +53,10 @@ struct CacheSetDiscardIgnore
     /** This operator is called when the map need to discard an
      * item due to a key collision.
      * 
+     * The discarded element is passed as an rvalue, right before being
+     * destroyed: a discard function taking @a old_value by rvalue
+     * reference or by value can move it away instead of copying it.
+     *
      * @param old_value a reference to the element discarded
      * @param new_value a reference to the element that will enter 
      *                  in the map
@@ -99,6 +103,13 @@ struct Identity
  *  - @a HashFunction : Callable hasher.
  *  - @a DiscardFunction : Discarded item manager.
  *  - @a Allocator : Allocator to be used.
+ *  - @a Ways : Number of buckets in each set. A value can be stored in any
+ *     bucket of its set, so values that map to the same set only evict
+ *     each other when the set is full. Must be a power of 2, up to
+ *     MM_MAX_WAYS. The default is 1 (each value maps to a single bucket).
+ *  - @a EvictionPolicy : Chooses the item to be replaced when a set is
+ *     full. Available policies are EvictRandom (the default), EvictClock,
+ *     EvictLRU and EvictLFU.
  *
  *  @author Matteo Merli
  *  @date $Date$
@@ -107,17 +118,19 @@ template < class Value,
            class HashFunction = hash<Value>,
            class KeyEqual = std::equal_to<Value>,
            class DiscardFunction = CacheSetDiscardIgnore< Value >,
-           class Allocator = std::allocator<Value> // not used
+           class Allocator = std::allocator<Value>, // not used
+           size_t Ways = 1,
+           class EvictionPolicy = EvictRandom
 >
 class cache_set
 {
 private:
     /// The actual hash table
     typedef cache_table< Value, Value,
-                         DiscardFunction,
+                         DiscardFunction, EvictionPolicy,
                          HashFunction, KeyEqual,
                          Identity<Value>,
-                         Allocator
+                         Allocator, Ways
                        > HT;
     HT m_ht;
         
@@ -160,6 +173,9 @@ public:
     /// Const reference to value_type.
     typedef typename HT::const_reference const_reference;
 
+    /// The allocator of the items.
+    typedef typename HT::allocator_type allocator_type;
+
     /// Iterator used to iterate through a cache_set. 
     typedef typename HT::const_iterator iterator;
     
@@ -175,6 +191,14 @@ public:
     /// Returns the key_equal object used by the cache_set. 
     key_equal key_eq() const  { return m_ht.key_eq(); }
 
+    /// Returns the allocator of the items
+    allocator_type get_allocator() const { return m_ht.get_allocator(); }
+
+    /// Returns the discard function, to configure it after construction
+    DiscardFunction& discard_funct() { return m_ht.discard_funct(); }
+    const DiscardFunction& discard_funct() const
+    { return m_ht.discard_funct(); }
+
     /// Get an iterator to first item
     iterator begin()             { return m_ht.begin(); }
     /// Get an iterator to the end of the table
@@ -195,11 +219,7 @@ public:
     /** Constructor.  You have to specify the size of the underlying table,
      *  in terms of the maximum number of allowed elements.
      * 
-     *  @attention After the cache_set is constructed, you have to call the
-     *  set_empty_key() method to set the value of an unused key.
-     *
      *  @param n The (fixed) size of table.
-     *  @see set_empty_key
      */
     cache_set( size_type n ) : m_ht( n, hasher(), key_equal() ) {}
 
@@ -224,6 +244,20 @@ public:
         : m_ht( n, hash, ke )
     {}
 
+    /** Constructor.
+     *
+     * @param n     the number of item buckets to allocate
+     * @param hash  the hasher function
+     * @param ke    the key comparison function
+     * @param alloc the allocator of the buckets
+     */
+    cache_set( size_type n,
+               const hasher& hash,
+               const key_equal& ke,
+               const allocator_type& alloc )
+        : m_ht( n, hash, ke, alloc )
+    {}
+
     /** Constructor. Creates a cache_set with a copy of a range.
      * 
      * @param first iterator pointing to the first item
@@ -309,6 +343,11 @@ public:
     }
 
     /** Sets the value of the empty key.
+     *
+     *  The set keeps track of its empty buckets by itself, so calling this
+     *  method is not required, and any item (including this one) can be
+     *  stored in the set. It is kept for compatibility, as the item
+     *  returned by get_empty_key().
      *   
      *  @param value the value value that will be used to identify empty items.
      */
@@ -333,7 +372,9 @@ public:
      *  existing one.
      *
      *  Following the @a DiscardFunction policy there will be a notification
-     *  that old item has been replaced.
+     *  that old item has been replaced. Inserting an item already present
+     *  does not count as a collision and does not call the discard
+     *  function.
      * 
      *  @return A @p pair<iterator,bool> which contain an #iterator to the
      *  inserted item and @p true if the item was correctly inserted, or @p
@@ -342,6 +383,19 @@ public:
     pair<iterator,bool> insert( const value_type& obj )
     { return m_ht.insert( obj ); }
 
+    /** Inserts an item in the set, moving it in.
+     *  @see insert( const value_type& )
+     */
+    pair<iterator,bool> insert( value_type&& obj )
+    { return m_ht.insert( std::move( obj ) ); }
+
+    /** Inserts an item constructed in place from @a args.
+     *  @see insert( const value_type& )
+     */
+    template <class... Args>
+    pair<iterator,bool> emplace( Args&&... args )
+    { return m_ht.emplace( std::forward<Args>( args )... ); }
+
     /** Iterator insertion.
      *  Insert multiple items into the set, using the input iterators.
      *
@@ -362,6 +416,19 @@ public:
     iterator insert( iterator it, const value_type& obj )
     { return m_ht.insert( obj ).first; }
 
+    /** Inserts @a n items at once.
+     *
+     *  Faster than inserting the items one by one when the set is much
+     *  bigger than the cache, because the buckets of the whole batch are
+     *  prefetched before storing the items.
+     *
+     *  @param objs the items to be inserted
+     *  @param n the number of items
+     *  @return the number of items inserted
+     */
+    size_type insert_batch( const value_type* objs, size_type n )
+    { return m_ht.insert_batch( objs, n ); }
+
     /** Finds an element in the set.
      *
      *  @param item the item to look for
@@ -372,6 +439,44 @@ public:
     iterator find( const value_type& item ) const 
     { return m_ht.find( item ); }
 
+    /** Finds @a n items at once.
+     *
+     *  Faster than @p n calls to find() when the set is much bigger than
+     *  the cache, because the buckets of the whole batch are prefetched
+     *  before looking at them.
+     *
+     *  @param items the items to look for
+     *  @param n the number of items
+     *  @param out receives a #const_iterator for each item, pointing to the
+     *         item or to @p end()
+     */
+    void find_batch( const value_type* items, size_type n,
+                     iterator* out ) const
+    { m_ht.find_batch( items, n, out ); }
+
+    /** Finds an item whose hash value is already known.
+     *
+     *  @param item the item to look for
+     *  @param hash the hash value of the item, computed by hash_funct()
+     *  @see find( const value_type& )
+     */
+    iterator find( const value_type& item, size_t hash ) const
+    { return m_ht.find( item, hash ); }
+
+    /** Prefetches the buckets where the item with the given hash value
+     *  can be stored.
+     *
+     *  The prefetch methods allow callers to overlap the cache misses of
+     *  independent lookups (see find_interleaved()). prefetch_matches() is
+     *  to be called after prefetch(), and returns true if it has
+     *  prefetched more buckets the lookup should wait for.
+     */
+    void prefetch( size_t hash ) const { m_ht.prefetch( hash ); }
+
+    /** @see prefetch() */
+    bool prefetch_matches( size_t hash ) const
+    { return m_ht.prefetch_matches( hash ); }
+
     /** Erases the element identified by the key. 
      *
      *  @param key The key of the item to be deleted.
@@ -400,6 +505,68 @@ public:
     /** Removes all the elements. */
     void clear() { m_ht.clear(); }
 
+    /** Makes clear() O(1).
+     *
+     *  The items erased by clear() are then destroyed lazily, when their
+     *  bucket is needed again, or by sweep(). Lookups read an additional
+     *  per-set epoch number.
+     */
+    void enable_lazy_clear() { m_ht.enable_lazy_clear(); }
+
+    /** Destroys the items left by a lazy clear(), a few at a time.
+     *
+     *  @param max_sets the maximum number of sets to be swept
+     *  @return true if there are no more items to be destroyed
+     *  @see enable_lazy_clear()
+     */
+    bool sweep( size_type max_sets ) { return m_ht.sweep( max_sets ); }
+
+    /** Writes all the items to a file, to warm up a cache with load()
+     *  after a restart.
+     *
+     *  The items are written with serializer<value_type>: by default,
+     *  this only works with trivially copyable types and std::string.
+     *
+     *  @param path the file to be written
+     *  @return false on I/O errors
+     */
+    bool save( const char* path ) const
+    {
+        return m_ht.save( path, serializer<value_type>() );
+    }
+
+    /** Writes all the items to a file, with the given serializer (see
+     *  snapshot.hpp).
+     */
+    template <class Serializer>
+    bool save( const char* path, const Serializer& s ) const
+    {
+        return m_ht.save( path, s );
+    }
+
+    /** Replaces the items with those of a file written by save().
+     *
+     *  The cache_set can have a different number of buckets than the saved
+     *  one: the items are then rehashed.
+     *
+     *  @param path the file to be read
+     *  @return false if the file cannot be read or is not a snapshot of
+     *          the same type of items
+     */
+    bool load( const char* path )
+    {
+        return m_ht.load( path, serializer<value_type>() );
+    }
+
+    /** Replaces the items with those of a file written by save(), with
+     *  the given serializer (see snapshot.hpp).
+     */
+    template <class Serializer>
+    bool load( const char* path, const Serializer& s )
+    {
+        return m_ht.load( path, s );
+    }
+
     /** Increases the bucket count to at least @a size.
      *
      *  @param size the new maximum number of elements.
@@ -464,14 +631,22 @@ public:
      */
     size_type num_collisions() const { return m_ht.num_collisions(); }
 
+    /** Get the number of items overwritten by an equal item.
+     *
+     *  @return the number of in-place updates done by insert()
+     */
+    size_type num_overwrites() const { return m_ht.num_overwrites(); }
+
     /** Swap the content of two cache_set instances.
      *
      *  @param m1 a cache_set
      *  @param m2 another cache_set
      */
     friend inline void swap(
-        cache_set<Value,HashFunction,KeyEqual,DiscardFunction,Allocator>& m1,
-        cache_set<Value,HashFunction,KeyEqual,DiscardFunction,Allocator>& m2 )
+        cache_set<Value,HashFunction,KeyEqual,DiscardFunction,Allocator,
+                  Ways,EvictionPolicy>& m1,
+        cache_set<Value,HashFunction,KeyEqual,DiscardFunction,Allocator,
+                  Ways,EvictionPolicy>& m2 )
     {
         m1.swap( m2 );
     }
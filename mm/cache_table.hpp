@@ -37,15 +37,37 @@
 #ifndef _CACHE_TABLE_HPP_
 #define _CACHE_TABLE_HPP_
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "eviction_policy.hpp"
+#include "snapshot.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /// Default number of buckets, when it's not specified.
 #define MM_DEFAULT_TABLE_SIZE 4096
 
+/// Maximum number of ways (slots per set) in set-associative mode.
+#define MM_MAX_WAYS 32
+
+/// Number of lookups whose sets are prefetched together by the batch
+/// methods.
+#define MM_PREFETCH_BATCH 32
+
+
 
 namespace mm 
 {
@@ -55,13 +77,14 @@ using std::_Construct;
 using std::_Destroy;
 
 template < class Value, class Key, class DiscardFunction,
-           class HashFunction, class KeyEqual, class KeyExtract,
-           class Allocator
+           class EvictionPolicy, class HashFunction, class KeyEqual,
+           class KeyExtract, class Allocator, size_t Ways
          > class cache_table;
 
 // ITERATORS
 
-template <class V, class K, class DF, class HF, class KEq, class KEx, class A>
+template <class V, class K, class DF, class EP, class HF, class KEq, class KEx,
+          class A, size_t W>
 class cache_table_const_iterator;
 
 /**
@@ -87,22 +110,113 @@ inline ptrdiff_t distance( IteratorA first, IteratorB last )
 
 ////////////////////////////////////////////////////////////////////////
 
+/** Tells whether an allocator returns zero-filled memory.
+ *
+ *  Allocators declare it with a static boolean member @p zero_filled. The
+ *  containers skip the zeroing of their tags and bitmaps when the memory
+ *  is already zero.
+ */
+template <class Alloc, class = void>
+struct allocates_zeroed : std::false_type {};
+
+template <class Alloc>
+struct allocates_zeroed< Alloc, decltype( void( Alloc::zero_filled ) ) >
+    : std::integral_constant<bool, Alloc::zero_filled> {};
+
+/** Tells whether the memory of an allocator outlives the containers.
+ *
+ *  Allocators declare it with a static boolean member @p persistent, like
+ *  mapped_file_allocator. The containers then take over the items they
+ *  find in their memory when they are built, and leave them in place when
+ *  they are destroyed.
+ */
+template <class Alloc, class = void>
+struct allocates_persistent : std::false_type {};
+
+template <class Alloc>
+struct allocates_persistent< Alloc, decltype( void( Alloc::persistent ) ) >
+    : std::integral_constant<bool, Alloc::persistent> {};
+
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Compares the tags of a set of buckets with a given tag.
+ *
+ * Sets of 4, 8, 16 and 32 tags are compared in parallel, using SSE2 or
+ * AVX2 instructions when available.
+ *
+ * @param tags pointer to the tags of the first bucket of the set
+ * @param tag  the tag to look for
+ * @return a bit mask with the bit @a i set if the @a i-th tag is equal to
+ *         @a tag
+ */
+template <size_t Ways>
+inline unsigned int match_tags( const unsigned char* tags, unsigned char tag )
+{
+#if defined(__SSE2__)
+    if ( Ways >= 4 )
+    {
+        const __m128i needle = _mm_set1_epi8( static_cast<char>( tag ) );
+        if ( Ways == 4 )
+        {
+            int word;
+            std::memcpy( &word, tags, sizeof(word) );
+            const __m128i t = _mm_cvtsi32_si128( word );
+            return _mm_movemask_epi8( _mm_cmpeq_epi8( t, needle ) ) & 0xF;
+        }
+        if ( Ways == 8 )
+        {
+            const __m128i t = _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>( tags ) );
+            return _mm_movemask_epi8( _mm_cmpeq_epi8( t, needle ) ) & 0xFF;
+        }
+#if defined(__AVX2__)
+        if ( Ways == 32 )
+        {
+            const __m256i t = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>( tags ) );
+            return _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8( t, _mm256_set1_epi8(
+                                          static_cast<char>( tag ) ) ) );
+        }
+#endif
+        unsigned int mask = 0;
+        for ( size_t i = 0; i < Ways; i += 16 )
+        {
+            const __m128i t = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>( tags + i ) );
+            mask |= static_cast<unsigned int>(
+                _mm_movemask_epi8( _mm_cmpeq_epi8( t, needle ) ) ) << i;
+        }
+        return mask;
+    }
+#endif
+    unsigned int mask = 0;
+    for ( size_t i = 0; i < Ways; ++i )
+        mask |= static_cast<unsigned int>( tags[ i ] == tag ) << i;
+
+    return mask;
+}
+
+////////////////////////////////////////////////////////////////////////
+
 /**
  * Iterator class 
  */
-template <class V, class K, class DF, class HF, class KEq, class KEx, class A>
+template <class V, class K, class DF, class EP, class HF, class KEq, class KEx,
+          class A, size_t W>
 class cache_table_iterator
 {
 public:
 
     /// cache_table definition
-    typedef cache_table<V,K,DF,HF,KEq,KEx,A>                table;
+    typedef cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>                table;
 
     /// Iterator definition
-    typedef cache_table_iterator<V,K,DF,HF,KEq,KEx,A>       iterator;
+    typedef cache_table_iterator<V,K,DF,EP,HF,KEq,KEx,A,W>       iterator;
 
     /// Const iterator definition
-    typedef cache_table_const_iterator<V,K,DF,HF,KEq,KEx,A> const_iterator;
+    typedef cache_table_const_iterator<V,K,DF,EP,HF,KEq,KEx,A,W> const_iterator;
 
     /// Iterator category
     typedef std::random_access_iterator_tag iterator_category;
@@ -225,11 +339,11 @@ public:
         
 private:
 
-    /// Advance the iterator to the next non-empty item
+    /// Advance the iterator to the next non-empty item, skipping the
+    /// empty buckets 64 at a time
     void advance_to_next_item()
     {
-        while ( m_pos < m_ht->m_end_marker && m_ht->is_empty_key( m_pos ) )
-            ++m_pos;
+        m_pos = m_ht->m_table + m_ht->next_occupied( m_pos - m_ht->m_table );
     }
     
     /// Pointer to tha associated cache-table instance
@@ -238,10 +352,10 @@ private:
     pointer       m_pos;
 
     /// Const iterator definition
-    friend class cache_table_const_iterator<V,K,DF,HF,KEq,KEx,A>;
+    friend class cache_table_const_iterator<V,K,DF,EP,HF,KEq,KEx,A,W>;
 
     /// Cache table definition
-    friend class cache_table<V,K,DF,HF,KEq,KEx,A>;
+    friend class cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -249,19 +363,20 @@ private:
 /**
  * Const Iterator class 
  */
-template <class V, class K, class DF, class HF, class KEq, class KEx, class A>
+template <class V, class K, class DF, class EP, class HF, class KEq, class KEx,
+          class A, size_t W>
 class cache_table_const_iterator
 {
 public:
 
     /// cache_table definition 
-    typedef cache_table<V,K,DF,HF,KEq,KEx,A>                table;
+    typedef cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>                table;
 
     /// Iterator definition
-    typedef cache_table_iterator<V,K,DF,HF,KEq,KEx,A>       iterator;
+    typedef cache_table_iterator<V,K,DF,EP,HF,KEq,KEx,A,W>       iterator;
 
     /// Const iterator definition
-    typedef cache_table_const_iterator<V,K,DF,HF,KEq,KEx,A> const_iterator;
+    typedef cache_table_const_iterator<V,K,DF,EP,HF,KEq,KEx,A,W> const_iterator;
 
     /// Iterator category
     typedef std::random_access_iterator_tag iterator_category;
@@ -384,8 +499,7 @@ private:
 
     void advance_to_next_item()
     {
-        while ( m_pos < m_ht->m_end_marker && m_ht->is_empty_key( m_pos ) )
-            ++m_pos;
+        m_pos = m_ht->m_table + m_ht->next_occupied( m_pos - m_ht->m_table );
     }
         
     /// Pointer to tha associated cache-table instance
@@ -394,7 +508,7 @@ private:
     pointer       m_pos;
 
     /// Cache table definition
-    friend class cache_table<V,K,DF,HF,KEq,KEx,A>;
+    friend class cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>;
 };
 
 
@@ -405,6 +519,30 @@ private:
  * 
  * This class should not be used directly. Instead use one of CacheMap
  * or CacheSet.
+ *
+ * The buckets are grouped in sets of @a Ways consecutive slots. A key is
+ * mapped to a set and can be stored in any slot of that set; when the set
+ * is full, the @a EvictionPolicy chooses which of the resident items is
+ * replaced (see eviction_policy.hpp).
+ * With @a Ways equal to 1 every key maps to exactly one slot
+ * (direct-mapped table). Choosing @a Ways so that a set fits in a cache
+ * line (eg: 4 ways of 16 bytes items) keeps lookups to a single cache line
+ * while greatly reducing the number of collisions.
+ *
+ * Alongside the buckets, the table keeps an array of 1-byte tags: the tag
+ * of an empty bucket is 0, the tag of a used one is taken from the most
+ * significant byte of the hash value of its key. Lookups compare the tags
+ * of a whole set at once and call @a KeyEqual only on buckets whose tag
+ * matches, so hash functions should spread entropy in the high bits.
+ *
+ * The table also keeps a bitmap of the used buckets, one bit per bucket:
+ * iterators skip 64 empty buckets at a time, and clear() only visits the
+ * used ones. Empty buckets hold no object at all, so no "empty key"
+ * sentinel is needed to tell them apart.
+ *
+ * With enable_lazy_clear(), each set also has an epoch number and clear()
+ * just starts a new epoch: the sets of older epochs read as empty, and
+ * their items are destroyed when the set is used again or by sweep().
  * 
  * @author Matteo Merli
  * @date $Date$
@@ -412,13 +550,19 @@ private:
 template < class Value, 
            class Key,
            class DiscardFunction,
+           class EvictionPolicy,
            class HashFunction, 
            class KeyEqual,
            class KeyExtract,
-           class Allocator 
+           class Allocator,
+           size_t Ways
          >
 class cache_table
 {
+    static_assert( Ways > 0 && Ways <= MM_MAX_WAYS
+                   && ( Ways & ( Ways - 1 ) ) == 0,
+                   "Ways must be a power of 2, not bigger than MM_MAX_WAYS" );
+
 public:
     typedef Key             key_type;
     typedef Value           value_type;
@@ -433,11 +577,13 @@ public:
     typedef value_type&       reference;
     typedef const value_type& const_reference;
     
-    typedef cache_table_iterator< Value, Key, DiscardFunction, HashFunction,
-                                  KeyEqual, KeyExtract, Allocator
+    typedef cache_table_iterator< Value, Key, DiscardFunction,
+                                  EvictionPolicy, HashFunction, KeyEqual,
+                                  KeyExtract, Allocator, Ways
                                 > iterator;
-    typedef cache_table_const_iterator< Value, Key, DiscardFunction, HashFunction,
-                                        KeyEqual, KeyExtract, Allocator
+    typedef cache_table_const_iterator< Value, Key, DiscardFunction,
+                                        EvictionPolicy, HashFunction,
+                                        KeyEqual, KeyExtract, Allocator, Ways
                                       > const_iterator;
         
     typedef Allocator allocator_type;
@@ -448,41 +594,74 @@ private:
     KeyExtract        m_key_extract;
     Allocator         m_allocator;
     DiscardFunction   m_discard;
+
+    /// The policy is notified of lookups too, which are const
+    mutable EvictionPolicy m_policy;
+
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<unsigned char> tag_allocator;
+    tag_allocator     m_tag_allocator;
+
+    typedef unsigned long long bitmap_word;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<bitmap_word> bitmap_allocator;
+    bitmap_allocator  m_bitmap_allocator;
+
+    typedef unsigned int epoch_type;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<epoch_type> epoch_allocator;
+    epoch_allocator   m_epoch_allocator;
     
 public:
     
     hasher hash_funct() const { return m_hasher;    }
     key_equal key_eq()  const { return m_key_equal; }
+    allocator_type get_allocator() const { return m_allocator; }
+    DiscardFunction& discard_funct() { return m_discard; }
+    const DiscardFunction& discard_funct() const { return m_discard; }
         
 public:
 
     cache_table()
         : m_num_elements( 0 ),
           m_num_collisions( 0 ),
+          m_num_overwrites( 0 ),
           m_empty_key_is_set( false ),
           m_table( 0 ),
+          m_tags( 0 ),
+          m_occupied( 0 ),
+          m_epochs( 0 ),
+          m_epoch( 0 ),
+          m_sweep_set( 0 ),
           m_empty_key(),
           m_empty_value()
     {
-        m_buckets = round_to_power2( MM_DEFAULT_TABLE_SIZE );
-        m_mask = m_buckets - 1;
-
+        set_bucket_count( MM_DEFAULT_TABLE_SIZE );
         init();
     }
     
-    cache_table( size_type n, const hasher& hash, const key_equal& ke )
+    cache_table( size_type n, const hasher& hash, const key_equal& ke,
+                 const allocator_type& alloc = allocator_type() )
         : m_hasher( hash ),
           m_key_equal( ke ),
+          m_allocator( alloc ),
+          m_tag_allocator( alloc ),
+          m_bitmap_allocator( alloc ),
+          m_epoch_allocator( alloc ),
           m_num_elements( 0 ),
           m_num_collisions( 0 ),
+          m_num_overwrites( 0 ),
           m_empty_key_is_set( false ),
           m_table( 0 ),
+          m_tags( 0 ),
+          m_occupied( 0 ),
+          m_epochs( 0 ),
+          m_epoch( 0 ),
+          m_sweep_set( 0 ),
           m_empty_key(),
           m_empty_value()
     {
-        m_buckets = round_to_power2( n );
-        m_mask = m_buckets - 1;
-
+        set_bucket_count( n );
         init();
     }
 
@@ -493,17 +672,28 @@ public:
     cache_table( const cache_table& other )
         : m_hasher( other.m_hasher ),
           m_key_equal( other.m_key_equal ),
-          m_num_elements( other.m_num_elements ),
+          m_allocator( other.m_allocator ),
+          m_tag_allocator( other.m_tag_allocator ),
+          m_bitmap_allocator( other.m_bitmap_allocator ),
+          m_epoch_allocator( other.m_epoch_allocator ),
+          m_buckets( other.m_buckets ),
+          m_mask( other.m_mask ),
+          m_num_elements( 0 ),
           m_num_collisions( other.m_num_collisions ),
+          m_num_overwrites( other.m_num_overwrites ),
           m_empty_key_is_set( other.m_empty_key_is_set ),
-          m_table( other.m_table ),
+          m_table( 0 ),
+          m_tags( 0 ),
+          m_occupied( 0 ),
+          m_epochs( 0 ),
+          m_epoch( 0 ),
+          m_sweep_set( 0 ),
           m_empty_key( other.m_empty_key),
-          m_empty_value( other.m_empty_value ),
-          m_buckets( other.m_buckets ),
-          m_mask( other.m_mask ),
-          m_end_it( other.m_end_it )
+          m_empty_value( other.m_empty_value )
     {
         init();
+        if ( other.m_epochs )
+            enable_lazy_clear();
         insert( other.begin(), other.end() );
     }
 
@@ -524,24 +714,57 @@ public:
     }
 
 private:
+    // The arenas of the tables stored in files are sized by table_layout()
+    // (see mapped_file.hpp), that follows these allocations
     void init()
     {
-        m_table = m_allocator.allocate( m_buckets * ItemSize );
+        m_table = m_allocator.allocate( m_buckets );
+        m_tags = m_tag_allocator.allocate( m_buckets );
+        m_occupied = m_bitmap_allocator.allocate( bitmap_words( m_buckets ) );
         m_end_marker = m_table + m_buckets;
         m_end_it = iterator( this, m_end_marker );
 
         initialize_memory();
+        if ( allocates_persistent<Allocator>::value )
+            adopt_items();
+    }
+
+    /// Counts the items found in the buckets, and notifies the eviction
+    /// policy of them: they have been left in persistent memory by a
+    /// previous table, or read from a snapshot
+    void adopt_items()
+    {
+        for ( size_t buck = next_bit( 0 ); buck < m_buckets;
+              buck = next_bit( buck + 1 ) )
+        {
+            ++m_num_elements;
+            m_policy.on_insert( buck );
+        }
+    }
+
+    /// Notifies the eviction policy about a bucket being stored
+    void stored( size_t buck, bool found ) const
+    {
+        if ( found )
+            m_policy.on_hit( buck );
+        else
+            m_policy.on_insert( buck );
     }
     
 public:
+    /** Sets the empty value, which is only reported by get_empty_value()
+     *  and passed to the discard function as the new item by
+     *  find_or_insert().
+     *
+     *  The empty buckets are tracked by the table and hold no object, so
+     *  the empty value is not needed to mark them.
+     */
     void set_empty_value( const value_type& empty_value )
     {
         assert( m_empty_key_is_set == false );
         
         m_empty_key = m_key_extract( empty_value );
         m_empty_value = empty_value;
-        
-        initialize_memory();
         m_empty_key_is_set = true;
     }
 
@@ -552,36 +775,112 @@ public:
         
     ~cache_table() 
     {
-        clear();
-        m_allocator.deallocate( m_table, m_buckets * ItemSize );
+        if ( ! allocates_persistent<Allocator>::value )
+            destroy_all();
+        disable_lazy_clear();
+        m_allocator.deallocate( m_table, m_buckets );
+        m_tag_allocator.deallocate( m_tags, m_buckets );
+        m_bitmap_allocator.deallocate( m_occupied, bitmap_words( m_buckets ) );
     }
 
     // INSERTIONS
-        
+
+    /** Inserts an item, replacing the one with the same key if present.
+     *
+     *  An item with the same key is assigned the new value in place and is
+     *  not passed to the discard function.
+     *
+     *  @return the iterator to the inserted item and @p true, or @p end()
+     *          and @p false if the eviction policy did not admit the item
+     */
     pair<iterator,bool> insert( const value_type& obj )
     {
-        const key_type& obj_key = m_key_extract( obj );
-        const size_t buck = m_hasher( obj_key ) & m_mask;
-            
-        const key_type& table_key = m_key_extract( m_table[ buck ] );
-        
-        if ( ! m_key_equal( table_key, m_empty_key ) )
+        return insert( obj, m_hasher( m_key_extract( obj ) ) );
+    }
+
+    /** Inserts an item, moving it into the table.
+     *  @see insert( const value_type& )
+     */
+    pair<iterator,bool> insert( value_type&& obj )
+    {
+        const size_t hash = m_hasher( m_key_extract( obj ) );
+        return insert( std::move( obj ), hash );
+    }
+
+    /** Inserts an item whose key hash value is already known.
+     *
+     *  The methods taking a @a hash parameter allow callers that have
+     *  already hashed the key (eg: to choose a shard) to avoid hashing it
+     *  again. @a hash must be the value computed by hash_funct() for the
+     *  key.
+     */
+    pair<iterator,bool> insert( const value_type& obj, size_t hash )
+    {
+        return insert_value( obj, hash );
+    }
+
+    pair<iterator,bool> insert( value_type&& obj, size_t hash )
+    {
+        return insert_value( std::move( obj ), hash );
+    }
+
+    /** Inserts an item constructed from @a args.
+     *
+     *  The item is constructed before looking for its key, as its key is
+     *  not known before; use emplace_absent() to construct it only if the
+     *  key is not present.
+     */
+    template <class... Args>
+    pair<iterator,bool> emplace( Args&&... args )
+    {
+        return insert( value_type( std::forward<Args>( args )... ) );
+    }
+
+    /** Stores an item constructed from @a args, unless an item with @a key
+     *  is already present.
+     *
+     *  Nothing is constructed when @a key is found. The item is
+     *  constructed in place in an empty bucket, or moved in place of the
+     *  victim when the set is full.
+     *
+     *  @param key the key of the item that @a args construct
+     *  @param hash the hash value of @a key
+     *  @return the iterator to the new item and @p true, or the iterator
+     *          to the item with the same key and @p false, or @p end() and
+     *          @p false if the eviction policy did not admit the item
+     */
+    template <class... Args>
+    pair<iterator,bool> emplace_absent( const key_type& key, size_t hash,
+                                        Args&&... args )
+    {
+        bool found;
+        const size_t buck = insert_position( hash, key, found, true );
+
+        if ( buck == m_buckets )
+            return pair<iterator,bool>( m_end_it, false );
+
+        if ( found )
         {
-            // There's already an item in the bucket and its key it different
-            // from the key of the inserted item.  Element is discarded.
-            ++m_num_collisions;
+            m_policy.on_hit( buck );
+            return pair<iterator,bool>( iterator( this, m_table + buck ),
+                                        false );
+        }
 
-            // Notify that the item will be discarded, to allow a policy to
-            // do something useful with it.
-            m_discard( m_table[ buck ], obj );
-            _Destroy( m_table + buck );
-            reset_value( m_table + buck );
+        if ( m_tags[ buck ] != 0 )
+        {
+            // The discard function must see the new item before it is
+            // stored
+            store( buck, hash, false,
+                   value_type( std::forward<Args>( args )... ) );
         }
         else
+        {
             ++m_num_elements;
+            _Construct( m_table + buck, std::forward<Args>( args )... );
+            occupy( buck, hash );
+            m_policy.on_insert( buck );
+        }
 
-        // Copy the object into the hash table.
-        _Construct( m_table + buck, obj );
         return pair<iterator,bool>( iterator( this, m_table + buck ), true );
     }
 
@@ -591,63 +890,228 @@ public:
         for ( ; first != last; ++first )
             insert( *first );
     }
+
+    /** Inserts @a n items at once.
+     *
+     *  The keys are hashed and their sets prefetched MM_PREFETCH_BATCH at
+     *  a time, before any item is stored, so the cache misses overlap.
+     *
+     *  @return the number of items stored (the eviction policy may not
+     *          admit some of them)
+     */
+    size_type insert_batch( const value_type* objs, size_type n )
+    {
+        size_t hashes[ MM_PREFETCH_BATCH ];
+        size_type stored = 0;
+        for ( size_type base = 0; base < n; base += MM_PREFETCH_BATCH )
+        {
+            const size_type count = std::min<size_type>( n - base,
+                                                         MM_PREFETCH_BATCH );
+            for ( size_type i = 0; i < count; ++i )
+            {
+                hashes[ i ] = m_hasher( m_key_extract( objs[ base + i ] ) );
+                prefetch( hashes[ i ] );
+            }
+
+            for ( size_type i = 0; i < count; ++i )
+                stored += insert( objs[ base + i ], hashes[ i ] ).second;
+        }
+
+        return stored;
+    }
     
     // SEARCHES
     
     iterator find( const key_type& key ) 
     {
-        // First of all, obtain the bucket number corresponding with the
-        // supplied key
-        size_t buck = m_hasher( key ) & m_mask;
-        
-        // Next, check that the key found in table bucket is equal to the
-        // supplied key. If not, either the bucket is empty and so the key
-        // wasn't found, or the bucket is hosting a different value with a
-        // hash collision.
-        if ( ! m_key_equal( m_key_extract( m_table[ buck ] ), key ) )
+        return find( key, m_hasher( key ) );
+    }
+
+    const_iterator find( const key_type& key ) const
+    {
+        return find( key, m_hasher( key ) );
+    }
+
+    iterator find( const key_type& key, size_t hash )
+    {
+        // First of all, obtain the set corresponding with the supplied key
+        // and look for a bucket in the set hosting the same key. If there
+        // is none, either the buckets are empty and so the key wasn't
+        // found, or they are hosting different values with a hash
+        // collision.
+        m_policy.on_access( hash );
+
+        size_t buck = probe( hash, key );
+        if ( buck == m_buckets )
             return m_end_it;
 
+        m_policy.on_hit( buck );
+
         // else return the iterator to found item
         return iterator( this, m_table + buck );
     }
 
-    const_iterator find( const key_type& key ) const
+    const_iterator find( const key_type& key, size_t hash ) const
     {
-        // First of all, obtain the bucket number corresponding with the
-        // supplied key
-        size_t buck = m_hasher( key ) & m_mask;
-        
-        // Next, check that the key found in table bucket is equal to the
-        // supplied key. If not, either the bucket is empty and so the key
-        // wasn't found, or the bucket is hosting a different value with a
-        // hash collision.
-        if ( ! m_key_equal( m_key_extract( m_table[ buck ] ), key ) )
+        m_policy.on_access( hash );
+
+        size_t buck = probe( hash, key );
+        if ( buck == m_buckets )
+            return m_end_it;
+
+        m_policy.on_hit( buck );
+        return iterator( this, m_table + buck );
+    }
+
+    /** Finds an item without notifying the eviction policy.
+     *
+     *  Unlike find(), this method does not write to the table, so it can be
+     *  called concurrently by many readers.
+     */
+    const_iterator peek( const key_type& key, size_t hash ) const
+    {
+        size_t buck = probe( hash, key );
+        if ( buck == m_buckets )
             return m_end_it;
 
-        // else return the iterator to found item
         return iterator( this, m_table + buck );
     }
 
+    /** Looks up @a n keys at once.
+     *
+     *  The keys are hashed and the sets they map to are prefetched
+     *  MM_PREFETCH_BATCH at a time, before any of them is searched, so the
+     *  cache misses of the lookups overlap instead of being paid one after
+     *  the other. This pays off when the table is much bigger than the
+     *  cache.
+     *
+     *  @param keys the keys to look for
+     *  @param n the number of keys
+     *  @param out receives, for each key, the iterator to the item or
+     *         end()
+     */
+    void find_batch( const key_type* keys, size_type n, iterator* out )
+    {
+        size_t hashes[ MM_PREFETCH_BATCH ];
+        for ( size_type base = 0; base < n; base += MM_PREFETCH_BATCH )
+        {
+            const size_type count = std::min<size_type>( n - base,
+                                                         MM_PREFETCH_BATCH );
+            for ( size_type i = 0; i < count; ++i )
+            {
+                hashes[ i ] = m_hasher( keys[ base + i ] );
+                prefetch( hashes[ i ] );
+            }
+
+            for ( size_type i = 0; i < count; ++i )
+                out[ base + i ] = find( keys[ base + i ], hashes[ i ] );
+        }
+    }
+
+    void find_batch( const key_type* keys, size_type n,
+                     const_iterator* out ) const
+    {
+        size_t hashes[ MM_PREFETCH_BATCH ];
+        for ( size_type base = 0; base < n; base += MM_PREFETCH_BATCH )
+        {
+            const size_type count = std::min<size_type>( n - base,
+                                                         MM_PREFETCH_BATCH );
+            for ( size_type i = 0; i < count; ++i )
+            {
+                hashes[ i ] = m_hasher( keys[ base + i ] );
+                prefetch( hashes[ i ] );
+            }
+
+            for ( size_type i = 0; i < count; ++i )
+                out[ base + i ] = find( keys[ base + i ], hashes[ i ] );
+        }
+    }
+
+    /** Brings in cache the set that the hash value maps to.
+     *
+     *  The tags and the first and last bytes of the buckets of the set are
+     *  prefetched: that is the whole set for small items and few ways.
+     */
+    void prefetch( size_t hash ) const
+    {
+        const size_t first = set_start( hash );
+        __builtin_prefetch( m_tags + first );
+        __builtin_prefetch( m_table + first );
+        __builtin_prefetch( reinterpret_cast<const char*>(
+                                m_table + first + Ways ) - 1 );
+        if ( m_epochs )
+            __builtin_prefetch( m_epochs + ( hash & m_mask ) );
+    }
+
+    /** Prefetches the buckets of the set whose tag matches the hash value.
+     *
+     *  To be called after prefetch(), once the tags are in cache, for
+     *  sets that prefetch() does not bring entirely in cache.
+     *
+     *  @return true if some bucket has been prefetched, false if the key is
+     *          certainly not in the table or the set was already entirely
+     *          prefetched by prefetch()
+     */
+    bool prefetch_matches( size_t hash ) const
+    {
+        // prefetch() covers the whole set if it spans two cache lines at
+        // most
+        if ( Ways * sizeof(value_type) <= 64 )
+            return false;
+
+        const size_t first = set_start( hash );
+        unsigned int match = match_tags<Ways>( m_tags + first,
+                                               tag_of( hash ) );
+        if ( match == 0 )
+            return false;
+
+        for ( ; match != 0; match &= match - 1 )
+            __builtin_prefetch( m_table + first + __builtin_ctz( match ) );
+        return true;
+    }
+
     value_type& find_or_insert( const key_type& key )
     {
-        size_t buck = m_hasher( key ) & m_mask;
-        key_type& table_key = m_key_extract( m_table[ buck ] );
+        return find_or_insert( key, m_hasher( key ) );
+    }
+
+    value_type& find_or_insert( key_type&& key )
+    {
+        const size_t hash = m_hasher( key );
+        return find_or_insert( std::move( key ), hash );
+    }
+
+    value_type& find_or_insert( const key_type& key, size_t hash )
+    {
+        return find_or_insert_key( key, hash );
+    }
+
+    value_type& find_or_insert( key_type&& key, size_t hash )
+    {
+        return find_or_insert_key( std::move( key ), hash );
+    }
+
+private:
+    template <class K>
+    value_type& find_or_insert_key( K&& key, size_t hash )
+    {
+        bool found;
+        size_t buck = insert_position( hash, key, found, false );
         
-        if ( ! m_key_equal( key, table_key ) )
+        if ( ! found )
         {            
             // The bucket is either empty or it contains another item.  In
             // this case we have to mark it as discarded, because we cannot
             // know how the reference will be used ( probably to overwrite
             // the item with a new one that has a different key ).
-            if ( ! m_key_equal( table_key, m_empty_key ) )
+            if ( m_tags[ buck ] != 0 )
             {
                 // The bucket already contained an item. This item is
                 // discarded and replaced with an empty one. The destructor
                 // is called on it.
                 // The m_num_elements does not change because 
-                m_discard( m_table[ buck ], m_empty_value );
+                m_discard( std::move( m_table[ buck ] ), m_empty_value );
                 _Destroy( m_table + buck );
-                reset_value( m_table + buck );
             }
             else
             {
@@ -656,20 +1120,86 @@ public:
                 ++m_num_elements;
             }
 
-            // Set the key in the empty item
-            _Construct( &table_key, key );
+            // Build a default item and set its key
+            _Construct( m_table + buck );
+            m_key_extract( m_table[ buck ] ) = std::forward<K>( key );
+            occupy( buck, hash );
         }
 
+        stored( buck, found );
+
         // Returns the reference to the found or recently added item
         return m_table[ buck ];
     }
-    
+
+    template <class V>
+    pair<iterator,bool> insert_value( V&& obj, size_t hash )
+    {
+        const key_type& obj_key = m_key_extract( obj );
+        bool found;
+        const size_t buck = insert_position( hash, obj_key, found, true );
+
+        if ( buck == m_buckets )
+        {
+            // The eviction policy did not admit the new item
+            return pair<iterator,bool>( m_end_it, false );
+        }
+
+        store( buck, hash, found, std::forward<V>( obj ) );
+        return pair<iterator,bool>( iterator( this, m_table + buck ), true );
+    }
+
+    /** Stores an item in a bucket, copying or moving it.
+     *
+     *  If the bucket hosts an item with the same key (@a found), the new
+     *  item is assigned to it. If it hosts another item, that item is
+     *  evicted: it is handed over (as an rvalue) to the discard function,
+     *  together with the new item.
+     */
+    template <class V>
+    void store( size_t buck, size_t hash, bool found, V&& obj )
+    {
+        if ( found )
+        {
+            // Same key: update the item in place, nothing is discarded
+            ++m_num_overwrites;
+            m_table[ buck ] = std::forward<V>( obj );
+            m_policy.on_hit( buck );
+            return;
+        }
+
+        if ( m_tags[ buck ] != 0 )
+        {
+            // The set is full and the item in the bucket was chosen as
+            // victim.  Element is discarded.
+            ++m_num_collisions;
+
+            // Notify that the item will be discarded, to allow a policy to
+            // do something useful with it.
+            m_discard( std::move( m_table[ buck ] ), obj );
+            _Destroy( m_table + buck );
+        }
+        else
+            ++m_num_elements;
+
+        // Move or copy the object into the hash table.
+        _Construct( m_table + buck, std::forward<V>( obj ) );
+        occupy( buck, hash );
+        stored( buck, found );
+    }
+
+public:
     size_type erase( const key_type& key )
     {
-        iterator it = find( key );
-        if ( it != m_end_it )
+        return erase( key, m_hasher( key ) );
+    }
+
+    size_type erase( const key_type& key, size_t hash )
+    {
+        const size_t buck = probe( hash, key );
+        if ( buck != m_buckets )
         {
-            erase( it );
+            erase( iterator( this, m_table + buck ) );
             return 1;
         }
             
@@ -678,11 +1208,11 @@ public:
         
     void erase( const iterator& it )
     {
-        if (    it != m_end_it
-             && ! m_key_equal( m_key_extract( *it ), m_empty_key ) )
+        if ( it != m_end_it && ! is_empty_key( it.m_pos ) )
         {
             _Destroy( &* it );
-            reset_value( it.m_pos );
+            vacate( it.m_pos - m_table );
+            m_policy.on_erase( it.m_pos - m_table );
             --m_num_elements;
         }
     }
@@ -696,9 +1226,8 @@ public:
         
     void erase( iterator first, iterator last )
     {
-        m_num_elements -= mm::distance( first, last );
-        _Destroy( first, last );
-        std::uninitialized_fill( first, last, m_empty_value );
+        for ( ; first != last; ++first )
+            erase( first );
     }
     
     void erase( const_iterator first, const_iterator last )
@@ -710,9 +1239,40 @@ public:
              );
     }
 
+    /** Erases all the items of a set.
+     *
+     *  The items are destroyed without reading their keys: used to drop a
+     *  set whose contents may be inconsistent, like one left half written
+     *  by a process that died (see shared_cache_map).
+     *
+     *  @param set the index of the set, as returned by set_index()
+     *  @return the number of erased items
+     */
+    size_type erase_set( size_type set )
+    {
+        reclaim_if_stale( set );
+
+        size_type n = 0;
+        const size_t first = set * Ways;
+        for ( size_t buck = next_bit( first ); buck < first + Ways;
+              buck = next_bit( buck + 1 ) )
+        {
+            _Destroy( m_table + buck );
+            m_policy.on_erase( buck );
+            ++n;
+        }
+
+        // The tags of the buckets not marked as used are cleared too
+        for ( size_t buck = first; buck < first + Ways; ++buck )
+            vacate( buck );
+
+        m_num_elements -= n;
+        return n;
+    }
+
     void resize( size_type size )
     {
-        size_t new_size = round_to_power2( size );
+        size_t new_size = std::max( round_to_power2( size ), Ways );
         size_t old_size = m_buckets;
 
         if ( new_size == old_size )
@@ -720,26 +1280,56 @@ public:
             // Do nothing
             return;
         }
-        else if ( new_size < old_size )
+
+        // The stale items are not moved to the new table
+        const bool lazy_clear = ( m_epochs != 0 );
+        if ( lazy_clear )
+        {
+            sweep( set_count() );
+            disable_lazy_clear();
+        }
+
+        if ( new_size < old_size )
         {
             // The new table will be smaller, so there's no need to rehash
-            // all the items.
+            // all the items: the sets that fit in the new table keep the
+            // same position.
             value_type* new_table;
-            new_table = m_allocator.allocate( new_size * ItemSize );
+            new_table = m_allocator.allocate( new_size );
+            unsigned char* new_tags;
+            new_tags = m_tag_allocator.allocate( new_size );
+            bitmap_word* new_occupied;
+            new_occupied = m_bitmap_allocator.allocate(
+                bitmap_words( new_size ) );
 
             // Copy the elements that fit into the new table and destroy
             // those that doesn't fit.  Plain old memcpy seems to have much
             // less problems with types than std::copy..
             std::memcpy( new_table, m_table, new_size * ItemSize );
+            std::memcpy( new_tags, m_tags, new_size );
+            std::memcpy( new_occupied, m_occupied,
+                         bitmap_words( new_size ) * sizeof(bitmap_word) );
+            if ( new_size < 64 )
+                new_occupied[ 0 ] &= ( 1ULL << new_size ) - 1;
             _Destroy( iterator( this, m_table + new_size, true ), m_end_it );
 
             m_allocator.deallocate( m_table, old_size );
+            m_tag_allocator.deallocate( m_tags, old_size );
+            m_bitmap_allocator.deallocate( m_occupied,
+                                           bitmap_words( old_size ) );
             m_table = new_table;
+            m_tags = new_tags;
+            m_occupied = new_occupied;
             
             m_end_marker = m_table + new_size;
             m_end_it = iterator( this, m_end_marker );
             m_buckets = new_size;
-            m_mask = m_buckets - 1;
+            m_mask = m_buckets / Ways - 1;
+
+            // The usage history of the items is lost
+            m_policy.init( m_buckets, Ways );
+            for ( const_iterator it = begin(); it != m_end_it; ++it )
+                m_policy.on_insert( it.m_pos - m_table );
 
             // Re-count the number of elements.
             m_num_elements = 0;
@@ -750,19 +1340,276 @@ public:
         {
             // Creates a new table and re-insert all the items, with
             // new buckets.
-            cache_table other( new_size, m_hasher, m_key_equal );
+            cache_table other( new_size, m_hasher, m_key_equal, m_allocator );
             other.set_empty_value( m_empty_value );
             swap( other );
             insert( other.begin(), other.end() );
         }
+
+        if ( lazy_clear )
+            enable_lazy_clear();
     }
 
+    /** Erases all the items.
+     *
+     *  With lazy clear enabled this is O(1): the items are destroyed later,
+     *  when their set is used again or by sweep().
+     */
     void clear()
     {
-        // Call the destructor for all objects and reinitialize the memory.
-        _Destroy( begin(), end() );
-        initialize_memory();
         m_num_elements = 0;
+        if ( m_epochs && m_epoch != epoch_type( -1 ) )
+        {
+            ++m_epoch;
+            m_sweep_set = 0;
+            return;
+        }
+
+        // Call the destructor for all the objects, visiting only the used
+        // buckets. When the epoch number wraps around, the old epochs of
+        // the sets would be valid again: every item is destroyed instead.
+        destroy_all();
+        if ( m_epochs )
+        {
+            std::fill( m_epochs, m_epochs + set_count(), epoch_type( 0 ) );
+            m_epoch = 0;
+        }
+    }
+
+    /** Makes clear() O(1).
+     *
+     *  Every set gets an epoch number, and clear() just increments the
+     *  current epoch: the sets of older epochs read as empty, and their
+     *  stale items are destroyed (and passed to the eviction policy as
+     *  erased) when the set is used again by an insertion, or by sweep().
+     *  Lookups have to read the epoch of the set, too.
+     */
+    void enable_lazy_clear()
+    {
+        if ( m_epochs )
+            return;
+
+        m_epochs = m_epoch_allocator.allocate( set_count() );
+        if ( ! allocates_zeroed<Allocator>::value )
+            std::fill( m_epochs, m_epochs + set_count(), epoch_type( 0 ) );
+        m_epoch = 0;
+        m_sweep_set = set_count();
+    }
+
+    /// Tells whether clear() is O(1)
+    bool lazy_clear() const { return m_epochs != 0; }
+
+    /** Destroys the stale items left by clear(), a few sets at a time.
+     *
+     *  Meant to be called periodically (eg: by a background maintenance
+     *  task, holding the same lock of the other writers) so that the
+     *  memory held by the stale items is released without waiting for
+     *  their sets to be reused.
+     *
+     *  @param max_sets the maximum number of sets to be swept
+     *  @return true if there are no more stale items
+     */
+    bool sweep( size_type max_sets )
+    {
+        if ( ! m_epochs )
+            return true;
+
+        const size_t sets = set_count();
+        for ( ; m_sweep_set < sets && max_sets > 0; ++m_sweep_set, --max_sets )
+            reclaim_if_stale( m_sweep_set );
+
+        return m_sweep_set == sets;
+    }
+
+    // SNAPSHOTS
+
+    /** Writes all the items to a file (see snapshot.hpp).
+     *
+     *  @param path the file to be written
+     *  @param s    the serializer of the items
+     *  @return false on I/O errors
+     */
+    template <class Serializer>
+    bool save( const char* path, const Serializer& s ) const
+    {
+        FILE* f = fopen( path, "wb" );
+        if ( ! f )
+            return false;
+
+        const bool saved = save( f, s );
+        return ( fclose( f ) == 0 ) && saved;
+    }
+
+    /** Writes all the items to an open file.
+     *
+     *  With a raw serializer, the occupancy bitmap, the tags and the
+     *  buckets are written as they are, each with a single call. Otherwise
+     *  the items are written one at a time.
+     *
+     *  @param f the file, open for writing
+     *  @param s the serializer of the items
+     *  @return false on I/O errors
+     */
+    template <class Serializer>
+    bool save( FILE* f, const Serializer& s ) const
+    {
+        // Sample a few items, spread over the table
+        size_t check[ 16 ];
+        size_t checked = 0;
+        for ( size_t i = 0; i < 16; ++i )
+        {
+            const size_t buck = next_occupied( i * ( m_buckets / 16 ) );
+            if ( buck < m_buckets && ( checked == 0
+                                       || buck != check[ checked - 1 ] ) )
+                check[ checked++ ] = buck;
+        }
+
+        snapshot_header h;
+        std::memcpy( h.magic, snapshot_magic, sizeof( h.magic ) );
+        h.raw = Serializer::raw;
+        h.buckets = m_buckets;
+        h.ways = Ways;
+        h.item_size = ItemSize;
+        h.items = m_num_elements;
+        h.has_empty = m_empty_key_is_set;
+        h.check_items = checked;
+        h.check_hash = 0;
+        for ( size_t i = 0; i < checked; ++i )
+            h.check_hash = h.check_hash * 31
+                + m_hasher( m_key_extract( m_table[ check[ i ] ] ) );
+
+        if ( fwrite( &h, sizeof( h ), 1, f ) != 1 )
+            return false;
+        if ( m_empty_key_is_set && ! s.write( f, m_empty_value ) )
+            return false;
+
+        if ( ! Serializer::raw )
+        {
+            for ( size_t buck = next_occupied( 0 ); buck < m_buckets;
+                  buck = next_occupied( buck + 1 ) )
+                if ( ! s.write( f, m_table[ buck ] ) )
+                    return false;
+
+            return true;
+        }
+
+        // The sampled items come before the arrays, so that the hash
+        // function can be checked before reading them
+        if ( checked == 0 )
+            return true;
+
+        for ( size_t i = 0; i < checked; ++i )
+            if ( fwrite( m_table + check[ i ], ItemSize, 1, f ) != 1 )
+                return false;
+
+        return write_live_bitmap( f )
+            && write_live_tags( f )
+            && fwrite( m_table, ItemSize, m_buckets, f ) == m_buckets;
+    }
+
+    /** Replaces the items with those of a file written by save().
+     *
+     *  A raw snapshot of a table with the same number of buckets and the
+     *  same hash function is read directly into the arrays of the table.
+     *  Otherwise the items are inserted one at a time, so a snapshot can
+     *  be loaded in a table of a different size: when it is smaller, some
+     *  items are evicted.
+     *
+     *  @param path the file to be read
+     *  @param s    the serializer of the items
+     *  @return false if the file is not a snapshot of this type of items,
+     *          and the table is left untouched, or on I/O errors, leaving
+     *          the table with the items read so far
+     */
+    template <class Serializer>
+    bool load( const char* path, const Serializer& s )
+    {
+        FILE* f = fopen( path, "rb" );
+        if ( ! f )
+            return false;
+
+        const bool loaded = load( f, s );
+        fclose( f );
+        return loaded;
+    }
+
+    /** Replaces the items with those of a snapshot in an open file.
+     *  @see load( const char*, const Serializer& )
+     */
+    template <class Serializer>
+    bool load( FILE* f, const Serializer& s )
+    {
+        snapshot_header h;
+        if ( fread( &h, sizeof( h ), 1, f ) != 1
+             || std::memcmp( h.magic, snapshot_magic, sizeof( h.magic ) )
+             || h.raw != Serializer::raw
+             || h.item_size != ItemSize
+             || h.ways == 0 || h.buckets % h.ways != 0
+             || h.check_items > 16 )
+            return false;
+
+        value_type empty_value( m_empty_value );
+        if ( h.has_empty && ! s.read( f, empty_value ) )
+            return false;
+
+        // Items of raw types are read in a buffer of raw memory, allocated
+        // apart from the table: the allocator of the table may have no room
+        // left (see mapped_file_allocator)
+        std::allocator<value_type> buffer_allocator;
+        const size_t chunk = 4096;
+        value_type* buffer = 0;
+        if ( Serializer::raw && h.check_items != 0 )
+        {
+            buffer = buffer_allocator.allocate( chunk );
+            if ( fread( buffer, ItemSize, h.check_items, f )
+                 != h.check_items )
+            {
+                buffer_allocator.deallocate( buffer, chunk );
+                return false;
+            }
+        }
+
+        // The snapshot is valid: start from an empty table, without stale
+        // items
+        destroy_all();
+        m_num_elements = 0;
+        if ( m_epochs )
+        {
+            std::fill( m_epochs, m_epochs + set_count(), m_epoch );
+            m_sweep_set = set_count();
+        }
+
+        if ( h.has_empty && ! m_empty_key_is_set )
+            set_empty_value( empty_value );
+
+        bool loaded = true;
+        if ( ! Serializer::raw )
+        {
+            for ( uint64_t i = 0; loaded && i < h.items; ++i )
+            {
+                value_type obj( m_empty_value );
+                loaded = s.read( f, obj );
+                if ( loaded )
+                    insert( std::move( obj ) );
+            }
+        }
+        else if ( buffer )
+        {
+            uint64_t check_hash = 0;
+            for ( size_t i = 0; i < h.check_items; ++i )
+                check_hash = check_hash * 31
+                    + m_hasher( m_key_extract( buffer[ i ] ) );
+
+            if ( h.buckets == m_buckets && h.ways == Ways
+                 && check_hash == h.check_hash )
+                loaded = load_arrays( f );
+            else
+                loaded = load_items( f, h.buckets, buffer, chunk );
+
+            buffer_allocator.deallocate( buffer, chunk );
+        }
+
+        return loaded;
     }
 
     // Iterator functions
@@ -777,6 +1624,30 @@ public:
     bool empty()             const { return size() == 0; }
     
     size_type num_collisions() const { return m_num_collisions; }
+    size_type num_overwrites() const { return m_num_overwrites; }
+
+    /// Counts an item updated in place by the container, after finding its
+    /// key (see cache_map::insert_or_assign())
+    void count_overwrite() { ++m_num_overwrites; }
+
+    size_type set_count()    const { return m_buckets / Ways; }
+
+    /// Number of items in a set, as returned by set_index()
+    size_type set_size( size_type set ) const
+    {
+        if ( is_stale( set ) )
+            return 0;
+
+        size_type n = 0;
+        const size_t first = set * Ways;
+        for ( size_t buck = next_bit( first ); buck < first + Ways;
+              buck = next_bit( buck + 1 ) )
+            ++n;
+        return n;
+    }
+
+    /// Index of the set where the keys with the given hash value are stored
+    size_type set_index( size_t hash ) const { return hash & m_mask; }
 
     // Comparison
     bool operator==( const cache_table& other ) const
@@ -795,16 +1666,26 @@ public:
         std::swap( m_key_equal,        other.m_key_equal        );
         std::swap( m_key_extract,      other.m_key_extract      );
         std::swap( m_allocator,        other.m_allocator        );
+        std::swap( m_tag_allocator,    other.m_tag_allocator    );
+        std::swap( m_bitmap_allocator, other.m_bitmap_allocator );
         std::swap( m_mask,             other.m_mask             );
         std::swap( m_buckets,          other.m_buckets          );
         std::swap( m_num_elements,     other.m_num_elements     );
         std::swap( m_num_collisions,   other.m_num_collisions   );
+        std::swap( m_num_overwrites,   other.m_num_overwrites   );
         std::swap( m_empty_key_is_set, other.m_empty_key_is_set );
         std::swap( m_table,            other.m_table            );
+        std::swap( m_tags,             other.m_tags             );
+        std::swap( m_occupied,         other.m_occupied         );
+        std::swap( m_epoch_allocator,  other.m_epoch_allocator  );
+        std::swap( m_epochs,           other.m_epochs           );
+        std::swap( m_epoch,            other.m_epoch            );
+        std::swap( m_sweep_set,        other.m_sweep_set        );
         std::swap( m_empty_key,        other.m_empty_key        );
         std::swap( m_empty_value,      other.m_empty_value      );
         std::swap( m_end_marker,       other.m_end_marker       );
         std::swap( m_end_it,           other.m_end_it           );
+        std::swap( m_policy,           other.m_policy           );
     }
         
 private:
@@ -812,30 +1693,343 @@ private:
     /// Array item size
     static const size_t ItemSize = sizeof(value_type);
 
-    /// Initialize the whole hash table with the empty value
+    /// Marks all the buckets as empty. The buckets themselves are left
+    /// uninitialized. Memory that comes zero-filled from the allocator is
+    /// not written at all, so that its pages are only touched when used.
     void initialize_memory()
     {
-        std::uninitialized_fill( m_table,
-                                 m_table + m_buckets,
-                                 m_empty_value );
+        if ( ! allocates_zeroed<Allocator>::value )
+        {
+            std::memset( m_tags, 0, m_buckets );
+            std::memset( m_occupied, 0,
+                         bitmap_words( m_buckets ) * sizeof(bitmap_word) );
+        }
+        m_policy.init( m_buckets, Ways );
+    }
+
+    /// Number of words of the occupancy bitmap of @a buckets buckets
+    static size_t bitmap_words( size_t buckets )
+    {
+        return ( buckets + 63 ) / 64;
+    }
+
+    /// Marks a bucket as used by an item with the given hash value
+    void occupy( size_t buck, size_t hash )
+    {
+        m_policy.on_store( buck, hash );
+        m_tags[ buck ] = tag_of( hash );
+        m_occupied[ buck / 64 ] |= 1ULL << ( buck % 64 );
+    }
+
+    /// Marks a bucket as empty
+    void vacate( size_t buck )
+    {
+        m_tags[ buck ] = 0;
+        m_occupied[ buck / 64 ] &= ~( 1ULL << ( buck % 64 ) );
+    }
+
+    /** Finds the first bucket holding an object, starting from @a buck.
+     *
+     *  @return the index of the bucket, or @p m_buckets if there are no
+     *          more used buckets
+     */
+    size_t next_bit( size_t buck ) const
+    {
+        if ( buck >= m_buckets )
+            return m_buckets;
+
+        const size_t words = bitmap_words( m_buckets );
+        size_t w = buck / 64;
+        bitmap_word bits = m_occupied[ w ] & ( ~0ULL << ( buck % 64 ) );
+        while ( bits == 0 )
+        {
+            if ( ++w == words )
+                return m_buckets;
+            bits = m_occupied[ w ];
+        }
+
+        return w * 64 + __builtin_ctzll( bits );
+    }
+
+    /** Finds the first used bucket, starting from @a buck, skipping the
+     *  stale items left by a lazy clear().
+     *
+     *  @return the index of the bucket, or @p m_buckets if there are no
+     *          more used buckets
+     */
+    size_t next_occupied( size_t buck ) const
+    {
+        buck = next_bit( buck );
+        while ( buck < m_buckets && is_stale( buck / Ways ) )
+            buck = next_bit( ( buck / Ways + 1 ) * Ways );
+
+        return buck;
+    }
+
+    /// Tells whether the items of a set have been cleared by a lazy clear()
+    bool is_stale( size_t set ) const
+    {
+        return m_epochs && m_epochs[ set ] != m_epoch;
+    }
+
+    /// Destroys the stale items of a set and brings it to the current epoch
+    void reclaim_if_stale( size_t set )
+    {
+        if ( ! is_stale( set ) )
+            return;
+
+        const size_t first = set * Ways;
+        for ( size_t buck = next_bit( first ); buck < first + Ways;
+              buck = next_bit( buck + 1 ) )
+        {
+            _Destroy( m_table + buck );
+            vacate( buck );
+            m_policy.on_erase( buck );
+        }
+
+        m_epochs[ set ] = m_epoch;
+    }
+
+    /// Destroys all the objects in the table, including the stale ones
+    void destroy_all()
+    {
+        for ( size_t buck = next_bit( 0 ); buck < m_buckets;
+              buck = next_bit( buck + 1 ) )
+        {
+            _Destroy( m_table + buck );
+            m_tags[ buck ] = 0;
+            m_policy.on_erase( buck );
+        }
+
+        std::memset( m_occupied, 0,
+                     bitmap_words( m_buckets ) * sizeof(bitmap_word) );
+    }
+
+    /// Word @a w of the occupancy bitmap, without the stale sets
+    bitmap_word live_bits( size_t w ) const
+    {
+        bitmap_word bits = m_occupied[ w ];
+        if ( ! m_epochs )
+            return bits;
+
+        const bitmap_word set_bits = ( 1ULL << Ways ) - 1;
+        const size_t last = std::min( w * 64 + 64, m_buckets );
+        for ( size_t buck = w * 64; buck < last; buck += Ways )
+            if ( is_stale( buck / Ways ) )
+                bits &= ~( set_bits << ( buck % 64 ) );
+
+        return bits;
+    }
+
+    /// Writes the occupancy bitmap without the stale sets
+    bool write_live_bitmap( FILE* f ) const
+    {
+        bitmap_word buffer[ 1024 ];
+        const size_t words = bitmap_words( m_buckets );
+        for ( size_t w = 0; w < words; w += 1024 )
+        {
+            const size_t n = std::min( words - w, size_t( 1024 ) );
+            for ( size_t i = 0; i < n; ++i )
+                buffer[ i ] = live_bits( w + i );
+            if ( fwrite( buffer, sizeof(bitmap_word), n, f ) != n )
+                return false;
+        }
+
+        return true;
+    }
+
+    /// Writes the tags, with the tags of the stale sets cleared
+    bool write_live_tags( FILE* f ) const
+    {
+        if ( ! m_epochs )
+            return fwrite( m_tags, 1, m_buckets, f ) == m_buckets;
+
+        unsigned char buffer[ 64 * 1024 ];
+        for ( size_t first = 0; first < m_buckets; first += sizeof(buffer) )
+        {
+            const size_t n = std::min( m_buckets - first, sizeof(buffer) );
+            for ( size_t i = 0; i < n; i += 64 )
+            {
+                const bitmap_word bits = live_bits( ( first + i ) / 64 );
+                for ( size_t j = 0; j < 64 && i + j < n; ++j )
+                    buffer[ i + j ] = ( bits >> j & 1 )
+                        ? m_tags[ first + i + j ] : 0;
+            }
+            if ( fwrite( buffer, 1, n, f ) != n )
+                return false;
+        }
+
+        return true;
     }
 
-    void reset_value( pointer pos )
+    /// Reads the arrays of a raw snapshot of a table with the same layout
+    bool load_arrays( FILE* f )
     {
-        std::memcpy( pos, &m_empty_value, ItemSize );
+        const size_t words = bitmap_words( m_buckets );
+        if ( fread( m_occupied, sizeof(bitmap_word), words, f ) != words
+             || fread( m_tags, 1, m_buckets, f ) != m_buckets
+             || fread( m_table, ItemSize, m_buckets, f ) != m_buckets )
+        {
+            std::memset( m_tags, 0, m_buckets );
+            std::memset( m_occupied, 0, words * sizeof(bitmap_word) );
+            return false;
+        }
+
+        adopt_items();
+        return true;
     }
 
-    /// Compares the key with the empty key
-    bool is_empty_key( const_pointer& pos ) const
+    /// Reads the arrays of a raw snapshot of a table with @a buckets
+    /// buckets, and inserts its items
+    bool load_items( FILE* f, size_t buckets, value_type* buffer,
+                     size_t chunk )
     {
-        return m_key_equal( m_key_extract( *pos ), m_empty_key );
+        std::vector<bitmap_word> occupied( bitmap_words( buckets ) );
+        if ( fread( &occupied[ 0 ], sizeof(bitmap_word), occupied.size(), f )
+             != occupied.size() )
+            return false;
+
+        // Skip the tags
+        for ( size_t done = 0; done < buckets; )
+        {
+            const size_t n = std::min( buckets - done, chunk * ItemSize );
+            if ( fread( buffer, 1, n, f ) != n )
+                return false;
+            done += n;
+        }
+
+        for ( size_t first = 0; first < buckets; first += chunk )
+        {
+            const size_t n = std::min( buckets - first, chunk );
+            if ( fread( buffer, ItemSize, n, f ) != n )
+                return false;
+
+            for ( size_t i = 0; i < n; ++i )
+            {
+                const size_t buck = first + i;
+                if ( occupied[ buck / 64 ] >> ( buck % 64 ) & 1 )
+                    insert( buffer[ i ] );
+            }
+        }
+
+        return true;
     }
 
-    bool is_empty_key( pointer& pos ) const
+    void disable_lazy_clear()
     {
-        return m_key_equal( m_key_extract( *pos ), m_empty_key );
+        if ( m_epochs )
+            m_epoch_allocator.deallocate( m_epochs, set_count() );
+        m_epochs = 0;
+    }
+
+    /// Tells whether the bucket is empty, looking at its tag
+    bool is_empty_key( const_pointer pos ) const
+    {
+        return m_tags[ pos - m_table ] == 0;
+    }
+
+    /// Tag of the items with the given hash value. It is never 0, which
+    /// marks empty buckets.
+    static unsigned char tag_of( size_t hash )
+    {
+        const unsigned char tag = hash >> ( ( sizeof(size_t) - 1 ) * 8 );
+        return tag + ( tag == 0 );
     }
         
+    /// Sets the number of buckets (at least one set) and the set mask
+    void set_bucket_count( size_type n )
+    {
+        m_buckets = std::max( round_to_power2( n ), Ways );
+        m_mask = m_buckets / Ways - 1;
+    }
+
+    /// Index of the first bucket of the set the hash value maps to
+    size_t set_start( size_t hash ) const
+    {
+        return ( hash & m_mask ) * Ways;
+    }
+
+    /** Looks for the bucket hosting @a key.
+     *
+     *  Only the buckets of the set whose tag matches are compared with
+     *  @a key.
+     *
+     *  @param hash the hash value of the key
+     *  @param key the key to look for
+     *  @return the index of the bucket, or @p m_buckets if the key is not
+     *          in the table
+     */
+    size_t probe( size_t hash, const key_type& key ) const
+    {
+        if ( is_stale( hash & m_mask ) )
+            return m_buckets;
+
+        const size_t first = set_start( hash );
+        unsigned int match = match_tags<Ways>( m_tags + first,
+                                               tag_of( hash ) );
+        for ( ; match != 0; match &= match - 1 )
+        {
+            const size_t i = first + __builtin_ctz( match );
+            if ( m_key_equal( m_key_extract( m_table[ i ] ), key ) )
+                return i;
+        }
+
+        return m_buckets;
+    }
+
+    /** Chooses the bucket where an item with @a key has to be stored.
+     *
+     *  That is the bucket already hosting the same key, or the first empty
+     *  bucket of the set, or a victim when the set is full. The eviction
+     *  policy may not admit the new item in the full set.
+     *
+     *  @param hash the hash value of the key
+     *  @param key the key of the item to be stored
+     *  @param found set to true if the bucket already hosts @a key
+     *  @param may_reject if false, the item is stored in place of the
+     *         victim even if the policy does not admit it
+     *  @return the index of the bucket, or @p m_buckets if the item was not
+     *          admitted
+     */
+    size_t insert_position( size_t hash, const key_type& key, bool& found,
+                            bool may_reject )
+    {
+        m_policy.on_access( hash );
+        reclaim_if_stale( hash & m_mask );
+
+        const size_t buck = probe( hash, key );
+        found = ( buck != m_buckets );
+        if ( found )
+            return buck;
+
+        const size_t first = set_start( hash );
+        const unsigned int empty = match_tags<Ways>( m_tags + first, 0 );
+        if ( empty != 0 )
+            return first + __builtin_ctz( empty );
+
+        const size_t way = m_policy.victim( first );
+        const size_t admitted = m_policy.admit( first, way, hash,
+                                                bucket_hasher( this ) );
+        if ( admitted < Ways )
+            return first + admitted;
+
+        return may_reject ? m_buckets : first + way;
+    }
+
+    /// Computes the hash value of the item stored in a bucket
+    struct bucket_hasher
+    {
+        explicit bucket_hasher( const cache_table* ht ) : m_ht( ht ) {}
+
+        size_t operator() ( size_t buck ) const
+        {
+            return m_ht->m_hasher(
+                m_ht->m_key_extract( m_ht->m_table[ buck ] ) );
+        }
+
+        const cache_table* m_ht;
+    };
+
     /// Round the number to the next power of 2.
     static size_t round_to_power2( size_t n )
     {
@@ -847,23 +2041,31 @@ private:
     }
 
     friend class cache_table_iterator< Value, Key, DiscardFunction,
-                                       HashFunction, KeyEqual, KeyExtract,
-                                       Allocator >;
+                                       EvictionPolicy, HashFunction,
+                                       KeyEqual, KeyExtract, Allocator,
+                                       Ways >;
     friend class cache_table_const_iterator< Value, Key, DiscardFunction,
-                                             HashFunction, KeyEqual,
-                                             KeyExtract, Allocator >;
+                                             EvictionPolicy, HashFunction,
+                                             KeyEqual, KeyExtract, Allocator,
+                                             Ways >;
         
     // Internal data 
         
     size_t m_buckets;          ///< Number of buckets in the hash table
-    size_t m_mask;             ///< Mask used to calculate bucket
+    size_t m_mask;             ///< Mask used to calculate the set
     size_t m_num_elements;     ///< Number of elements in the table
-    size_t m_num_collisions;   ///< Number of collisions
+    size_t m_num_collisions;   ///< Number of items evicted by others
+    size_t m_num_overwrites;   ///< Number of items replaced by same key
     bool   m_empty_key_is_set; ///< Tells whether the empty key has been set
 
     value_type* m_table;       ///< The 'real' hash table array     
-    key_type    m_empty_key;   ///< The key value that identifies empty items
-    value_type  m_empty_value; ///< The value that identifies empty items
+    unsigned char* m_tags;     ///< Tags of the buckets (0 means empty)
+    bitmap_word* m_occupied;   ///< One bit for each used bucket
+    epoch_type* m_epochs;      ///< Epoch of each set, with lazy clear
+    epoch_type  m_epoch;       ///< Current epoch
+    size_t      m_sweep_set;   ///< Next set to be swept
+    key_type    m_empty_key;   ///< Key of m_empty_value
+    value_type  m_empty_value; ///< The value set by set_empty_value()
     value_type* m_end_marker;  ///< Pointer to the end of the table
     iterator    m_end_it;      ///< value of end()
 };
@@ -871,9 +2073,10 @@ private:
 /**
  * @relates cache_table
  */
-template <class V, class K, class DF, class HF, class KEq, class KEx, class A>
-inline void swap( cache_table<V,K,DF,HF,KEq,KEx,A>& ht1, 
-                  cache_table<V,K,DF,HF,KEq,KEx,A>& ht2 )
+template <class V, class K, class DF, class EP, class HF, class KEq, class KEx,
+          class A, size_t W>
+inline void swap( cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>& ht1, 
+                  cache_table<V,K,DF,EP,HF,KEq,KEx,A,W>& ht2 )
 {
     ht1.swap( ht2 );
 }
@@ -0,0 +1,466 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _CONCURRENT_CACHE_MAP_HPP_
+#define _CONCURRENT_CACHE_MAP_HPP_
+
+#include "cache_map.hpp"
+#include "locks.hpp"
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <shared_mutex>
+#include <vector>
+
+/// Default number of shards of the concurrent containers.
+#define MM_DEFAULT_SHARDS 64
+
+/// Maximum number of shards of the concurrent containers.
+#define MM_MAX_SHARDS 256
+
+namespace mm
+{
+
+/** Concurrent cache map
+ *
+ *  A thread-safe @a map container with a fixed element number. The items
+ *  are distributed over a number of independent cache_table shards, each
+ *  one protected by its own lock, so that threads working on different
+ *  shards do not contend. The shard of a key is chosen with the high bits
+ *  of its hash value multiplied by a large odd constant (Fibonacci
+ *  hashing), so that keys are spread over the shards even with weak hash
+ *  functions.
+ *
+ *  Since other threads can replace an item at any time, no iterators nor
+ *  references to the items are given away: find() copies the data out of
+ *  the map while holding the lock.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  The parameters are the same of cache_map, plus:
+ *
+ *  - @a Lock : The lock of each shard: spin_lock (the default), rw_lock or
+ *     seq_lock. With rw_lock lookups are done under a shared lock, with
+ *     seq_lock they take no lock at all and are validated by a sequence
+ *     counter of the set they read (see seq_lock for the requirements on
+ *     the key and data types). In both cases lookups do not notify the
+ *     @a EvictionPolicy.
+ *
+ *  The @a DiscardFunction of each shard is called while holding the lock of
+ *  the shard.
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template < class Key,
+           class T,
+           class HashFunction = hash<Key>,
+           class KeyEqual = std::equal_to<Key>,
+           class DiscardFunction = DiscardIgnore< pair<Key,T> >,
+           class Allocator = std::allocator< pair<Key,T> >,
+           size_t Ways = 1,
+           class EvictionPolicy = EvictRandom,
+           class Lock = spin_lock
+>
+class concurrent_cache_map
+{
+private:
+    /// The hash table of each shard
+    typedef cache_table< pair<Key,T>, Key,
+                         DiscardFunction, EvictionPolicy,
+                         HashFunction, KeyEqual,
+                         _Select1st< pair<Key,T> >,
+                         Allocator, Ways
+                       > HT;
+
+public:
+
+    /// The key type
+    typedef typename HT::key_type key_type;
+
+    /// The type of object associated with the keys.
+    typedef T data_type;
+
+    /// The type of object associated with the keys.
+    typedef T mapped_type;
+
+    /// The type of object stored in the map.
+    typedef typename HT::value_type value_type;
+
+    /// The hash function.
+    typedef typename HT::hasher hasher;
+
+    /// Function object that compares keys for equality.
+    typedef typename HT::key_equal key_equal;
+
+    /// An unsigned integral type.
+    typedef typename HT::size_type size_type;
+
+    /// The allocator of the shards.
+    typedef typename HT::allocator_type allocator_type;
+
+    /// The lock type of the shards.
+    typedef Lock lock_type;
+
+private:
+    /// A shard: a lock and the table it protects, on their own cache lines
+    struct alignas( MM_CACHE_LINE_SIZE ) shard
+    {
+        shard( size_type n, const hasher& hash, const key_equal& ke,
+               const allocator_type& alloc )
+            : table( n, hash, ke, alloc )
+        {
+            if ( Lock::is_seq )
+                seq.reset( new seq_counter[ table.set_count() ] );
+        }
+
+        Lock lock;
+        HT   table;
+
+        /// Sequence counters of the sets, only used with seq_lock
+        std::unique_ptr<seq_counter[]> seq;
+    };
+
+    typedef std::lock_guard<Lock>  exclusive_guard;
+    typedef std::shared_lock<Lock> shared_guard;
+
+    /// Exclusive lock of a shard while modifying a single set
+    class write_guard
+    {
+    public:
+        write_guard( shard& s, size_t hash )
+            : m_guard( s.lock ),
+              m_seq( Lock::is_seq
+                     ? &s.seq[ s.table.set_index( hash ) ] : 0 )
+        {
+            if ( m_seq )
+                m_seq->write_begin();
+        }
+
+        ~write_guard()
+        {
+            if ( m_seq )
+                m_seq->write_end();
+        }
+
+    private:
+        exclusive_guard m_guard;
+        seq_counter*    m_seq;
+    };
+
+    /// Exclusive lock of a shard while modifying all of its sets
+    class shard_write_guard
+    {
+    public:
+        shard_write_guard( shard& s )
+            : m_guard( s.lock ),
+              m_shard( s )
+        {
+            if ( Lock::is_seq )
+                for ( size_type i = 0; i < s.table.set_count(); ++i )
+                    s.seq[ i ].write_begin();
+        }
+
+        ~shard_write_guard()
+        {
+            if ( Lock::is_seq )
+                for ( size_type i = 0; i < m_shard.table.set_count(); ++i )
+                    m_shard.seq[ i ].write_end();
+        }
+
+    private:
+        exclusive_guard m_guard;
+        shard&          m_shard;
+    };
+
+public:
+
+    /** Constructor.
+     *
+     *  @param n      the total number of buckets, divided among the shards
+     *  @param shards the number of shards (rounded to a power of 2, up to
+     *                MM_MAX_SHARDS)
+     *  @param hash   the hasher function
+     *  @param ke     the key comparison function
+     *  @param alloc  the allocator of the buckets of all the shards
+     */
+    explicit concurrent_cache_map( size_type n = MM_DEFAULT_TABLE_SIZE,
+                                   size_type shards = MM_DEFAULT_SHARDS,
+                                   const hasher& hash = hasher(),
+                                   const key_equal& ke = key_equal(),
+                                   const allocator_type& alloc =
+                                       allocator_type() )
+        : m_hasher( hash )
+    {
+        size_type count = 1;
+        while ( count < shards && count < MM_MAX_SHARDS )
+            count <<= 1;
+
+        m_mask = count - 1;
+        for ( size_type i = 0; i < count; ++i )
+            m_shards.emplace_back( new shard( n / count, hash, ke, alloc ) );
+    }
+
+    /** Sets the value of the empty key.
+     *
+     *  Not required: the shards keep track of their empty buckets by
+     *  themselves (see cache_map::set_empty_key()).
+     *
+     *  @param key the key value that will be used to identify empty items.
+     */
+    void set_empty_key( const key_type& key )
+    {
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shard_write_guard guard( *m_shards[ i ] );
+            m_shards[ i ]->table.set_empty_value(
+                value_type( key, data_type() ) );
+        }
+    }
+
+    /** Finds the item with the given key and copies its data.
+     *
+     *  @param key  the key of the item
+     *  @param data receives a copy of the data of the item, if found
+     *  @return true if the key was found
+     */
+    bool find( const key_type& key, data_type& data )
+    {
+        const size_t hash = m_hasher( key );
+        shard& s = shard_of( hash );
+
+        if ( Lock::is_seq )
+        {
+            const seq_counter& seq = s.seq[ s.table.set_index( hash ) ];
+            bool found;
+            unsigned int start;
+            do
+            {
+                start = seq.read_begin();
+                typename HT::const_iterator it = s.table.peek( key, hash );
+                found = ( it != s.table.end() );
+                if ( found )
+                    data = it->second;
+            }
+            while ( seq.read_retry( start ) );
+
+            return found;
+        }
+
+        if ( Lock::is_shared )
+        {
+            shared_guard guard( s.lock );
+            typename HT::const_iterator it = s.table.peek( key, hash );
+            if ( it == s.table.end() )
+                return false;
+
+            data = it->second;
+            return true;
+        }
+
+        exclusive_guard guard( s.lock );
+        typename HT::iterator it = s.table.find( key, hash );
+        if ( it == s.table.end() )
+            return false;
+
+        data = it->second;
+        return true;
+    }
+
+    /** Insert an item in the map.
+     *
+     *  In case of a key hash collision, the inserted item will replace the
+     *  existing one, following the @a EvictionPolicy.
+     *
+     *  @return true if the item was inserted, false if the eviction policy
+     *  did not admit it
+     */
+    bool insert( const key_type& key, const data_type& data )
+    {
+        const size_t hash = m_hasher( key );
+        shard& s = shard_of( hash );
+
+        write_guard guard( s, hash );
+        return s.table.insert( value_type( key, data ), hash ).second;
+    }
+
+    /** Insert an item in the map.
+     *  @see insert( const key_type&, const data_type& )
+     */
+    bool insert( const value_type& obj )
+    {
+        return insert( obj.first, obj.second );
+    }
+
+    /** Erases the element identified by the key.
+     *
+     *  @return the number of deleted items, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        const size_t hash = m_hasher( key );
+        shard& s = shard_of( hash );
+
+        write_guard guard( s, hash );
+        return s.table.erase( key, hash );
+    }
+
+    /** Erases all of the elements. */
+    void clear()
+    {
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shard_write_guard guard( *m_shards[ i ] );
+            m_shards[ i ]->table.clear();
+        }
+    }
+
+    /** Makes clear() O(1) for each shard (see cache_map::enable_lazy_clear()).
+     *
+     *  With seq_lock, clear() still has to bump the sequence counter of
+     *  every set.
+     */
+    void enable_lazy_clear()
+    {
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shard_write_guard guard( *m_shards[ i ] );
+            m_shards[ i ]->table.enable_lazy_clear();
+        }
+    }
+
+    /** Destroys the items left by a lazy clear(), a few at a time, holding
+     *  the lock of one shard at a time.
+     *
+     *  @param max_sets the maximum number of sets to be swept in each shard
+     *  @return true if there are no more items to be destroyed
+     */
+    bool sweep( size_type max_sets )
+    {
+        bool done = true;
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shard_write_guard guard( *m_shards[ i ] );
+            done &= m_shards[ i ]->table.sweep( max_sets );
+        }
+
+        return done;
+    }
+
+    /** Get the size of the map.
+     *
+     *  The shards are counted one at a time, so the result is only a
+     *  snapshot while other threads are modifying the map.
+     */
+    size_type size() const
+    {
+        size_type n = 0;
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shared_guard guard( m_shards[ i ]->lock );
+            n += m_shards[ i ]->table.size();
+        }
+
+        return n;
+    }
+
+    /** Test for empty. */
+    bool empty() const { return size() == 0; }
+
+    /** Get the total number of hash key collisions. */
+    size_type num_collisions() const
+    {
+        size_type n = 0;
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shared_guard guard( m_shards[ i ]->lock );
+            n += m_shards[ i ]->table.num_collisions();
+        }
+
+        return n;
+    }
+
+    /** Get the total number of items overwritten by the same key. */
+    size_type num_overwrites() const
+    {
+        size_type n = 0;
+        for ( size_type i = 0; i < m_shards.size(); ++i )
+        {
+            shared_guard guard( m_shards[ i ]->lock );
+            n += m_shards[ i ]->table.num_overwrites();
+        }
+
+        return n;
+    }
+
+    /** Get the total number of buckets. */
+    size_type bucket_count() const
+    {
+        return m_shards.size() * m_shards[ 0 ]->table.bucket_count();
+    }
+
+    /** Get the number of shards. */
+    size_type shard_count() const { return m_shards.size(); }
+
+    /** Returns the hasher object. */
+    hasher hash_funct() const { return m_hasher; }
+
+    /** Returns the allocator of the shards. */
+    allocator_type get_allocator() const
+    {
+        return m_shards[ 0 ]->table.get_allocator();
+    }
+
+private:
+    concurrent_cache_map( const concurrent_cache_map& );
+    concurrent_cache_map& operator= ( const concurrent_cache_map& );
+
+    /// The shard of the key with the given hash value
+    shard& shard_of( size_t hash ) const
+    {
+        const uint64_t spread = hash * 0x9E3779B97F4A7C15ULL;
+        return *m_shards[ ( spread >> 56 ) & m_mask ];
+    }
+
+    HashFunction                         m_hasher; ///< Hasher of all shards
+    std::vector< std::unique_ptr<shard> > m_shards; ///< The shards
+    size_t                               m_mask;   ///< Mask of shard bits
+};
+
+} // namespace mm
+
+#endif // _CONCURRENT_CACHE_MAP_HPP_
@@ -0,0 +1,267 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_EVICTION_POLICY_HPP_
+#define _MM_EVICTION_POLICY_HPP_
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Eviction policies.
+ *
+ * An eviction policy chooses which item of a full set is replaced when a
+ * new item has to be stored in it. The policy is notified of every use of
+ * the buckets and keeps its own per-bucket metadata, in compact arrays
+ * separated from the items.
+ *
+ * A policy must provide these methods:
+ *
+ * - @p init(buckets,ways) : called when the table is (re)initialized,
+ *   all the buckets are empty.
+ * - @p on_insert(bucket) : an item has been stored in an empty bucket or
+ *   in place of a victim.
+ * - @p on_hit(bucket) : the item in the bucket has been found or
+ *   replaced with another one with the same key.
+ * - @p on_erase(bucket) : the item in the bucket has been erased.
+ * - @p victim(first) : returns the way (from 0 to @a ways - 1) of the item
+ *   to be replaced, in the full set starting at bucket @a first.
+ *
+ * Policies that derive from EvictionPolicyBase inherit a default for the
+ * hooks used by admission filters:
+ *
+ * - @p on_access(hash) : a key with the given hash value has been looked
+ *   up or inserted.
+ * - @p on_store(bucket,hash) : an item with the given hash value is being
+ *   stored in the bucket, before on_insert(). The items adopted
+ *   from persistent memory or a snapshot, or kept in place by resize(),
+ *   are only passed to on_insert().
+ * - @p admit(first,way,hash,bucket_hash) : called when a new item with the
+ *   given hash value is going to replace the victim @a way of the set
+ *   starting at @a first. Returns the way to be actually replaced, or
+ *   @a ways to reject the new item. @a bucket_hash(bucket) computes the
+ *   hash value of a resident item by hashing its key again: a policy that
+ *   needs it on every admission should record it with on_store().
+ */
+namespace mm
+{
+
+/** Base class of eviction policies.
+ *
+ *  Provides the default hooks: every access is ignored and every new item
+ *  is admitted in place of the victim.
+ */
+class EvictionPolicyBase
+{
+public:
+    void on_access( size_t hash ) {}
+    void on_store( size_t bucket, size_t hash ) {}
+
+    template <class BucketHash>
+    size_t admit( size_t first, size_t way, size_t hash,
+                  const BucketHash& bucket_hash )
+    {
+        return way;
+    }
+};
+
+/** Random eviction policy.
+ *
+ *  The victim is chosen with a pseudo-random generator, no metadata is
+ *  kept. This is the default policy.
+ */
+class EvictRandom : public EvictionPolicyBase
+{
+public:
+    EvictRandom() : m_ways( 1 ), m_seed( 88172645463325252ULL ) {}
+
+    void init( size_t buckets, size_t ways ) { m_ways = ways; }
+    void on_insert( size_t bucket ) {}
+    void on_hit( size_t bucket )    {}
+    void on_erase( size_t bucket )  {}
+
+    size_t victim( size_t first )
+    {
+        // xorshift generator
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 7;
+        m_seed ^= m_seed << 17;
+        return m_seed & ( m_ways - 1 );
+    }
+
+private:
+    size_t             m_ways; ///< Number of buckets in each set
+    unsigned long long m_seed; ///< State of the generator
+};
+
+/** CLOCK eviction policy.
+ *
+ *  Each bucket has a reference bit, set when the item is used. Each set
+ *  has a clock hand that sweeps the set looking for an item with the
+ *  reference bit clear, clearing the bits it finds set.
+ */
+class EvictClock : public EvictionPolicyBase
+{
+public:
+    EvictClock() : m_ways( 1 ) {}
+
+    void init( size_t buckets, size_t ways )
+    {
+        m_ways = ways;
+        m_referenced.assign( buckets, 0 );
+        m_hands.assign( buckets / ways, 0 );
+    }
+
+    void on_insert( size_t bucket ) { m_referenced[ bucket ] = 1; }
+    void on_hit( size_t bucket )    { m_referenced[ bucket ] = 1; }
+    void on_erase( size_t bucket )  { m_referenced[ bucket ] = 0; }
+
+    size_t victim( size_t first )
+    {
+        unsigned char& hand = m_hands[ first / m_ways ];
+        while ( m_referenced[ first + hand ] )
+        {
+            m_referenced[ first + hand ] = 0;
+            hand = ( hand + 1 ) & ( m_ways - 1 );
+        }
+
+        const size_t way = hand;
+        hand = ( hand + 1 ) & ( m_ways - 1 );
+        return way;
+    }
+
+private:
+    size_t                     m_ways;       ///< Number of buckets in each set
+    std::vector<unsigned char> m_referenced; ///< Reference bit of buckets
+    std::vector<unsigned char> m_hands;      ///< Clock hand of each set
+};
+
+/** Least Recently Used eviction policy, within each set.
+ *
+ *  Each bucket has an age, from 0 (most recently used) to @a ways - 1
+ *  (least recently used): the ages of a set are always a permutation of
+ *  those values.
+ */
+class EvictLRU : public EvictionPolicyBase
+{
+public:
+    EvictLRU() : m_ways( 1 ) {}
+
+    void init( size_t buckets, size_t ways )
+    {
+        m_ways = ways;
+        m_ages.resize( buckets );
+        for ( size_t i = 0; i < buckets; ++i )
+            m_ages[ i ] = i & ( ways - 1 );
+    }
+
+    void on_insert( size_t bucket ) { touch( bucket ); }
+    void on_hit( size_t bucket )    { touch( bucket ); }
+    void on_erase( size_t bucket )  {}
+
+    size_t victim( size_t first )
+    {
+        size_t way = 0;
+        for ( size_t i = 1; i < m_ways; ++i )
+            if ( m_ages[ first + i ] > m_ages[ first + way ] )
+                way = i;
+
+        return way;
+    }
+
+private:
+    /// Makes the bucket the most recently used of its set
+    void touch( size_t bucket )
+    {
+        const size_t first = bucket & ~( m_ways - 1 );
+        const unsigned char age = m_ages[ bucket ];
+        for ( size_t i = first; i < first + m_ways; ++i )
+            m_ages[ i ] += ( m_ages[ i ] < age );
+
+        m_ages[ bucket ] = 0;
+    }
+
+    size_t                     m_ways; ///< Number of buckets in each set
+    std::vector<unsigned char> m_ages; ///< Age of buckets within their set
+};
+
+/** Least Frequently Used eviction policy, within each set.
+ *
+ *  Each bucket has a saturating use counter. When a counter saturates, all
+ *  the counters of its set are halved, so that old uses are forgotten.
+ */
+class EvictLFU : public EvictionPolicyBase
+{
+public:
+    EvictLFU() : m_ways( 1 ) {}
+
+    void init( size_t buckets, size_t ways )
+    {
+        m_ways = ways;
+        m_counts.assign( buckets, 0 );
+    }
+
+    void on_insert( size_t bucket ) { m_counts[ bucket ] = 1; }
+    void on_erase( size_t bucket )  { m_counts[ bucket ] = 0; }
+
+    void on_hit( size_t bucket )
+    {
+        if ( ++m_counts[ bucket ] == 255 )
+        {
+            const size_t first = bucket & ~( m_ways - 1 );
+            for ( size_t i = first; i < first + m_ways; ++i )
+                m_counts[ i ] >>= 1;
+        }
+    }
+
+    size_t victim( size_t first )
+    {
+        size_t way = 0;
+        for ( size_t i = 1; i < m_ways; ++i )
+            if ( m_counts[ first + i ] < m_counts[ first + way ] )
+                way = i;
+
+        return way;
+    }
+
+private:
+    size_t                     m_ways;   ///< Number of buckets in each set
+    std::vector<unsigned char> m_counts; ///< Use counter of buckets
+};
+
+} // namespace mm
+
+#endif // _MM_EVICTION_POLICY_HPP_
@@ -0,0 +1,125 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_FIXED_STRING_HPP_
+#define _MM_FIXED_STRING_HPP_
+
+#include "hash_fun.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace mm
+{
+
+/** String with a fixed capacity, stored inline.
+ *
+ *  The characters are kept in an array of @a N bytes, padded with zeros,
+ *  so the string is trivially copyable: it can be used as a key of the
+ *  tables that store their items as raw memory, like
+ *  persistent_cache_map, or saved in a raw snapshot.
+ *
+ *  A string of exactly @a N characters has no terminating zero: use
+ *  size() or str() rather than data() as a C string.
+ */
+template <size_t N>
+class fixed_string
+{
+public:
+    fixed_string() { std::memset( m_data, 0, N ); }
+
+    /// @throw std::length_error if @a s is longer than @a N characters
+    fixed_string( const char* s ) { assign( s, strlen( s ) ); }
+
+    /// @throw std::length_error if @a s is longer than @a N characters
+    fixed_string( const std::string& s ) { assign( s.data(), s.size() ); }
+
+    /// The characters, not zero terminated when the string is full
+    const char* data() const { return m_data; }
+
+    size_t size() const
+    {
+        const void* end = std::memchr( m_data, 0, N );
+        return end ? static_cast<const char*>( end ) - m_data : N;
+    }
+
+    bool empty() const { return m_data[ 0 ] == 0; }
+
+    static size_t capacity() { return N; }
+
+    std::string str() const { return std::string( m_data, size() ); }
+
+    bool operator==( const fixed_string& s ) const
+    {
+        return std::memcmp( m_data, s.m_data, N ) == 0;
+    }
+
+    bool operator!=( const fixed_string& s ) const { return ! ( *this == s ); }
+
+    bool operator<( const fixed_string& s ) const
+    {
+        return std::memcmp( m_data, s.m_data, N ) < 0;
+    }
+
+private:
+    void assign( const char* s, size_t len )
+    {
+        if ( len > N )
+            throw std::length_error( "mm::fixed_string: string too long" );
+
+        std::memcpy( m_data, s, len );
+        std::memset( m_data + len, 0, N - len );
+    }
+
+    char m_data[ N ]; ///< The characters, padded with zeros
+};
+
+/** Hash value specialization for @a fixed_string. It is the same of the
+ *  std::string with the same characters.
+ *  @param s the string to be hashed
+ *  @return the hash value
+ *  @relates hash
+ */
+template <size_t N>
+inline size_t hash_value( const fixed_string<N>& s )
+{
+    return hash_bytes( s.data(), s.size() );
+}
+
+} // namespace mm
+
+#endif // _MM_FIXED_STRING_HPP_
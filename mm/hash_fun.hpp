@@ -50,6 +50,50 @@ using std::size_t;
 // Scalar integers
 ///////////////////////////////////////////////////////////////////////
 
+/** Mixes the bits of an integer value.
+ *
+ *  Containers use the low bits of the hash value to choose the bucket and
+ *  the high bits for the tag, so returning an integer key unchanged makes
+ *  keys that differ only in their high bits (eg: multiples of 4096,
+ *  aligned pointers) collide. This is the finalizer of MurmurHash3: every
+ *  bit of the input affects every bit of the result.
+ *
+ *  Define @p MM_IDENTITY_HASH to get back the identity hash for integers
+ *  and pointers.
+ *
+ *  @param n the value to be mixed
+ *  @return the mixed value
+ *  @relates hash
+ */
+inline size_t hash_mix( size_t n )
+{
+#ifdef MM_IDENTITY_HASH
+    return n;
+#else
+    if ( sizeof(size_t) == 8 )
+    {
+        unsigned long long k = n;
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return static_cast<size_t>( k );
+    }
+
+    unsigned int k = static_cast<unsigned int>( n );
+    k ^= k >> 16;
+    k *= 0x85ebca6bU;
+    k ^= k >> 13;
+    k *= 0xc2b2ae35U;
+    k ^= k >> 16;
+    return k;
+#endif
+}
+
+// Characters are not mixed: they are hashed one at a time by hash_range(),
+// and they cannot collide in tables of 256 or more buckets anyway.
+
 /** Hash value specialization for @a char
  *  @param n the number to be hashed
  *  @return the hash value
@@ -72,7 +116,7 @@ inline size_t hash_value( unsigned char n )
  *  @relates hash
  */
 inline size_t hash_value( short n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
 
 /** Hash value specialization for @a unsigned @a char
  *  @param n the number to be hashed
@@ -80,7 +124,7 @@ inline size_t hash_value( short n )
  *  @relates hash
  */
 inline size_t hash_value( unsigned short n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
 
 /** Hash value specialization for @a int
  *  @param n the number to be hashed
@@ -88,7 +132,7 @@ inline size_t hash_value( unsigned short n )
  *  @relates hash
  */
 inline size_t hash_value( int n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
 
 /** Hash value specialization for @a unsigned @a int
  *  @param n the number to be hashed
@@ -96,7 +140,7 @@ inline size_t hash_value( int n )
  *  @relates hash
  */
 inline size_t hash_value( unsigned int n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
 
 /** Hash value specialization for @a long
  *  @param n the number to be hashed
@@ -104,7 +148,7 @@ inline size_t hash_value( unsigned int n )
  *  @relates hash
  */
 inline size_t hash_value( long n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
 
 /** Hash value specialization for @a unsigned @a long
  *  @param n the number to be hashed
@@ -112,12 +156,44 @@ inline size_t hash_value( long n )
  *  @relates hash
  */
 inline size_t hash_value( unsigned long n )
-{ return static_cast<size_t>( n ); }
+{ return hash_mix( static_cast<size_t>( n ) ); }
+
+/** Hash value specialization for @a long @a long
+ *  @param n the number to be hashed
+ *  @return the hash value
+ *  @relates hash
+ */
+inline size_t hash_value( long long n )
+{ return hash_mix( static_cast<size_t>( n ) ); }
+
+/** Hash value specialization for @a unsigned @a long @a long
+ *  @param n the number to be hashed
+ *  @return the hash value
+ *  @relates hash
+ */
+inline size_t hash_value( unsigned long long n )
+{ return hash_mix( static_cast<size_t>( n ) ); }
+
+/** Hash value specialization for pointers.
+ *
+ *  The pointer value (not the pointed object) is hashed. Strings are
+ *  handled by the @a char* overloads.
+ *
+ *  @param p the pointer to be hashed
+ *  @return the hash value
+ *  @relates hash
+ */
+template <class T>
+inline size_t hash_value( T* p )
+{ return hash_mix( reinterpret_cast<size_t>( p ) ); }
     
 ///////////////////////////////////////////////////////////////////////
 // Sequences
 ///////////////////////////////////////////////////////////////////////
 
+template <class T>
+inline void hash_combine( size_t& seed, const T& v );
+
 /** Hash value specialization for a range of elements.
  *
  *  Compute the combined hash value for a collection of items.
@@ -158,6 +234,146 @@ inline void hash_range( size_t& seed, Iterator first, Iterator last )
         hash_combine( seed, *first );
 }
 
+///////////////////////////////////////////////////////////////////////
+// Strings
+///////////////////////////////////////////////////////////////////////
+
+namespace detail
+{
+
+typedef unsigned long long hash_word;
+
+/// Unaligned load of 8 bytes
+inline hash_word hash_read8( const unsigned char* p )
+{
+    hash_word v;
+    memcpy( &v, p, 8 );
+    return v;
+}
+
+/// Unaligned load of 4 bytes
+inline hash_word hash_read4( const unsigned char* p )
+{
+    unsigned int v;
+    memcpy( &v, p, 4 );
+    return v;
+}
+
+/// Multiplies @a a and @a b, returning the low and high 64 bits of the
+/// product in @a a and @a b.
+inline void hash_mul128( hash_word& a, hash_word& b )
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = a;
+    r *= b;
+    a = static_cast<hash_word>( r );
+    b = static_cast<hash_word>( r >> 64 );
+#else
+    const hash_word ha = a >> 32, hb = b >> 32;
+    const hash_word la = a & 0xffffffffULL, lb = b & 0xffffffffULL;
+    const hash_word rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    const hash_word t = rl + ( rm0 << 32 );
+    const hash_word lo = t + ( rm1 << 32 );
+    const hash_word c = ( t < rl ) + ( lo < t );
+    a = lo;
+    b = rh + ( rm0 >> 32 ) + ( rm1 >> 32 ) + c;
+#endif
+}
+
+/// Folds the 128 bits product of @a a and @a b into 64 bits
+inline hash_word hash_fold( hash_word a, hash_word b )
+{
+    hash_mul128( a, b );
+    return a ^ b;
+}
+
+} // namespace detail
+
+/** Hash value of a block of memory.
+ *
+ *  The bytes are consumed 48 at a time, in three independent multiply
+ *  chains, so the cost per byte is a small fraction of hash_range(), which
+ *  combines one character at a time. The construction is the one of
+ *  wyhash: every block is folded into the state with a 64x64->128 bit
+ *  multiplication, and inputs up to 16 bytes are read with at most four
+ *  overlapping loads.
+ *
+ *  The result depends on the byte order of the machine.
+ *
+ *  @param data pointer to the first byte
+ *  @param len number of bytes to be hashed
+ *  @param seed the initial seed value
+ *  @return the hash value
+ *  @relates hash
+ */
+inline size_t hash_bytes( const void* data, size_t len, size_t seed = 0 )
+{
+    using detail::hash_word;
+    using detail::hash_read8;
+    using detail::hash_read4;
+    using detail::hash_fold;
+
+    static const hash_word k0 = 0xa0761d6478bd642fULL;
+    static const hash_word k1 = 0xe7037ed1a0b428dbULL;
+    static const hash_word k2 = 0x8ebc6af09c88c6e3ULL;
+    static const hash_word k3 = 0x589965cc75374cc3ULL;
+
+    const unsigned char* p = static_cast<const unsigned char*>( data );
+    hash_word h = seed ^ hash_fold( seed ^ k0, k1 );
+    hash_word a, b;
+
+    if ( len <= 16 )
+    {
+        if ( len >= 4 )
+        {
+            const size_t d = ( len >> 3 ) << 2;
+            a = ( hash_read4( p ) << 32 ) | hash_read4( p + d );
+            b = ( hash_read4( p + len - 4 ) << 32 )
+                | hash_read4( p + len - 4 - d );
+        }
+        else if ( len > 0 )
+        {
+            a = ( hash_word( p[0] ) << 16 ) | ( hash_word( p[len >> 1] ) << 8 )
+                | p[len - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t i = len;
+        if ( i > 48 )
+        {
+            hash_word h1 = h, h2 = h;
+            do
+            {
+                h  = hash_fold( hash_read8( p )      ^ k1, hash_read8( p + 8 )  ^ h );
+                h1 = hash_fold( hash_read8( p + 16 ) ^ k2, hash_read8( p + 24 ) ^ h1 );
+                h2 = hash_fold( hash_read8( p + 32 ) ^ k3, hash_read8( p + 40 ) ^ h2 );
+                p += 48;
+                i -= 48;
+            } while ( i > 48 );
+            h ^= h1 ^ h2;
+        }
+
+        while ( i > 16 )
+        {
+            h = hash_fold( hash_read8( p ) ^ k1, hash_read8( p + 8 ) ^ h );
+            p += 16;
+            i -= 16;
+        }
+
+        a = hash_read8( p + i - 16 );
+        b = hash_read8( p + i - 8 );
+    }
+
+    a ^= k1;
+    b ^= h;
+    detail::hash_mul128( a, b );
+    return static_cast<size_t>( hash_fold( a ^ k0 ^ len, b ^ k1 ) );
+}
+
 /** Hash value specialization for @a char*
  *  @param s the c-style string to be hashed
  *  @return the hash value
@@ -165,7 +381,7 @@ inline void hash_range( size_t& seed, Iterator first, Iterator last )
  */
 inline size_t hash_value( char* s ) 
 {
-    return hash_range( s, s + strlen( s ) );
+    return hash_bytes( s, strlen( s ) );
 }
     
 /** Hash value specialization for @a const @a char*
@@ -175,7 +391,7 @@ inline size_t hash_value( char* s )
  */
 inline size_t hash_value( const char* s ) 
 {
-    return hash_range( s, s + strlen( s ) );
+    return hash_bytes( s, strlen( s ) );
 }
 
 /** Hash value specialization for @a std::string
@@ -185,7 +401,7 @@ inline size_t hash_value( const char* s )
  */
 inline size_t hash_value( const std::string& s ) 
 {
-    return hash_range( s.begin(), s.end() );
+    return hash_bytes( s.data(), s.size() );
 }
 
 /** Hash value specialization for @a std::pair<T1,T2>
@@ -0,0 +1,184 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _MM_INTERLEAVED_FIND_HPP_
+#define _MM_INTERLEAVED_FIND_HPP_
+
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define MM_HAS_COROUTINES 1
+#include <coroutine>
+#endif
+
+/// Default number of lookups kept in flight by find_interleaved().
+#define MM_INTERLEAVE_WIDTH 16
+
+#ifdef MM_HAS_COROUTINES
+
+namespace mm
+{
+
+/** Coroutine that runs a part of an interleaved computation.
+ *
+ *  The coroutine is created suspended and it is resumed by its owner
+ *  until done(). It does not return any value.
+ */
+class lookup_task
+{
+public:
+    struct promise_type
+    {
+        lookup_task get_return_object()
+        {
+            return lookup_task(
+                std::coroutine_handle<promise_type>::from_promise( *this ) );
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept   { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    lookup_task( lookup_task&& other ) : m_handle( other.m_handle )
+    {
+        other.m_handle = 0;
+    }
+
+    ~lookup_task()
+    {
+        if ( m_handle )
+            m_handle.destroy();
+    }
+
+    bool done() const { return m_handle.done(); }
+    void resume()     { m_handle.resume(); }
+
+private:
+    explicit lookup_task( std::coroutine_handle<promise_type> h )
+        : m_handle( h ) {}
+
+    lookup_task( const lookup_task& );
+    lookup_task& operator= ( const lookup_task& );
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/** Looks up the keys of a batch, one after the other, suspending after
+ *  each prefetch.
+ *
+ *  The keys handled by this worker are taken from the shared @a next
+ *  index, so that all the workers of a batch stay busy until the end.
+ */
+template <class Table, class Key, class Result>
+lookup_task interleaved_worker( Table& table, const Key* keys, size_t n,
+                                Result* out, size_t& next )
+{
+    while ( next < n )
+    {
+        const size_t i = next++;
+        const size_t hash = table.hash_funct()( keys[ i ] );
+
+        // Wait for the tags and the set
+        table.prefetch( hash );
+        co_await std::suspend_always();
+
+        // Large sets: wait for the buckets whose tag matches
+        if ( table.prefetch_matches( hash ) )
+            co_await std::suspend_always();
+
+        out[ i ] = table.find( keys[ i ], hash );
+    }
+}
+
+/** Looks up @a n keys, keeping many lookups in flight.
+ *
+ *  Each lookup prefetches the set of its key and then suspends, letting
+ *  the other lookups run while the memory is read: when it is resumed,
+ *  the set is in cache. With @a width lookups in flight, the cache misses
+ *  of @a width independent lookups overlap. Unlike find_batch(), a slow
+ *  lookup (a big set whose matching buckets have to be read too) does not
+ *  hold up the others.
+ *
+ *  @a Table can be a cache_map, a cache_set or a cache_table. For a const
+ *  table, @a out must be an array of const iterators.
+ *
+ *  This function is only available when compiling with coroutine support
+ *  (C++20), which is signaled by @p MM_HAS_COROUTINES.
+ *
+ *  @param table the table to look into
+ *  @param keys the keys to look for
+ *  @param n the number of keys
+ *  @param out receives, for each key, the result of find()
+ *  @param width number of lookups in flight, at least one is always run
+ */
+template <class Table, class Key, class Result>
+void find_interleaved( Table& table, const Key* keys, size_t n, Result* out,
+                       size_t width = MM_INTERLEAVE_WIDTH )
+{
+    if ( width == 0 )
+        width = 1;
+
+    size_t next = 0;
+    std::vector<lookup_task> workers;
+    workers.reserve( width );
+    for ( size_t w = 0; w < width && w < n; ++w )
+        workers.push_back( interleaved_worker( table, keys, n, out, next ) );
+
+    // Round robin among the workers until all the keys are done
+    size_t running = workers.size();
+    while ( running > 0 )
+    {
+        for ( size_t w = 0; w < workers.size(); ++w )
+        {
+            if ( workers[ w ].done() )
+                continue;
+
+            workers[ w ].resume();
+            running -= workers[ w ].done();
+        }
+    }
+}
+
+} // namespace mm
+
+#endif // MM_HAS_COROUTINES
+
+#endif // _MM_INTERLEAVED_FIND_HPP_
@@ -0,0 +1,253 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_LOCKS_HPP_
+#define _MM_LOCKS_HPP_
+
+#include <atomic>
+#include <cerrno>
+#include <shared_mutex>
+
+#include <pthread.h>
+
+/// Size of a cache line, used to keep locks of different shards apart.
+#define MM_CACHE_LINE_SIZE 64
+
+/**
+ * Locks used by the concurrent containers.
+ *
+ * Every lock provides @p lock(), @p unlock(), @p lock_shared() and
+ * @p unlock_shared(). The @p is_shared constant tells whether shared
+ * (reader) owners can actually hold the lock at the same time, while
+ * @p is_seq tells whether readers do not lock at all and rely on sequence
+ * counters instead.
+ */
+namespace mm
+{
+
+/// Hint to the processor that the thread is spinning on a lock
+inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/** Spin lock.
+ *
+ *  Test-and-test-and-set lock: waiters spin on a plain load, so that the
+ *  cache line is not bounced while the lock is held. Readers are exclusive
+ *  too, which lets them update the eviction policy metadata.
+ */
+class spin_lock
+{
+public:
+    enum { is_shared = 0, is_seq = 0 };
+
+    spin_lock() : m_locked( false ) {}
+
+    void lock()
+    {
+        while ( m_locked.exchange( true, std::memory_order_acquire ) )
+            while ( m_locked.load( std::memory_order_relaxed ) )
+                cpu_relax();
+    }
+
+    void unlock() { m_locked.store( false, std::memory_order_release ); }
+
+    void lock_shared()   { lock();   }
+    void unlock_shared() { unlock(); }
+
+private:
+    spin_lock( const spin_lock& );
+    spin_lock& operator= ( const spin_lock& );
+
+    std::atomic<bool> m_locked;
+};
+
+/** Reader-writer lock.
+ *
+ *  Many readers can hold the lock at the same time. Since readers do not
+ *  have exclusive access, they must not write to the table: lookups done
+ *  under a shared lock do not notify the eviction policy.
+ */
+class rw_lock
+{
+public:
+    enum { is_shared = 1, is_seq = 0 };
+
+    void lock()          { m_mutex.lock();          }
+    void unlock()        { m_mutex.unlock();        }
+    void lock_shared()   { m_mutex.lock_shared();   }
+    void unlock_shared() { m_mutex.unlock_shared(); }
+
+private:
+    std::shared_mutex m_mutex;
+};
+
+/** Sequence lock.
+ *
+ *  Writers are serialized by a spin lock, and they bump a sequence counter
+ *  before and after modifying the data: the counter is odd while a write
+ *  is in progress. Readers take no lock: they read the counter, copy the
+ *  data out and read the counter again, retrying if it changed. Readers
+ *  never write to shared memory, so they do not bounce cache lines among
+ *  processors.
+ *
+ *  The containers keep a sequence counter for every set of buckets, so
+ *  readers only retry when the very set they are reading is modified.
+ *
+ *  @attention Readers can see items while they are being modified. This is
+ *  harmless for trivially copyable keys and data, whose copies are simply
+ *  discarded when the counter changed. Other types can be used only if
+ *  comparing a key and copying the data never follow pointers read from
+ *  the item (eg: std::string is NOT safe), nor have side effects.
+ */
+class seq_lock : public spin_lock
+{
+public:
+    enum { is_shared = 0, is_seq = 1 };
+};
+
+/** Sequence counter of a seq_lock.
+ *
+ *  @see seq_lock
+ */
+class seq_counter
+{
+public:
+    seq_counter() : m_seq( 0 ) {}
+
+    /// Starts a read: returns the current (even) value of the counter
+    unsigned int read_begin() const
+    {
+        unsigned int seq;
+        while ( ( seq = m_seq.load( std::memory_order_acquire ) ) & 1 )
+            cpu_relax();
+
+        return seq;
+    }
+
+    /** Starts a read, unless a write is in progress.
+     *
+     *  @param seq receives the current value of the counter
+     *  @return false if the counter is odd
+     */
+    bool try_read_begin( unsigned int& seq ) const
+    {
+        seq = m_seq.load( std::memory_order_acquire );
+        return ( seq & 1 ) == 0;
+    }
+
+    /// Tells whether a write is in progress
+    bool writing() const
+    {
+        return m_seq.load( std::memory_order_relaxed ) & 1;
+    }
+
+    /// Tells whether the data read since read_begin() must be read again
+    bool read_retry( unsigned int seq ) const
+    {
+        std::atomic_thread_fence( std::memory_order_acquire );
+        return m_seq.load( std::memory_order_relaxed ) != seq;
+    }
+
+    /// Starts a write. Writers must be serialized by a lock.
+    void write_begin()
+    {
+        m_seq.store( m_seq.load( std::memory_order_relaxed ) + 1,
+                     std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+    }
+
+    /// Ends a write
+    void write_end()
+    {
+        m_seq.store( m_seq.load( std::memory_order_relaxed ) + 1,
+                     std::memory_order_release );
+    }
+
+private:
+    std::atomic<unsigned int> m_seq;
+};
+
+/** Robust lock, shared among processes.
+ *
+ *  A POSIX mutex with the process-shared and robust attributes, to be
+ *  placed in shared memory. When a process dies holding the lock, the
+ *  next owner is told about it by lock(), and has to repair the data the
+ *  lock protects: the lock is then usable again.
+ */
+class robust_lock
+{
+public:
+    robust_lock()
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init( &attr );
+        pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+        pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+        pthread_mutex_init( &m_mutex, &attr );
+        pthread_mutexattr_destroy( &attr );
+    }
+
+    ~robust_lock() { pthread_mutex_destroy( &m_mutex ); }
+
+    /** Acquires the lock.
+     *
+     *  @return true if the previous owner died while holding the lock
+     */
+    bool lock()
+    {
+        if ( pthread_mutex_lock( &m_mutex ) != EOWNERDEAD )
+            return false;
+
+        pthread_mutex_consistent( &m_mutex );
+        return true;
+    }
+
+    void unlock() { pthread_mutex_unlock( &m_mutex ); }
+
+private:
+    robust_lock( const robust_lock& );
+    robust_lock& operator= ( const robust_lock& );
+
+    pthread_mutex_t m_mutex;
+};
+
+} // namespace mm
+
+#endif // _MM_LOCKS_HPP_
@@ -0,0 +1,368 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_MAPPED_FILE_HPP_
+#define _MM_MAPPED_FILE_HPP_
+
+#include "hash_fun.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mm
+{
+
+/// Header of the files mapped by mapped_file, in their first page
+struct mapped_file_header
+{
+    char     magic[ 8 ];   ///< "MMTABLE" and the format version
+    uint64_t buckets;      ///< Number of buckets of the table
+    uint64_t ways;         ///< Number of buckets of each set
+    uint64_t item_size;    ///< Size of the items
+    uint64_t hash_id;      ///< Identifier of the hash function
+    uint64_t data_size;    ///< Size of the arrays, after the header
+    uint64_t checksum;     ///< Hash value of the fields above
+    uint64_t clean;        ///< 1 if the file was detached cleanly
+};
+
+/** Identifier of a hash function, to be stored with the tables that
+ *  outlive the process.
+ *
+ *  It is computed from the type of the hash function and from the hash
+ *  value of a key made of a fixed byte pattern, so it changes when the
+ *  hash values change (eg: MM_IDENTITY_HASH is toggled). The key must be
+ *  trivially copyable.
+ */
+template <class Key, class HashFunction>
+uint64_t hash_function_id()
+{
+    alignas( Key ) unsigned char bytes[ sizeof( Key ) ];
+    for ( size_t i = 0; i < sizeof( Key ); ++i )
+        bytes[ i ] = 0x5a + i;
+
+    const Key& key = *reinterpret_cast<const Key*>( bytes );
+    const char* name = typeid( HashFunction ).name();
+    return hash_bytes( name, std::strlen( name ), HashFunction()( key ) );
+}
+
+/** A block of memory, whose arrays are handed out in order.
+ *
+ *  Used by mapped_file_allocator: the owners of the memory (mapped_file,
+ *  shared_segment) derive from it.
+ */
+class memory_arena
+{
+public:
+    memory_arena() : m_data( 0 ), m_size( 0 ), m_used( 0 ) {}
+
+    /** Hands out the next @a bytes, aligned to a cache line.
+     *
+     *  @return the memory, or 0 if the arena is full
+     */
+    void* allocate( size_t bytes )
+    {
+        bytes = aligned( bytes );
+        if ( bytes > m_size - m_used )
+            return 0;
+
+        void* p = m_data + m_used;
+        m_used += bytes;
+        return p;
+    }
+
+    /// Size of an array in the arena
+    static size_t aligned( size_t bytes ) { return ( bytes + 63 ) & ~63; }
+
+protected:
+    char*  m_data; ///< The memory
+    size_t m_size; ///< Size of the memory
+    size_t m_used; ///< Bytes handed out by allocate()
+};
+
+/** The header of the arena of a cache_table with at least @a n buckets.
+ *
+ *  The bucket count is rounded up like the table does, and the size of the
+ *  data follows the arrays allocated by cache_table::init(), in order:
+ *  items, tags and occupancy bitmap. This is the only copy of that layout,
+ *  shared by persistent_cache_map and shared_cache_map.
+ *
+ *  @param n         the requested number of buckets
+ *  @param ways      the number of buckets of each set
+ *  @param item_size the size of the items
+ *  @param hash_id   an identifier of the hash function
+ */
+inline mapped_file_header table_layout( size_t n, size_t ways,
+                                        size_t item_size, uint64_t hash_id )
+{
+    size_t buckets = ways;
+    while ( buckets < n )
+        buckets <<= 1;
+
+    mapped_file_header h;
+    std::memset( &h, 0, sizeof( h ) );
+    h.buckets = buckets;
+    h.ways = ways;
+    h.item_size = item_size;
+    h.hash_id = hash_id;
+    h.data_size = memory_arena::aligned( buckets * item_size )
+                  + memory_arena::aligned( buckets )
+                  + memory_arena::aligned( ( buckets + 63 ) / 64 * 8 );
+    return h;
+}
+
+/** A file mapped in memory, that holds the arrays of a table.
+ *
+ *  The file starts with a page holding a mapped_file_header, followed by
+ *  the arrays, that are handed out in order by allocate(). The header
+ *  describes the table: a file is only attached by a table with the same
+ *  layout and the same hash function.
+ *
+ *  The pages are mapped with MAP_SHARED, so the kernel writes them back
+ *  to the file and reads them in when they are first used. While a table
+ *  is attached the header is marked as dirty, and it is marked as clean
+ *  when the table is detached. A file left dirty by a crashed process is
+ *  emptied at the next attach, since its arrays may be inconsistent.
+ *
+ *  The file is locked while attached: a second process cannot attach it.
+ */
+class mapped_file : public memory_arena
+{
+public:
+    /// Size of the header, one page
+    static const size_t header_size = 4096;
+
+    /** Opens a file, creating it if missing.
+     *
+     *  @param path   the path of the file
+     *  @param layout the expected header (magic, checksum and clean are
+     *                ignored)
+     *  @throw std::runtime_error if the file cannot be opened or was
+     *         written for a table with a different layout or hash function
+     */
+    mapped_file( const char* path, const mapped_file_header& layout )
+        : m_fd( -1 ), m_created( false )
+    {
+        m_size = layout.data_size;
+        static const char magic[ 8 ] = { 'M', 'M', 'T', 'A',
+                                          'B', 'L', 'E', '1' };
+
+        mapped_file_header h = layout;
+        std::memcpy( h.magic, magic, sizeof( h.magic ) );
+        h.checksum = checksum( h );
+        h.clean = 0;
+
+        m_fd = open( path, O_RDWR | O_CREAT, 0644 );
+        if ( m_fd < 0 )
+            fail( path, "cannot be opened" );
+        if ( flock( m_fd, LOCK_EX | LOCK_NB ) != 0 )
+            fail( path, "is attached by another table" );
+
+        struct stat st;
+        if ( fstat( m_fd, &st ) != 0 )
+            fail( path, "cannot be read" );
+
+        if ( st.st_size == 0 )
+            m_created = true;
+        else
+        {
+            mapped_file_header old;
+            if ( pread( m_fd, &old, sizeof( old ), 0 ) != sizeof( old ) )
+                fail( path, "cannot be read" );
+            if ( std::memcmp( &old, &h, offsetof( mapped_file_header, clean ) ) )
+                fail( path, "belongs to a table with a different layout or "
+                            "hash function" );
+
+            // Drop the arrays of a dirty file, leaving zero-filled holes
+            if ( ! old.clean )
+            {
+                m_created = true;
+                if ( ftruncate( m_fd, header_size ) != 0 )
+                    fail( path, "cannot be resized" );
+            }
+        }
+
+        if ( ftruncate( m_fd, header_size + m_size ) != 0
+             || pwrite( m_fd, &h, sizeof( h ), 0 ) != sizeof( h ) )
+            fail( path, "cannot be written" );
+
+        void* p = mmap( 0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        m_fd, header_size );
+        if ( p == MAP_FAILED )
+            fail( path, "cannot be mapped" );
+        m_data = static_cast<char*>( p );
+    }
+
+    /// Writes back the arrays and marks the file as clean
+    ~mapped_file()
+    {
+        if ( m_data )
+        {
+            const bool synced = msync( m_data, m_size, MS_SYNC ) == 0;
+            munmap( m_data, m_size );
+
+            // If the arrays cannot be written back the file stays dirty,
+            // and is emptied at the next attach
+            const uint64_t clean = 1;
+            const ssize_t written = synced
+                ? pwrite( m_fd, &clean, sizeof( clean ),
+                          offsetof( mapped_file_header, clean ) )
+                : 0;
+            (void) written;
+        }
+
+        if ( m_fd >= 0 )
+            close( m_fd );
+    }
+
+    /** Tells whether the file has been created, or emptied because it was
+     *  not detached cleanly: the table then starts empty.
+     */
+    bool created() const { return m_created; }
+
+    /// Starts writing back the modified pages, without waiting
+    void sync() { msync( m_data, m_size, MS_ASYNC ); }
+
+private:
+    mapped_file( const mapped_file& );
+    mapped_file& operator= ( const mapped_file& );
+
+    static uint64_t checksum( const mapped_file_header& h )
+    {
+        return hash_bytes( &h, offsetof( mapped_file_header, checksum ) );
+    }
+
+    void fail( const char* path, const char* reason )
+    {
+        if ( m_fd >= 0 )
+            close( m_fd );
+        throw std::runtime_error( std::string( "mm::mapped_file: " ) + path
+                                  + " " + reason );
+    }
+
+    int  m_fd;      ///< The open file
+    bool m_created; ///< True if the arrays started empty
+};
+
+/** Allocator of the arrays of a table from a memory_arena, like a
+ *  mapped_file.
+ *
+ *  The arrays of a table are carved out of the arena in the order the
+ *  table allocates them, which is the same every time a table of the same
+ *  type and size is built: so a new table finds the arrays of the previous
+ *  one. The memory is never released, and the allocation fails with
+ *  std::bad_alloc when the arena is full: a table using this allocator
+ *  cannot be resized or copied, nor use a lazy clear.
+ *
+ *  The memory is persistent: the containers take over the items they
+ *  find in the arrays, and leave them in place when destroyed. The items
+ *  must be trivially copyable, since they are never constructed nor
+ *  destroyed by another process.
+ */
+template <class T>
+class mapped_file_allocator
+{
+public:
+    typedef T           value_type;
+    typedef T*          pointer;
+    typedef const T*    const_pointer;
+    typedef T&          reference;
+    typedef const T&    const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    /// A new file is zero-filled
+    static const bool zero_filled = true;
+
+    /// The items outlive the containers
+    static const bool persistent = true;
+
+    template <class U>
+    struct rebind { typedef mapped_file_allocator<U> other; };
+
+    mapped_file_allocator( memory_arena* arena = 0 ) : m_arena( arena ) {}
+
+    template <class U>
+    mapped_file_allocator( const mapped_file_allocator<U>& other )
+        : m_arena( other.arena() ) {}
+
+    /// @throw std::bad_alloc if the arena is full
+    T* allocate( size_type n )
+    {
+        void* p = m_arena ? m_arena->allocate( n * sizeof( T ) ) : 0;
+        if ( ! p )
+            throw std::bad_alloc();
+
+        return static_cast<T*>( p );
+    }
+
+    void deallocate( T*, size_type ) {}
+
+    memory_arena* arena() const { return m_arena; }
+
+    bool operator==( const mapped_file_allocator& other ) const
+    {
+        return m_arena == other.m_arena;
+    }
+
+    bool operator!=( const mapped_file_allocator& other ) const
+    {
+        return m_arena != other.m_arena;
+    }
+
+private:
+    memory_arena* m_arena; ///< The memory holding the arrays
+};
+
+template <class T>
+const bool mapped_file_allocator<T>::zero_filled;
+
+template <class T>
+const bool mapped_file_allocator<T>::persistent;
+
+} // namespace mm
+
+#endif // _MM_MAPPED_FILE_HPP_
@@ -0,0 +1,267 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _MM_MMAP_ALLOCATOR_HPP_
+#define _MM_MMAP_ALLOCATOR_HPP_
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mm
+{
+
+/** Page sizes that can back the memory of an mmap_allocator.
+ *
+ *  - @p small_pages : the base pages of the system.
+ *  - @p transparent_huge_pages : the memory is aligned to 2 MB and the
+ *    kernel is asked to use transparent huge pages for it, with
+ *    madvise(MADV_HUGEPAGE). The kernel can still use base pages, when
+ *    transparent huge pages are disabled or memory is fragmented.
+ *  - @p huge_pages_2mb, @p huge_pages_1gb : the memory is mapped from the
+ *    reserved pool of huge pages (MAP_HUGETLB). When the pool is too small
+ *    the allocator falls back to transparent huge pages. With 1 GB pages,
+ *    the allocations smaller than 1 GB use 2 MB pages.
+ *
+ *  In every mode, the allocations smaller than 2 MB use base pages.
+ */
+enum page_mode
+{
+    small_pages,
+    transparent_huge_pages,
+    huge_pages_2mb,
+    huge_pages_1gb
+};
+
+/** Allocator that maps anonymous memory directly from the kernel.
+ *
+ *  The pages are mapped on demand: allocating a table only reserves
+ *  address space, and each page is faulted in (zero-filled) the first
+ *  time it is written. Since the containers keep no object in empty
+ *  buckets and do not need to zero memory that is already zero, building
+ *  a cache_map with this allocator takes constant time, and its resident
+ *  memory grows with the buckets actually used. This holds with the
+ *  default EvictRandom policy: the other policies keep their metadata in
+ *  vectors, that are filled when the table is built.
+ *
+ *  With @a Pages set to one of the huge page modes, big tables need far
+ *  fewer TLB entries, which makes random lookups cheaper. page_size()
+ *  tells which page size the last allocation actually got.
+ *
+ *  Each allocation is rounded up to whole pages, so this allocator is
+ *  meant for the big arrays of the tables, not for small objects.
+ */
+template <class T, page_mode Pages = small_pages>
+class mmap_allocator
+{
+public:
+    typedef T           value_type;
+    typedef T*          pointer;
+    typedef const T*    const_pointer;
+    typedef T&          reference;
+    typedef const T&    const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    /// The memory returned by allocate() is zero-filled
+    static const bool zero_filled = true;
+
+    template <class U>
+    struct rebind { typedef mmap_allocator<U,Pages> other; };
+
+    mmap_allocator() : m_page_size( base_page_size() ) {}
+
+    template <class U>
+    mmap_allocator( const mmap_allocator<U,Pages>& other )
+        : m_page_size( other.page_size() ) {}
+
+    /** Maps @a n objects of anonymous memory.
+     *
+     *  The memory is not reserved in the swap space (MAP_NORESERVE), so
+     *  the size of a table is not limited by the overcommit policy until
+     *  it is actually used. Huge pages from the reserved pool are the
+     *  exception: they are reserved by mmap(), so that a short pool makes
+     *  the allocation fall back instead of crashing on a page fault.
+     *
+     *  @throw std::bad_alloc if the memory cannot be mapped
+     */
+    T* allocate( size_type n )
+    {
+        const size_type page = page_for( n );
+        const size_type size = bytes( n );
+        void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+        if ( page > huge_page_size
+             || ( page == huge_page_size && Pages != transparent_huge_pages ) )
+        {
+            p = mmap( 0, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+                      | hugetlb_flags( page ), -1, 0 );
+            if ( p != MAP_FAILED )
+            {
+                m_page_size = page;
+                return static_cast<T*>( p );
+            }
+        }
+#endif
+
+        if ( page == base_page_size() )
+            p = mmap( 0, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        else
+            p = map_aligned( size );
+
+        if ( p == MAP_FAILED )
+            throw std::bad_alloc();
+
+        m_page_size = base_page_size();
+#ifdef MADV_HUGEPAGE
+        if ( page != base_page_size()
+             && madvise( p, size, MADV_HUGEPAGE ) == 0
+             && transparent_huge_pages_enabled() )
+            m_page_size = huge_page_size;
+#endif
+        return static_cast<T*>( p );
+    }
+
+    void deallocate( T* p, size_type n )
+    {
+        if ( p )
+            munmap( p, bytes( n ) );
+    }
+
+    /** Returns the size of the pages backing the last allocation.
+     *
+     *  For transparent huge pages this is the size the kernel was asked
+     *  for: it can still back some of the memory with base pages.
+     */
+    size_type page_size() const { return m_page_size; }
+
+    bool operator==( const mmap_allocator& ) const { return true; }
+    bool operator!=( const mmap_allocator& ) const { return false; }
+
+protected:
+    /// Size of @a n objects, rounded up to whole pages
+    static size_type bytes( size_type n )
+    {
+        const size_type page = page_for( n );
+        const size_type size = n * sizeof( T );
+        return ( size + page - 1 ) / page * page + ( size == 0 ) * page;
+    }
+
+private:
+    /// Size of transparent huge pages, and of the smaller hugetlb pages
+    static const size_type huge_page_size = size_type( 1 ) << 21;
+
+    static size_type base_page_size() { return sysconf( _SC_PAGESIZE ); }
+
+    /// Biggest page size of the mode that fits in @a n objects: the
+    /// allocations smaller than a huge page just use base pages
+    static size_type page_for( size_type n )
+    {
+        const size_type size = n * sizeof( T );
+        if ( Pages == huge_pages_1gb && size >= ( size_type( 1 ) << 30 ) )
+            return size_type( 1 ) << 30;
+        if ( Pages != small_pages && size >= huge_page_size )
+            return huge_page_size;
+        return base_page_size();
+    }
+
+
+#ifdef MAP_HUGETLB
+    /// Selects the size of the pages of MAP_HUGETLB mappings
+    static int hugetlb_flags( size_type page )
+    {
+#ifdef MAP_HUGE_SHIFT
+        return ( page > huge_page_size ? 30 : 21 ) << MAP_HUGE_SHIFT;
+#else
+        return 0;
+#endif
+    }
+#endif
+
+    /// Maps @a size bytes aligned to a huge page, so that they can be
+    /// backed by huge pages from the first byte
+    static void* map_aligned( size_type size )
+    {
+        const size_type align = huge_page_size;
+        char* p = static_cast<char*>(
+            mmap( 0, size + align, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 ) );
+        if ( p == MAP_FAILED )
+            return MAP_FAILED;
+
+        // Unmap the misaligned head and the rest of the tail
+        const size_type head = ( align - size_type( p ) % align ) % align;
+        if ( head )
+            munmap( p, head );
+        munmap( p + head + size, align - head );
+        return p + head;
+    }
+
+    /// Tells whether the kernel uses transparent huge pages for the
+    /// memory advised with MADV_HUGEPAGE
+    static bool transparent_huge_pages_enabled()
+    {
+        FILE* f = fopen( "/sys/kernel/mm/transparent_hugepage/enabled", "r" );
+        if ( ! f )
+            return false;
+
+        char mode[ 64 ] = "";
+        const bool read = fgets( mode, sizeof( mode ), f ) != 0;
+        fclose( f );
+        return read && ! strstr( mode, "[never]" );
+    }
+
+    size_type m_page_size; ///< Page size of the last allocation
+};
+
+template <class T, page_mode Pages>
+const bool mmap_allocator<T,Pages>::zero_filled;
+
+template <class T, page_mode Pages>
+const typename mmap_allocator<T,Pages>::size_type
+mmap_allocator<T,Pages>::huge_page_size;
+
+} // namespace mm
+
+#endif // _MM_MMAP_ALLOCATOR_HPP_
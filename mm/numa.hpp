@@ -0,0 +1,258 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_NUMA_HPP_
+#define _MM_NUMA_HPP_
+
+#include "mmap_allocator.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// Maximum number of NUMA nodes handled by the placement functions.
+#define MM_NUMA_MAX_NODES 64
+
+/**
+ * NUMA placement.
+ *
+ * The functions talk to the kernel with raw system calls (mbind, getcpu)
+ * and read the topology from /sys, so that no libnuma is needed. On
+ * systems without NUMA support they see a single node 0, and the
+ * placement requests fail harmlessly.
+ */
+namespace mm
+{
+
+namespace detail
+{
+
+/// Parses a list of ranges like "0-3,8,10-11" into its numbers
+inline std::vector<int> parse_list( const char* path )
+{
+    std::vector<int> items;
+    FILE* f = fopen( path, "r" );
+    if ( ! f )
+        return items;
+
+    int first, last;
+    while ( fscanf( f, "%d", &first ) == 1 )
+    {
+        last = first;
+        int c = fgetc( f );
+        if ( c == '-' )
+        {
+            if ( fscanf( f, "%d", &last ) != 1 )
+                break;
+            c = fgetc( f );
+        }
+
+        for ( int i = first; i <= last; ++i )
+            items.push_back( i );
+        if ( c != ',' )
+            break;
+    }
+
+    fclose( f );
+    return items;
+}
+
+// Memory policies of mbind(), from <linux/mempolicy.h>
+enum { mpol_preferred = 1, mpol_interleave = 3 };
+
+/// Applies a memory policy on the nodes of @a mask to a range of memory
+inline bool mbind( void* p, size_t size, int mode, unsigned long mask )
+{
+#ifdef SYS_mbind
+    // The kernel reads one bit less than the given number of nodes
+    return syscall( SYS_mbind, p, size, mode, &mask,
+                    sizeof( mask ) * 8 + 1, 0 ) == 0;
+#else
+    return false;
+#endif
+}
+
+} // namespace detail
+
+/// Returns the number of NUMA nodes of the system
+inline int numa_node_count()
+{
+    const std::vector<int> nodes =
+        detail::parse_list( "/sys/devices/system/node/online" );
+    if ( nodes.empty() )
+        return 1;
+
+    const int count = nodes.back() + 1;
+    return count < MM_NUMA_MAX_NODES ? count : MM_NUMA_MAX_NODES;
+}
+
+/// Returns the CPUs of a NUMA node
+inline std::vector<int> numa_node_cpus( int node )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ),
+              "/sys/devices/system/node/node%d/cpulist", node );
+    return detail::parse_list( path );
+}
+
+/// Returns the NUMA node of the CPU running the calling thread
+inline int numa_current_node()
+{
+    unsigned cpu = 0, node = 0;
+#ifdef SYS_getcpu
+    if ( syscall( SYS_getcpu, &cpu, &node, 0 ) != 0 )
+        node = 0;
+#endif
+    return node < MM_NUMA_MAX_NODES ? int( node ) : 0;
+}
+
+/** Restricts the calling thread to the CPUs of a NUMA node.
+ *
+ *  @return false if the node has no CPU or the affinity cannot be set
+ */
+inline bool numa_run_on_node( int node )
+{
+    const std::vector<int> cpus = numa_node_cpus( node );
+    if ( cpus.empty() )
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for ( size_t i = 0; i < cpus.size(); ++i )
+        CPU_SET( cpus[ i ], &set );
+    return sched_setaffinity( 0, sizeof( set ), &set ) == 0;
+}
+
+/** Spreads the pages of a range of memory over all the nodes, round
+ *  robin. Must be called before the pages are first touched.
+ */
+inline bool numa_interleave( void* p, size_t size )
+{
+    const int nodes = numa_node_count();
+    const unsigned long mask = nodes < 64 ? ( 1UL << nodes ) - 1 : ~0UL;
+    return detail::mbind( p, size, detail::mpol_interleave, mask );
+}
+
+/** Places the pages of a range of memory on a node, or on other nodes
+ *  when it is full. Must be called before the pages are first touched.
+ *
+ *  @return false, leaving the pages alone, if @a node is not below
+ *  MM_NUMA_MAX_NODES or the kernel refuses the policy
+ */
+inline bool numa_prefer( void* p, size_t size, int node )
+{
+    if ( node < 0 || node >= MM_NUMA_MAX_NODES )
+        return false;
+
+    return detail::mbind( p, size, detail::mpol_preferred, 1UL << node );
+}
+
+/// The node argument of numa_allocator that interleaves the memory
+static const int numa_interleaved = -1;
+
+/** Allocator that places the memory on chosen NUMA nodes.
+ *
+ *  It maps memory like mmap_allocator (with the same @a Pages modes), and
+ *  sets the NUMA policy of the pages before they are touched. The pages
+ *  are either interleaved over all the nodes (the default), which evens
+ *  out the cost of a table shared by all the CPUs, or placed on a single
+ *  node, for data mostly used by the CPUs of that node.
+ *
+ *  The node is part of the state of the allocator, and is propagated to
+ *  the rebound allocators and to the copies of the containers.
+ */
+template <class T, page_mode Pages = small_pages>
+class numa_allocator : public mmap_allocator<T, Pages>
+{
+public:
+    typedef typename mmap_allocator<T, Pages>::size_type size_type;
+
+    template <class U>
+    struct rebind { typedef numa_allocator<U,Pages> other; };
+
+    /** Constructor.
+     *
+     *  @param node the node of the memory, or numa_interleaved
+     */
+    numa_allocator( int node = numa_interleaved ) : m_node( node ) {}
+
+    template <class U>
+    numa_allocator( const numa_allocator<U,Pages>& other )
+        : mmap_allocator<T, Pages>( other ), m_node( other.node() ) {}
+
+    /** Maps @a n objects, placed following the node of the allocator.
+     *
+     *  A failure to set the NUMA policy is not an error: the pages are
+     *  then placed on the node that first touches them.
+     *
+     *  @throw std::bad_alloc if the memory cannot be mapped
+     */
+    T* allocate( size_type n )
+    {
+        T* p = mmap_allocator<T, Pages>::allocate( n );
+        const size_type size = this->bytes( n );
+        if ( m_node == numa_interleaved )
+            numa_interleave( p, size );
+        else
+            numa_prefer( p, size, m_node );
+
+        return p;
+    }
+
+    /// Returns the node of the memory, or numa_interleaved
+    int node() const { return m_node; }
+
+    bool operator==( const numa_allocator& other ) const
+    {
+        return m_node == other.m_node;
+    }
+
+    bool operator!=( const numa_allocator& other ) const
+    {
+        return m_node != other.m_node;
+    }
+
+private:
+    int m_node; ///< Node of the memory, or numa_interleaved
+};
+
+} // namespace mm
+
+#endif // _MM_NUMA_HPP_
@@ -0,0 +1,165 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_PERSISTENT_CACHE_MAP_HPP_
+#define _MM_PERSISTENT_CACHE_MAP_HPP_
+
+#include "cache_map.hpp"
+#include "mapped_file.hpp"
+
+#include <type_traits>
+
+namespace mm
+{
+
+namespace detail
+{
+
+/// Holds the file of a persistent_cache_map, so that it is opened before
+/// the table is built and closed after the table is destroyed
+struct mapped_file_holder
+{
+    mapped_file_holder( const char* path, const mapped_file_header& layout )
+        : m_file( path, layout ) {}
+
+    mapped_file m_file;
+};
+
+} // namespace detail
+
+/** Persistent cache map
+ *
+ *  A cache_map whose arrays live in a file mapped in memory, on a local
+ *  disk or on tmpfs. The items survive the process: a new map attached to
+ *  the same file starts with the items of the previous one, without
+ *  reading them, and the kernel pages in only the parts that are used.
+ *
+ *  The file records the layout of the table and an identifier of the hash
+ *  function, and the map refuses to attach a file written by a table with
+ *  a different key or data size, bucket count, number of ways or hash
+ *  function. A file left by a crashed process is emptied (see
+ *  mapped_file).
+ *
+ *  The keys and the data must be trivially copyable, with no pointers to
+ *  other memory: fixed_string can be used for string keys. The map cannot
+ *  be resized nor copied, and lazy clear is not available. The eviction
+ *  policies keep their metadata in ordinary memory, so the usage history
+ *  of the items is lost when the file is attached again.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  The parameters are the same of cache_map, except the allocator.
+ */
+template < class Key,
+           class T,
+           class HashFunction = hash<Key>,
+           class KeyEqual = std::equal_to<Key>,
+           class DiscardFunction = DiscardIgnore< pair<Key,T> >,
+           size_t Ways = 1,
+           class EvictionPolicy = EvictRandom
+>
+class persistent_cache_map
+    : private detail::mapped_file_holder,
+      public cache_map< Key, T, HashFunction, KeyEqual, DiscardFunction,
+                        mapped_file_allocator< pair<Key,T> >, Ways,
+                        EvictionPolicy >
+{
+    static_assert( std::is_trivially_copyable<Key>::value
+                   && std::is_trivially_copyable<T>::value,
+                   "persistent_cache_map needs trivially copyable types" );
+
+    typedef cache_map< Key, T, HashFunction, KeyEqual, DiscardFunction,
+                       mapped_file_allocator< pair<Key,T> >, Ways,
+                       EvictionPolicy > base;
+
+public:
+    typedef typename base::size_type      size_type;
+    typedef typename base::hasher         hasher;
+    typedef typename base::key_equal      key_equal;
+    typedef typename base::allocator_type allocator_type;
+
+    /** Attaches a file, creating it if missing.
+     *
+     *  @param path    the path of the file
+     *  @param n       the number of buckets
+     *  @param hash_id an identifier of the hash function, to be changed
+     *                 when the hash values of the keys change
+     *  @throw std::runtime_error if the file cannot be attached
+     */
+    persistent_cache_map( const char* path, size_type n,
+                          uint64_t hash_id = default_hash_id() )
+        : detail::mapped_file_holder( path, layout( n, hash_id ) ),
+          base( n, hasher(), key_equal(), allocator_type( &m_file ) )
+    {}
+
+    /** Tells whether the map started empty, because the file was missing
+     *  or had not been detached cleanly.
+     */
+    bool created() const { return m_file.created(); }
+
+    /** Starts writing back the modified items to the file, without
+     *  waiting. They are written back anyway when the map is destroyed.
+     */
+    void sync() { m_file.sync(); }
+
+    /** Identifier of the hash function (see hash_function_id()). */
+    static uint64_t default_hash_id()
+    {
+        return hash_function_id<Key, HashFunction>();
+    }
+
+    /// The arrays cannot be exchanged between two files
+    friend void swap( persistent_cache_map&, persistent_cache_map& ) = delete;
+
+private:
+    persistent_cache_map( const persistent_cache_map& );
+    persistent_cache_map& operator= ( const persistent_cache_map& );
+
+    // The arrays have the size recorded in the file
+    using base::resize;
+    using base::enable_lazy_clear;
+    using base::swap;
+
+    /// The header of the file of a table with @a n buckets
+    static mapped_file_header layout( size_type n, uint64_t hash_id )
+    {
+        return table_layout( n, Ways, sizeof( pair<Key,T> ), hash_id );
+    }
+};
+
+} // namespace mm
+
+#endif // _MM_PERSISTENT_CACHE_MAP_HPP_
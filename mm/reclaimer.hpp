@@ -0,0 +1,285 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_RECLAIMER_HPP_
+#define _MM_RECLAIMER_HPP_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// Default number of items retired by a table before handing them over
+#define MM_RETIRE_BATCH 256
+
+namespace mm
+{
+
+/** Reclaimer of retired items.
+ *
+ *  Destroys, away from the threads that use the tables, the items they
+ *  evicted: freeing values that own big heap structures (like a vector of
+ *  strings) can take longer than the insertion that evicted them.
+ *
+ *  The tables collect their victims in a retire list, with the
+ *  DiscardRetire discard function, and hand the full lists over to the
+ *  reclaimer. A background thread destroys them, or, without the thread,
+ *  reclaim() destroys them at a quiescent point chosen by the program.
+ *  The emptied lists are given back to the tables, so that retiring items
+ *  does not allocate memory once the lists have grown.
+ */
+template <class V>
+class reclaimer
+{
+public:
+    /** Creates a reclaimer.
+     *
+     *  @param background true to destroy the items in a background thread,
+     *                    false to destroy them when reclaim() is called
+     *  @param batch      the size of the retire lists
+     */
+    reclaimer( bool background = true, size_t batch = MM_RETIRE_BATCH )
+        : m_batch( batch ),
+          m_retired( 0 ),
+          m_reclaimed( 0 ),
+          m_stop( false )
+    {
+        if ( background )
+            m_thread = std::thread( &reclaimer::run, this );
+    }
+
+    /// Destroys the retired items and stops the thread
+    ~reclaimer()
+    {
+        if ( m_thread.joinable() )
+        {
+            {
+                std::lock_guard<std::mutex> guard( m_mutex );
+                m_stop = true;
+            }
+            m_wake.notify_one();
+            m_thread.join();
+        }
+
+        reclaim();
+    }
+
+    /** Takes over a retire list, giving back an empty one.
+     *
+     *  @param list the retired items, replaced by an empty list
+     */
+    void retire( std::vector<V>& list )
+    {
+        if ( list.empty() )
+            return;
+
+        std::vector<V> empty;
+        {
+            std::lock_guard<std::mutex> guard( m_mutex );
+            m_retired += list.size();
+            m_full.push_back( std::move( list ) );
+            if ( ! m_free.empty() )
+            {
+                empty = std::move( m_free.back() );
+                m_free.pop_back();
+            }
+        }
+
+        list = std::move( empty );
+        list.reserve( m_batch );
+        m_wake.notify_one();
+    }
+
+    /** Destroys the retired items in the calling thread. */
+    void reclaim()
+    {
+        std::vector< std::vector<V> > full;
+        {
+            std::lock_guard<std::mutex> guard( m_mutex );
+            full.swap( m_full );
+        }
+
+        destroy( full );
+    }
+
+    /** Waits for the background thread to destroy the retired items.
+     *  Without the thread, destroys them in the calling thread.
+     */
+    void flush()
+    {
+        if ( ! m_thread.joinable() )
+        {
+            reclaim();
+            return;
+        }
+
+        std::unique_lock<std::mutex> guard( m_mutex );
+        m_done.wait( guard, [this] { return m_reclaimed == m_retired; } );
+    }
+
+    /** Get the size of the retire lists. */
+    size_t batch() const { return m_batch; }
+
+    /** Get the number of items handed over. */
+    size_t num_retired() const
+    {
+        std::lock_guard<std::mutex> guard( m_mutex );
+        return m_retired;
+    }
+
+    /** Get the number of items destroyed. */
+    size_t num_reclaimed() const
+    {
+        std::lock_guard<std::mutex> guard( m_mutex );
+        return m_reclaimed;
+    }
+
+    /** Get the number of items handed over and not destroyed yet. */
+    size_t pending() const
+    {
+        std::lock_guard<std::mutex> guard( m_mutex );
+        return m_retired - m_reclaimed;
+    }
+
+private:
+    reclaimer( const reclaimer& );
+    reclaimer& operator= ( const reclaimer& );
+
+    /// Destroys the items of the lists, and keeps the lists for reuse
+    void destroy( std::vector< std::vector<V> >& full )
+    {
+        size_t count = 0;
+        for ( size_t i = 0; i < full.size(); ++i )
+        {
+            count += full[ i ].size();
+            full[ i ].clear();
+        }
+
+        std::lock_guard<std::mutex> guard( m_mutex );
+        for ( size_t i = 0; i < full.size(); ++i )
+            m_free.push_back( std::move( full[ i ] ) );
+
+        m_reclaimed += count;
+        m_done.notify_all();
+    }
+
+    /// The background thread
+    void run()
+    {
+        std::vector< std::vector<V> > full;
+        for ( ;; )
+        {
+            {
+                std::unique_lock<std::mutex> guard( m_mutex );
+                m_wake.wait( guard, [this] {
+                    return m_stop || ! m_full.empty(); } );
+                if ( m_full.empty() )
+                    return;
+
+                full.swap( m_full );
+            }
+
+            destroy( full );
+            full.clear();
+        }
+    }
+
+    size_t                        m_batch;     ///< Size of the retire lists
+    size_t                        m_retired;   ///< Items handed over
+    size_t                        m_reclaimed; ///< Items destroyed
+    bool                          m_stop;      ///< The thread must stop
+    std::vector< std::vector<V> > m_full;      ///< Lists to be destroyed
+    std::vector< std::vector<V> > m_free;      ///< Emptied lists
+    mutable std::mutex            m_mutex;     ///< Protects the lists
+    std::condition_variable       m_wake;      ///< Wakes the thread up
+    std::condition_variable       m_done;      ///< Signals reclaimed items
+    std::thread                   m_thread;    ///< The background thread
+};
+
+/** Discard function that retires the discarded items.
+ *
+ *  The victims are moved into a retire list of the table, and the table
+ *  only destroys what is left of them: for most types, an empty shell
+ *  that owns no memory. The full lists are handed over to the reclaimer
+ *  set with reclaimer(): until then, the victims are destroyed in place.
+ *
+ *  Each table has its own list (each shard, for concurrent_cache_map), so
+ *  retiring an item takes no lock. The reclaimer must outlive the table.
+ */
+template <class V>
+class DiscardRetire
+{
+public:
+    DiscardRetire() : m_reclaimer( 0 ) {}
+
+    /// Hands the retired items over
+    ~DiscardRetire() { flush(); }
+
+    void operator() ( V&& old_value, const V& new_value )
+    {
+        if ( ! m_reclaimer )
+            return;
+
+        m_list.push_back( std::move( old_value ) );
+        if ( m_list.size() >= m_reclaimer->batch() )
+            m_reclaimer->retire( m_list );
+    }
+
+    /// Sets the reclaimer of the retired items
+    void reclaimer( mm::reclaimer<V>* r )
+    {
+        flush();
+        m_reclaimer = r;
+        if ( r )
+            m_list.reserve( r->batch() );
+    }
+
+    /// Hands the items retired so far over to the reclaimer
+    void flush()
+    {
+        if ( m_reclaimer )
+            m_reclaimer->retire( m_list );
+    }
+
+private:
+    mm::reclaimer<V>* m_reclaimer; ///< Destroys the retired items
+    std::vector<V>    m_list;      ///< The items retired by the table
+};
+
+} // namespace mm
+
+#endif // _MM_RECLAIMER_HPP_
@@ -0,0 +1,209 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_REPLICATED_CACHE_MAP_HPP_
+#define _MM_REPLICATED_CACHE_MAP_HPP_
+
+#include "concurrent_cache_map.hpp"
+#include "numa.hpp"
+
+#include <memory>
+#include <vector>
+
+#include <sched.h>
+
+namespace mm
+{
+
+/** Per-node replicas of a concurrent cache map.
+ *
+ *  For read-mostly caches on NUMA systems: each node has its own copy of
+ *  the map, in memory local to the node, and lookups only read the
+ *  replica of the node of the calling thread. Every write goes to all the
+ *  replicas, so writes cost one update per node, but lookups never pay
+ *  the latency of remote memory.
+ *
+ *  The replicas are updated one after the other, each one under its own
+ *  locks: a lookup on a node can see a write before a lookup on another
+ *  node does. Since each replica evicts items on its own, a key can be
+ *  present in a replica and missing in another one.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  - @a Map : the type of the replicas, a concurrent_cache_map whose
+ *    allocator can be constructed from a node number, like
+ *    numa_allocator.
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template <class Map>
+class replicated_cache_map
+{
+public:
+    typedef typename Map::key_type       key_type;
+    typedef typename Map::data_type      data_type;
+    typedef typename Map::value_type     value_type;
+    typedef typename Map::size_type      size_type;
+    typedef typename Map::hasher         hasher;
+    typedef typename Map::key_equal      key_equal;
+    typedef typename Map::allocator_type allocator_type;
+
+    /** Constructor.
+     *
+     *  @param n      the number of buckets of each replica
+     *  @param shards the number of shards of each replica
+     */
+    explicit replicated_cache_map( size_type n = MM_DEFAULT_TABLE_SIZE,
+                                   size_type shards = MM_DEFAULT_SHARDS )
+    {
+        const int nodes = numa_node_count();
+        for ( int node = 0; node < nodes; ++node )
+        {
+            m_replicas.emplace_back( new Map( n, shards, hasher(),
+                                              key_equal(),
+                                              allocator_type( node ) ) );
+
+            const std::vector<int> cpus = numa_node_cpus( node );
+            for ( size_t i = 0; i < cpus.size(); ++i )
+            {
+                if ( size_t( cpus[ i ] ) >= m_cpu_nodes.size() )
+                    m_cpu_nodes.resize( cpus[ i ] + 1, 0 );
+                m_cpu_nodes[ cpus[ i ] ] = node;
+            }
+        }
+    }
+
+    /** Finds the item with the given key in the replica of the local node
+     *  and copies its data.
+     *
+     *  @return true if the key was found
+     */
+    bool find( const key_type& key, data_type& data )
+    {
+        return local().find( key, data );
+    }
+
+    /** Inserts an item in all the replicas.
+     *
+     *  @return true if the item was inserted in the replica of the local
+     *  node
+     */
+    bool insert( const key_type& key, const data_type& data )
+    {
+        Map& self = local();
+        bool inserted = false;
+        for ( size_type i = 0; i < m_replicas.size(); ++i )
+        {
+            const bool done = m_replicas[ i ]->insert( key, data );
+            if ( m_replicas[ i ].get() == &self )
+                inserted = done;
+        }
+
+        return inserted;
+    }
+
+    /** Inserts an item in all the replicas.
+     *  @see insert( const key_type&, const data_type& )
+     */
+    bool insert( const value_type& obj )
+    {
+        return insert( obj.first, obj.second );
+    }
+
+    /** Erases the element identified by the key from all the replicas.
+     *
+     *  @return the number of deleted items in the replica of the local
+     *  node, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        Map& self = local();
+        size_type erased = 0;
+        for ( size_type i = 0; i < m_replicas.size(); ++i )
+        {
+            const size_type n = m_replicas[ i ]->erase( key );
+            if ( m_replicas[ i ].get() == &self )
+                erased = n;
+        }
+
+        return erased;
+    }
+
+    /** Erases all the elements of all the replicas. */
+    void clear()
+    {
+        for ( size_type i = 0; i < m_replicas.size(); ++i )
+            m_replicas[ i ]->clear();
+    }
+
+    /** Get the size of the replica of the local node. */
+    size_type size() const { return local().size(); }
+
+    /** Test for empty. */
+    bool empty() const { return size() == 0; }
+
+    /** Get the number of replicas, one for each node. */
+    size_type replica_count() const { return m_replicas.size(); }
+
+    /** Returns the replica of a node. */
+    Map& replica( int node ) { return *m_replicas[ node ]; }
+
+    /** Returns the replica of the node of the calling thread. */
+    Map& local() const { return *m_replicas[ current_node() ]; }
+
+private:
+    replicated_cache_map( const replicated_cache_map& );
+    replicated_cache_map& operator= ( const replicated_cache_map& );
+
+    /// The node of the calling thread, from the CPU it is running on: the
+    /// CPU is read without a system call, where the C library can
+    int current_node() const
+    {
+        const int cpu = sched_getcpu();
+        if ( cpu < 0 || size_t( cpu ) >= m_cpu_nodes.size() )
+            return 0;
+
+        return m_cpu_nodes[ cpu ];
+    }
+
+    std::vector< std::unique_ptr<Map> > m_replicas;  ///< One for each node
+    std::vector<int>                    m_cpu_nodes; ///< Node of each CPU
+};
+
+} // namespace mm
+
+#endif // _MM_REPLICATED_CACHE_MAP_HPP_
@@ -0,0 +1,557 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_SHARED_CACHE_MAP_HPP_
+#define _MM_SHARED_CACHE_MAP_HPP_
+
+#include "cache_map.hpp"
+#include "hash_fun.hpp"
+#include "locks.hpp"
+#include "mapped_file.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Maximum number of lock stripes of a shared_cache_map.
+#define MM_SHARED_STRIPES 1024
+
+/// Number of lock-free attempts of a lookup, before taking the lock.
+#define MM_SHARED_READ_ATTEMPTS 1000
+
+namespace mm
+{
+
+/** A lock stripe of a shared_cache_map, on its own cache line.
+ *
+ *  The stripe counts the items of its sets. They only change under the
+ *  lock, so the count of the other sets, recorded before a set is
+ *  modified, stays exact if the writer dies: the repair erases the set and
+ *  restores that count.
+ */
+struct alignas( MM_CACHE_LINE_SIZE ) shared_stripe
+{
+    shared_stripe() : writing( -1 ), items( 0 ), others( 0 ) {}
+
+    robust_lock          lock;    ///< Serializes the writers of the sets
+    std::atomic<int64_t> writing; ///< Set being modified, or -1
+    std::atomic<int64_t> items;   ///< Number of items in the sets
+    int64_t              others;  ///< Items outside the modified set
+};
+
+/// Header of the shared memory segments, in their first page
+struct shared_segment_header
+{
+    enum { ready = 1 };
+
+    mapped_file_header    layout; ///< The table (the clean flag is unused)
+    std::atomic<uint32_t> state;  ///< 0 while the segment is being built
+};
+
+/** A POSIX shared memory segment, that holds a table and its locks.
+ *
+ *  The segment starts with a page holding a shared_segment_header,
+ *  followed by the lock stripes, the sequence counters of the sets and the
+ *  arrays of the table, handed out in order by allocate().
+ *
+ *  The first process creates and initializes the segment, the others
+ *  wait for it to be ready and check that it holds a table with the same
+ *  layout and hash function. The segment stays in the system until it is
+ *  removed, even when no process has it mapped.
+ */
+class shared_segment : public memory_arena
+{
+public:
+    /// Size of the header, one page
+    static const size_t header_size = 4096;
+
+    /** Opens a segment, creating it if missing.
+     *
+     *  @param name    the name of the segment, like "/my_cache"
+     *  @param layout  the expected table (magic, checksum and clean are
+     *                 ignored)
+     *  @param stripes the number of lock stripes
+     *  @param sets    the number of sets of the table
+     *  @throw std::runtime_error if the segment cannot be opened, was
+     *         created for a different table or was never made ready
+     */
+    shared_segment( const char* name, const mapped_file_header& layout,
+                    size_t stripes, size_t sets )
+        : m_base( 0 ), m_total( 0 ), m_stripes( 0 ), m_counters( 0 ),
+          m_created( false )
+    {
+        static const char magic[ 8 ] = { 'M', 'M', 'S', 'H',
+                                          'A', 'R', 'E', '2' };
+
+        mapped_file_header h = layout;
+        std::memcpy( h.magic, magic, sizeof( h.magic ) );
+        h.clean = 0;
+        h.checksum = hash_bytes( &h, offsetof( mapped_file_header,
+                                               checksum ) );
+
+        const size_t stripes_size = aligned( stripes * sizeof(shared_stripe) );
+        const size_t counters_size = aligned( sets * sizeof(seq_counter) );
+        m_total = header_size + stripes_size + counters_size + h.data_size;
+
+        int fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+        m_created = ( fd >= 0 );
+        if ( fd < 0 && errno == EEXIST )
+            fd = shm_open( name, O_RDWR, 0 );
+        if ( fd < 0 )
+            fail( name, "cannot be opened" );
+
+        // The creator sizes the segment, the others wait for it
+        bool sized = m_created && ftruncate( fd, m_total ) == 0;
+        for ( int i = 0; ! m_created && ! sized && i < 5000; ++i )
+        {
+            struct stat st;
+            if ( fstat( fd, &st ) != 0 )
+                break;
+            if ( st.st_size != 0 )
+            {
+                sized = ( size_t( st.st_size ) == m_total );
+                break;
+            }
+            usleep( 1000 );
+        }
+
+        void* p = sized ? mmap( 0, m_total, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0 )
+                        : MAP_FAILED;
+        close( fd );
+        if ( p == MAP_FAILED )
+        {
+            if ( m_created )
+                shm_unlink( name );
+            fail( name, sized ? "cannot be mapped"
+                              : "holds a table with a different layout" );
+        }
+
+        m_base = static_cast<char*>( p );
+        m_stripes = reinterpret_cast<shared_stripe*>( m_base + header_size );
+        m_counters = reinterpret_cast<seq_counter*>(
+            m_base + header_size + stripes_size );
+        m_data = m_base + header_size + stripes_size + counters_size;
+        m_size = h.data_size;
+
+        shared_segment_header& header = this->header();
+        if ( m_created )
+        {
+            // The memory is zero-filled: the state is not ready yet
+            new ( &header ) shared_segment_header();
+            header.layout = h;
+            for ( size_t i = 0; i < stripes; ++i )
+                new ( m_stripes + i ) shared_stripe();
+            for ( size_t i = 0; i < sets; ++i )
+                new ( m_counters + i ) seq_counter();
+            header.state.store( shared_segment_header::ready,
+                                std::memory_order_release );
+            return;
+        }
+
+        for ( int i = 0; header.state.load( std::memory_order_acquire )
+                         != shared_segment_header::ready; ++i )
+        {
+            if ( i == 5000 )
+                fail( name, "was never made ready" );
+            usleep( 1000 );
+        }
+
+        if ( std::memcmp( &header.layout, &h, sizeof( h ) ) != 0 )
+            fail( name, "holds a table with a different layout or hash "
+                        "function" );
+    }
+
+    /// Unmaps the segment, which stays in the system
+    ~shared_segment() { munmap( m_base, m_total ); }
+
+    shared_segment_header& header()
+    {
+        return *reinterpret_cast<shared_segment_header*>( m_base );
+    }
+
+    shared_stripe* stripes()  { return m_stripes;  }
+    seq_counter*   counters() { return m_counters; }
+
+    /// Tells whether this process created the segment
+    bool created() const { return m_created; }
+
+private:
+    shared_segment( const shared_segment& );
+    shared_segment& operator= ( const shared_segment& );
+
+    void fail( const char* name, const char* reason )
+    {
+        if ( m_base )
+            munmap( m_base, m_total );
+        throw std::runtime_error( std::string( "mm::shared_segment: " ) + name
+                                  + " " + reason );
+    }
+
+    char*          m_base;     ///< The mapped segment
+    size_t         m_total;    ///< Size of the segment
+    shared_stripe* m_stripes;  ///< The lock stripes
+    seq_counter*   m_counters; ///< The sequence counters of the sets
+    bool           m_created;  ///< True if this process created it
+};
+
+namespace detail
+{
+
+/// Holds the segment of a shared_cache_map, so that it is mapped before
+/// the table is built and unmapped after the table is destroyed
+struct shared_segment_holder
+{
+    shared_segment_holder( const char* name, const mapped_file_header& layout,
+                           size_t stripes, size_t sets )
+        : m_segment( name, layout, stripes, sets ) {}
+
+    shared_segment m_segment;
+};
+
+} // namespace detail
+
+/** Shared cache map
+ *
+ *  A cache map in a POSIX shared memory segment, used at the same time by
+ *  all the processes that open it by name: the processes of a host share
+ *  a single warm cache instead of keeping a copy each.
+ *
+ *  Each process maps the segment at its own address: the items are found
+ *  by their offset in the arrays of the table, which hold no pointers. So
+ *  the keys and the data must be trivially copyable, with no pointers to
+ *  other memory: fixed_string can be used for string keys.
+ *
+ *  The writers lock a stripe of sets with a robust_lock, and bump the
+ *  sequence counter of the set they modify (see seq_lock). Lookups take no
+ *  lock: they retry while the set is modified, and take the lock of its
+ *  stripe if that lasts too long. When a process dies in the middle of a
+ *  write, the next process to take the lock of the stripe erases the set
+ *  that was being modified, which may be inconsistent.
+ *
+ *  Like concurrent_cache_map, find() copies the data out of the map. The
+ *  eviction policy is EvictRandom: the policies with metadata would have
+ *  to keep it in the segment too.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  - @a Key, @a T, @a HashFunction, @a KeyEqual, @a Ways : the same of
+ *    cache_map.
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template < class Key,
+           class T,
+           class HashFunction = hash<Key>,
+           class KeyEqual = std::equal_to<Key>,
+           size_t Ways = 1
+>
+class shared_cache_map : private detail::shared_segment_holder
+{
+    static_assert( std::is_trivially_copyable<Key>::value
+                   && std::is_trivially_copyable<T>::value,
+                   "shared_cache_map needs trivially copyable types" );
+
+    /// The table of each process, on the arrays in the segment
+    typedef cache_table< pair<Key,T>, Key,
+                         DiscardIgnore< pair<Key,T> >, EvictRandom,
+                         HashFunction, KeyEqual,
+                         _Select1st< pair<Key,T> >,
+                         mapped_file_allocator< pair<Key,T> >, Ways
+                       > HT;
+
+public:
+    typedef typename HT::key_type   key_type;
+    typedef T                       data_type;
+    typedef T                       mapped_type;
+    typedef typename HT::value_type value_type;
+    typedef typename HT::hasher     hasher;
+    typedef typename HT::key_equal  key_equal;
+    typedef typename HT::size_type  size_type;
+
+    /** Opens the map in a shared memory segment, creating it if missing.
+     *
+     *  @param name    the name of the segment, like "/my_cache"
+     *  @param n       the number of buckets
+     *  @param hash_id an identifier of the hash function (see
+     *                 hash_function_id())
+     *  @throw std::runtime_error if the segment cannot be opened, or holds
+     *         a map with a different layout or hash function
+     */
+    shared_cache_map( const char* name, size_type n,
+                      uint64_t hash_id = default_hash_id() )
+        : detail::shared_segment_holder( name, layout( n, hash_id ),
+                                         stripe_count( n ), set_count( n ) ),
+          m_table( n, hasher(), key_equal(),
+                   typename HT::allocator_type( &m_segment ) ),
+          m_stripes( m_segment.stripes() ),
+          m_counters( m_segment.counters() ),
+          m_stripe_mask( stripe_count( n ) - 1 )
+    {}
+
+    /** Finds the item with the given key and copies its data.
+     *
+     *  @param key  the key of the item
+     *  @param data receives a copy of the data of the item, if found
+     *  @return true if the key was found
+     */
+    bool find( const key_type& key, data_type& data )
+    {
+        const size_t hash = m_hasher( key );
+        const size_t set = m_table.set_index( hash );
+        const seq_counter& seq = m_counters[ set ];
+
+        for ( int i = 0; i < MM_SHARED_READ_ATTEMPTS; ++i )
+        {
+            unsigned int start;
+            if ( ! seq.try_read_begin( start ) )
+            {
+                cpu_relax();
+                continue;
+            }
+
+            typename HT::const_iterator it = m_table.peek( key, hash );
+            const bool found = ( it != m_table.end() );
+            if ( found )
+                data = it->second;
+            if ( ! seq.read_retry( start ) )
+                return found;
+        }
+
+        // The set is being modified for too long, maybe by a process that
+        // died: the lock repairs it
+        stripe_guard guard( *this, set );
+        typename HT::const_iterator it = m_table.peek( key, hash );
+        if ( it == m_table.end() )
+            return false;
+
+        data = it->second;
+        return true;
+    }
+
+    /** Insert an item in the map.
+     *
+     *  In case of a key hash collision, the inserted item will replace the
+     *  existing one.
+     */
+    void insert( const key_type& key, const data_type& data )
+    {
+        const size_t hash = m_hasher( key );
+        write_guard guard( *this, m_table.set_index( hash ) );
+        m_table.insert( value_type( key, data ), hash );
+    }
+
+    /** Insert an item in the map.
+     *  @see insert( const key_type&, const data_type& )
+     */
+    void insert( const value_type& obj ) { insert( obj.first, obj.second ); }
+
+    /** Erases the element identified by the key.
+     *
+     *  @return the number of deleted items, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        const size_t hash = m_hasher( key );
+        write_guard guard( *this, m_table.set_index( hash ) );
+        return m_table.erase( key, hash );
+    }
+
+    /** Erases all of the elements.
+     *
+     *  The sets are erased one at a time, each one locked and recorded as
+     *  being modified like by insert(): a process that dies while clearing
+     *  leaves a single set to be repaired.
+     */
+    void clear()
+    {
+        for ( size_type set = 0; set < m_table.set_count(); ++set )
+        {
+            write_guard guard( *this, set );
+            m_table.erase_set( set );
+        }
+    }
+
+    /** Get the number of items, as counted by all the processes.
+     *
+     *  The counts of the lock stripes are added up, without locking them.
+     */
+    size_type size() const
+    {
+        int64_t n = 0;
+        for ( size_t i = 0; i <= m_stripe_mask; ++i )
+            n += m_stripes[ i ].items.load( std::memory_order_relaxed );
+        return n;
+    }
+
+    /** Test for empty. */
+    bool empty() const { return size() == 0; }
+
+    /** Get the number of buckets. */
+    size_type bucket_count() const { return m_table.bucket_count(); }
+
+    /** Tells whether this process created the segment. */
+    bool created() const { return m_segment.created(); }
+
+    /** Removes a segment from the system. The processes that have it
+     *  mapped can keep using it.
+     *
+     *  @return false if the segment does not exist
+     */
+    static bool remove( const char* name ) { return shm_unlink( name ) == 0; }
+
+    /** Identifier of the hash function (see hash_function_id()). */
+    static uint64_t default_hash_id()
+    {
+        return hash_function_id<Key, HashFunction>();
+    }
+
+private:
+    shared_cache_map( const shared_cache_map& );
+    shared_cache_map& operator= ( const shared_cache_map& );
+
+    /// Lock of the stripe of a set
+    class stripe_guard
+    {
+    public:
+        stripe_guard( shared_cache_map& map, size_t set )
+            : m_stripe( map.m_stripes[ set & map.m_stripe_mask ] )
+        {
+            map.lock_stripe( m_stripe );
+        }
+
+        ~stripe_guard() { m_stripe.lock.unlock(); }
+
+    protected:
+        shared_stripe& m_stripe;
+    };
+
+    /// Lock of the stripe of a set, while modifying the set. The change
+    /// of the number of items of the table is added to the stripe count.
+    class write_guard : public stripe_guard
+    {
+    public:
+        write_guard( shared_cache_map& map, size_t set )
+            : stripe_guard( map, set ),
+              m_map( map ),
+              m_seq( map.m_counters[ set ] ),
+              m_size( map.m_table.size() )
+        {
+            shared_stripe& stripe = this->m_stripe;
+            stripe.others = stripe.items.load( std::memory_order_relaxed )
+                            - int64_t( map.m_table.set_size( set ) );
+            stripe.writing.store( set, std::memory_order_relaxed );
+            m_seq.write_begin();
+        }
+
+        ~write_guard()
+        {
+            shared_stripe& stripe = this->m_stripe;
+            stripe.items.fetch_add( int64_t( m_map.m_table.size() - m_size ),
+                                    std::memory_order_relaxed );
+            m_seq.write_end();
+            stripe.writing.store( -1, std::memory_order_relaxed );
+        }
+
+    private:
+        shared_cache_map& m_map;
+        seq_counter&      m_seq;
+        size_t            m_size;
+    };
+
+    /// Locks a stripe, erasing the set left half written by a process
+    /// that died holding the lock. Whether or not the dead writer counted
+    /// its change, the stripe is left with the items of its other sets.
+    void lock_stripe( shared_stripe& stripe )
+    {
+        if ( ! stripe.lock.lock() )
+            return;
+
+        const int64_t set = stripe.writing.load( std::memory_order_relaxed );
+        if ( set < 0 )
+            return;
+
+        seq_counter& seq = m_counters[ set ];
+        if ( ! seq.writing() )
+            seq.write_begin();
+        m_table.erase_set( set );
+        stripe.items.store( stripe.others, std::memory_order_relaxed );
+        seq.write_end();
+        stripe.writing.store( -1, std::memory_order_relaxed );
+    }
+
+    static size_t set_count( size_type n )
+    {
+        size_t buckets = Ways;
+        while ( buckets < n )
+            buckets <<= 1;
+
+        return buckets / Ways;
+    }
+
+    static size_t stripe_count( size_type n )
+    {
+        return std::min( set_count( n ), size_t( MM_SHARED_STRIPES ) );
+    }
+
+    /// The layout of the table, with @a n buckets
+    static mapped_file_header layout( size_type n, uint64_t hash_id )
+    {
+        return table_layout( n, Ways, sizeof( value_type ), hash_id );
+    }
+
+    HT                     m_table;       ///< The table of this process
+    HashFunction           m_hasher;      ///< Hasher of the keys
+    shared_stripe*         m_stripes;     ///< Lock stripes
+    seq_counter*           m_counters;    ///< Sequence counters of the sets
+    size_t                 m_stripe_mask; ///< Mask of the stripe bits
+};
+
+} // namespace mm
+
+#endif // _MM_SHARED_CACHE_MAP_HPP_
@@ -0,0 +1,166 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_SNAPSHOT_HPP_
+#define _MM_SNAPSHOT_HPP_
+
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <stdint.h>
+
+/**
+ * Snapshots of the tables.
+ *
+ * cache_table::save() writes the items of a table to a file, and
+ * cache_table::load() reads them back, to warm up a cache after a
+ * restart. The items are written by a serializer, a class with:
+ *
+ * - @p raw : a static boolean, true if the items can be written as they
+ *   are in memory. The whole arrays of the table are then written and
+ *   read with single calls, at the speed of the disk.
+ * - @p write(file,item) and @p read(file,item) : write and read a single
+ *   item, returning false on I/O errors. Only used when @p raw is false.
+ *
+ * serializer<T> handles the types that can be copied as raw memory,
+ * std::string, and the pairs of them. It can be specialized, or replaced
+ * by another class passed to save() and load().
+ *
+ * The snapshots hold the items as they are in memory: they can only be
+ * loaded on a machine with the same architecture, by a program built with
+ * the same types.
+ */
+namespace mm
+{
+
+/** Default serializer of the snapshots.
+ *
+ *  Writes the bytes of the objects: only usable with trivially copyable
+ *  types.
+ */
+template <class T>
+struct serializer
+{
+    static const bool raw = std::is_trivially_copyable<T>::value;
+
+    bool write( FILE* f, const T& obj ) const
+    {
+        static_assert( raw, "a serializer is needed for this type" );
+        return fwrite( &obj, sizeof( T ), 1, f ) == 1;
+    }
+
+    bool read( FILE* f, T& obj ) const
+    {
+        static_assert( raw, "a serializer is needed for this type" );
+        return fread( &obj, sizeof( T ), 1, f ) == 1;
+    }
+};
+
+/// Serializer of strings: the length, then the characters
+template <>
+struct serializer<std::string>
+{
+    static const bool raw = false;
+
+    bool write( FILE* f, const std::string& s ) const
+    {
+        const uint64_t size = s.size();
+        return fwrite( &size, sizeof( size ), 1, f ) == 1
+            && fwrite( s.data(), 1, s.size(), f ) == s.size();
+    }
+
+    bool read( FILE* f, std::string& s ) const
+    {
+        uint64_t size;
+        if ( fread( &size, sizeof( size ), 1, f ) != 1 )
+            return false;
+
+        s.resize( size );
+        return fread( &s[ 0 ], 1, size, f ) == size;
+    }
+};
+
+/** Serializer of pairs: the two members, one after the other.
+ *
+ *  A pair of raw types is raw too, even though std::pair is not
+ *  trivially copyable because of its assignment operator.
+ */
+template <class A, class B>
+struct serializer< std::pair<A,B> >
+{
+    typedef typename std::remove_const<A>::type first_type;
+
+    static const bool raw = serializer<first_type>::raw
+                            && serializer<B>::raw;
+
+    bool write( FILE* f, const std::pair<A,B>& p ) const
+    {
+        return serializer<first_type>().write( f, p.first )
+            && serializer<B>().write( f, p.second );
+    }
+
+    bool read( FILE* f, std::pair<A,B>& p ) const
+    {
+        return serializer<first_type>().read(
+                   f, const_cast<first_type&>( p.first ) )
+            && serializer<B>().read( f, p.second );
+    }
+};
+
+/// Header of the snapshot files
+struct snapshot_header
+{
+    char     magic[ 8 ];   ///< "MMCACHE" and the format version
+    uint64_t raw;          ///< 1 if the arrays follow, 0 for the items
+    uint64_t buckets;      ///< Number of buckets of the saved table
+    uint64_t ways;         ///< Number of buckets of each set
+    uint64_t item_size;    ///< Size of the items
+    uint64_t items;        ///< Number of items
+    uint64_t has_empty;    ///< 1 if the empty value follows the header
+    uint64_t check_items;  ///< Number of items sampled for the check
+    uint64_t check_hash;   ///< Combined hash value of the sampled items, to
+                           ///< detect a change of the hash function
+};
+
+/// Magic string of the snapshots, with the version of the format
+static const char snapshot_magic[ 8 ] = { 'M', 'M', 'C', 'A',
+                                          'C', 'H', 'E', '1' };
+
+} // namespace mm
+
+#endif // _MM_SNAPSHOT_HPP_
@@ -0,0 +1,546 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_SPILL_LOG_HPP_
+#define _MM_SPILL_LOG_HPP_
+
+#include "cache_map.hpp"
+#include "snapshot.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Default size of the segments of a spill_log
+#define MM_SPILL_SEGMENT_SIZE ( 64 << 20 )
+
+/// Default size of the write buffer of a spill_log
+#define MM_SPILL_BATCH_SIZE ( 256 << 10 )
+
+namespace mm
+{
+
+/// Position of an item in the segments of a spill_log
+struct spill_location
+{
+    uint32_t segment; ///< Identifier of the segment
+    uint32_t size;    ///< Size of the serialized item
+    uint64_t offset;  ///< Offset of the item in the segment
+};
+
+/** Spill log
+ *
+ *  A cache on a local disk, for the items discarded by the caches in
+ *  memory: it receives the victims of a cache_map that has DiscardDemote
+ *  as discard function. Under a tiered_cache_map, whose second level
+ *  demotes to the log, the lookups that miss the memory are served from
+ *  the disk (see tiered_cache_map).
+ *
+ *  The items are serialized and appended to the current segment of a
+ *  log, a file in a directory. The appends are collected in a buffer and
+ *  written in batches. An index in memory, a cache_map, maps the hash
+ *  value of the keys to the position of the items in the log, and the
+ *  lookups read the items with a single pread() each.
+ *
+ *  An item replaced by a new one with the same key, erased or dropped by
+ *  the index leaves garbage in its segment. When the log grows beyond its
+ *  capacity, the segment with the least live data is removed. Its live
+ *  items are copied to the current segment if they take at most half of a
+ *  segment, otherwise they are dropped from the index: like the other
+ *  caches, the log keeps the items it has room for. Each segment lists the
+ *  keys appended to it, so only its own items are looked up.
+ *
+ *  Two keys with the same hash value take the same entry of the index,
+ *  the one inserted last stays. The log starts empty, and removes its
+ *  segments when destroyed.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  - @a Key, @a T, @a HashFunction, @a KeyEqual : The same of cache_map.
+ *
+ *  - @a Serializer : Writes and reads the items, as in the snapshots (see
+ *     serializer).
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template < class Key,
+           class T,
+           class HashFunction = hash<Key>,
+           class KeyEqual = std::equal_to<Key>,
+           class Serializer = serializer< pair<Key,T> >
+>
+class spill_log
+{
+public:
+    typedef Key          key_type;
+    typedef T            data_type;
+    typedef T            mapped_type;
+    typedef pair<Key,T>  value_type;
+    typedef HashFunction hasher;
+    typedef KeyEqual     key_equal;
+    typedef size_t       size_type;
+
+    /** Creates an empty log.
+     *
+     *  @param dir          the directory of the segments, created if
+     *                      missing
+     *  @param index_size   the number of buckets of the index
+     *  @param capacity     the maximum size of the segments on disk
+     *  @param segment_size the size of each segment
+     *  @param batch_size   the size of the write buffer
+     *  @throw std::runtime_error if a segment cannot be created
+     */
+    spill_log( const char* dir, size_type index_size, uint64_t capacity,
+               uint64_t segment_size = MM_SPILL_SEGMENT_SIZE,
+               size_t batch_size = MM_SPILL_BATCH_SIZE )
+        : m_dir( dir ),
+          m_index( index_size ),
+          m_segment_size( segment_size ),
+          m_max_segments( std::max<uint64_t>( 2, capacity / segment_size ) ),
+          m_writer( 0 ),
+          m_flushed( 0 ),
+          m_batch( batch_size ),
+          m_next_id( 0 ),
+          m_num_reads( 0 ),
+          m_num_writes( 0 )
+    {
+        mkdir( dir, 0700 );
+        m_index.discard_funct().m_log = this;
+        if ( ! open_segment() )
+            throw std::runtime_error( "mm::spill_log: cannot create a "
+                                      "segment in " + m_dir );
+    }
+
+    /// Removes the segments
+    ~spill_log()
+    {
+        if ( m_writer )
+            fclose( m_writer );
+        while ( ! m_segments.empty() )
+            remove_segment( 0 );
+    }
+
+    /** Appends an item to the log. It replaces the item with the same key,
+     *  or with the same hash value.
+     *
+     *  It does not throw on I/O errors, as it runs in the discard function
+     *  of the caches: when a new segment cannot be created, the items are
+     *  appended to the current one, or refused if it was sealed, until a
+     *  later attempt succeeds.
+     *
+     *  @return false if the item could not be written
+     */
+    bool insert( const value_type& obj )
+    {
+        if ( ! m_writer && ! open_segment() )
+            return false;
+
+        const uint64_t h = m_hasher( obj.first );
+
+        segment& seg = m_segments.back();
+        spill_location loc;
+        loc.segment = seg.id;
+        loc.offset = seg.size;
+        if ( ! m_serializer.write( m_writer, obj ) )
+        {
+            // The buffer may hold a part of the item: this segment is
+            // sealed, and the next one starts from a clean state
+            seg.size = ftello( m_writer );
+            seal();
+            open_segment();
+            return false;
+        }
+
+        seg.size = ftello( m_writer );
+        seg.live += seg.size - loc.offset;
+        seg.keys.push_back( h );
+        loc.size = seg.size - loc.offset;
+        ++m_num_writes;
+
+        typename index_type::iterator it = m_index.find( h );
+        if ( it != m_index.end() )
+        {
+            dead( it->second );
+            it->second = loc;
+        }
+        else
+            m_index.insert( typename index_type::value_type( h, loc ) );
+
+        // A segment that cannot be rotated keeps growing meanwhile
+        if ( seg.size >= m_segment_size )
+            open_segment();
+
+        return true;
+    }
+
+    /** Appends an item to the log.
+     *  @see insert( const value_type& )
+     */
+    bool insert( const key_type& key, const data_type& data )
+    {
+        return insert( value_type( key, data ) );
+    }
+
+    /** Finds the item with the given key and reads its data.
+     *
+     *  @param key  the key of the item
+     *  @param data receives the data of the item, if found
+     *  @return true if the key was found and the item could be read
+     */
+    bool find( const key_type& key, data_type& data )
+    {
+        typename index_type::iterator it = m_index.find( m_hasher( key ) );
+        if ( it == m_index.end() )
+            return false;
+
+        value_type obj;
+        if ( ! read( it->second, obj ) || ! m_key_equal( obj.first, key ) )
+            return false;
+
+        data = std::move( obj.second );
+        return true;
+    }
+
+    /** Erases the element identified by the key.
+     *
+     *  @return the number of deleted items, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        typename index_type::iterator it = m_index.find( m_hasher( key ) );
+        if ( it == m_index.end() )
+            return 0;
+
+        value_type obj;
+        if ( ! read( it->second, obj ) || ! m_key_equal( obj.first, key ) )
+            return 0;
+
+        dead( it->second );
+        m_index.erase( it );
+        return 1;
+    }
+
+    /** Erases all of the elements, and removes all the segments. If a new
+     *  segment cannot be created, the next insert() tries again.
+     */
+    void clear()
+    {
+        m_index.clear();
+        seal();
+        while ( ! m_segments.empty() )
+            remove_segment( 0 );
+
+        open_segment();
+    }
+
+    /** Writes the buffered items to the current segment. */
+    void flush()
+    {
+        if ( ! m_writer )
+            return;
+
+        fflush( m_writer );
+        m_flushed = m_segments.back().size;
+    }
+
+    /** Get the number of items in the index. */
+    size_type size() const { return m_index.size(); }
+
+    /** Test for empty. */
+    bool empty() const { return m_index.empty(); }
+
+    /** Get the number of buckets of the index. */
+    size_type bucket_count() const { return m_index.bucket_count(); }
+
+    /** Get the number of segments. */
+    size_type segment_count() const { return m_segments.size(); }
+
+    /** Get the size of the segments, including the garbage. */
+    uint64_t disk_size() const
+    {
+        uint64_t size = 0;
+        for ( size_t i = 0; i < m_segments.size(); ++i )
+            size += m_segments[ i ].size;
+
+        return size;
+    }
+
+    /** Get the size of the live items in the segments. */
+    uint64_t live_size() const
+    {
+        uint64_t size = 0;
+        for ( size_t i = 0; i < m_segments.size(); ++i )
+            size += m_segments[ i ].live;
+
+        return size;
+    }
+
+    /** Get the number of items read from the disk. */
+    size_type num_reads() const { return m_num_reads; }
+
+    /** Get the number of items appended to the log. */
+    size_type num_writes() const { return m_num_writes; }
+
+private:
+    spill_log( const spill_log& );
+    spill_log& operator= ( const spill_log& );
+
+    /// Discard function of the index: the items dropped by the index are
+    /// garbage in their segment
+    struct index_discard
+    {
+        index_discard() : m_log( 0 ) {}
+
+        void operator() ( const pair<uint64_t,spill_location>& old_value,
+                          const pair<uint64_t,spill_location>& new_value )
+        {
+            if ( m_log )
+                m_log->dead( old_value.second );
+        }
+
+        spill_log* m_log;
+    };
+
+    /// Hasher of the index, whose keys are already hash values
+    struct hashed_key
+    {
+        size_t operator() ( uint64_t h ) const { return h; }
+    };
+
+    /// The index, with keys already hashed
+    typedef cache_map< uint64_t, spill_location, hashed_key,
+                       std::equal_to<uint64_t>, index_discard,
+                       std::allocator< pair<uint64_t,spill_location> >, 4
+                     > index_type;
+
+    /// A file of the log
+    struct segment
+    {
+        uint32_t              id;   ///< Identifier, increasing with the age
+        int                   fd;   ///< Descriptor of the file, for reading
+        uint64_t              size; ///< Bytes appended to the file
+        uint64_t              live; ///< Bytes of the items still in the index
+        std::vector<uint64_t> keys; ///< Keys of the items appended, hashed
+    };
+
+    std::string path( uint32_t id ) const
+    {
+        return m_dir + "/segment." + std::to_string( id );
+    }
+
+    /// Position of a segment in m_segments, or m_segments.size()
+    size_t segment_index( uint32_t id ) const
+    {
+        size_t i = 0;
+        while ( i < m_segments.size() && m_segments[ i ].id != id )
+            ++i;
+
+        return i;
+    }
+
+    /** Starts a new segment, removing one if there are too many.
+     *
+     *  @return false if the file cannot be created: the last segment, if
+     *          any, stays the current one
+     */
+    bool open_segment()
+    {
+        segment seg;
+        seg.id = m_next_id;
+        seg.size = 0;
+        seg.live = 0;
+
+        const std::string name = path( seg.id );
+        FILE* writer = fopen( name.c_str(), "wb" );
+        seg.fd = writer ? open( name.c_str(), O_RDONLY ) : -1;
+        if ( seg.fd < 0 )
+        {
+            if ( writer )
+            {
+                fclose( writer );
+                unlink( name.c_str() );
+            }
+            return false;
+        }
+
+        // The buffer is released by the previous writer before being
+        // handed to the new one
+        seal();
+        ++m_next_id;
+        m_writer = writer;
+        m_flushed = 0;
+        setvbuf( m_writer, &m_batch[ 0 ], _IOFBF, m_batch.size() );
+        m_segments.push_back( seg );
+
+        if ( m_segments.size() > m_max_segments )
+            collect();
+
+        return true;
+    }
+
+    /// Closes the writer of the last segment, which can still be read
+    void seal()
+    {
+        if ( m_writer )
+            fclose( m_writer );
+        m_writer = 0;
+    }
+
+    /// Removes the sealed segment with the least live data, copying its
+    /// live items to the current segment, or dropping them from the index
+    /// if they take more than half of a segment
+    void collect()
+    {
+        size_t victim = 0;
+        for ( size_t i = 1; i + 1 < m_segments.size(); ++i )
+            if ( m_segments[ i ].live < m_segments[ victim ].live )
+                victim = i;
+
+        segment& seg = m_segments[ victim ];
+        const bool copy = seg.live <= m_segment_size / 2;
+        for ( size_t k = 0; k < seg.keys.size() && seg.live != 0; ++k )
+        {
+            // The keys of the replaced items are either missing or point
+            // to another segment
+            typename index_type::iterator it = m_index.find( seg.keys[ k ] );
+            if ( it == m_index.end() || it->second.segment != seg.id )
+                continue;
+
+            seg.live -= it->second.size;
+            if ( ! copy || ! relocate( seg, it ) )
+                m_index.erase( it );
+        }
+
+        remove_segment( victim );
+    }
+
+    /// Copies an item of a sealed segment to the end of the current one
+    bool relocate( const segment& from,
+                   typename index_type::iterator it )
+    {
+        spill_location& loc = it->second;
+        m_buffer.resize( loc.size );
+        if ( ! m_writer
+             || pread( from.fd, &m_buffer[ 0 ], loc.size, loc.offset )
+                != ssize_t( loc.size ) )
+            return false;
+
+        segment& head = m_segments.back();
+        const uint64_t offset = head.size;
+        const bool ok = fwrite( &m_buffer[ 0 ], 1, loc.size, m_writer )
+                        == loc.size;
+        head.size = ftello( m_writer );
+        if ( ! ok )
+            return false;
+
+        head.live += loc.size;
+        head.keys.push_back( it->first );
+        loc.segment = head.id;
+        loc.offset = offset;
+        return true;
+    }
+
+    void remove_segment( size_t i )
+    {
+        close( m_segments[ i ].fd );
+        unlink( path( m_segments[ i ].id ).c_str() );
+        m_segments.erase( m_segments.begin() + i );
+    }
+
+    /// The item at @a loc is no longer in the index
+    void dead( const spill_location& loc )
+    {
+        const size_t i = segment_index( loc.segment );
+        if ( i != m_segments.size() )
+            m_segments[ i ].live -= loc.size;
+    }
+
+    /// Reads the item at @a loc
+    bool read( const spill_location& loc, value_type& obj )
+    {
+        const size_t i = segment_index( loc.segment );
+        if ( i == m_segments.size() )
+            return false;
+
+        // The item may still be in the write buffer
+        if ( m_writer && i + 1 == m_segments.size()
+             && loc.offset + loc.size > m_flushed )
+            flush();
+
+        m_buffer.resize( loc.size );
+        if ( pread( m_segments[ i ].fd, &m_buffer[ 0 ], loc.size, loc.offset )
+             != ssize_t( loc.size ) )
+            return false;
+
+        FILE* f = fmemopen( &m_buffer[ 0 ], loc.size, "rb" );
+        if ( ! f )
+            return false;
+
+        const bool ok = m_serializer.read( f, obj );
+        fclose( f );
+        ++m_num_reads;
+        return ok;
+    }
+
+    std::string          m_dir;          ///< Directory of the segments
+    index_type           m_index;        ///< Hash value -> item position
+    uint64_t             m_segment_size; ///< Size of the segments
+    uint64_t             m_max_segments; ///< Number of segments kept
+    std::vector<segment> m_segments;     ///< Segments, the oldest first
+    FILE*                m_writer;       ///< Appends to the last segment,
+                                         ///< or 0 if it is sealed
+    uint64_t             m_flushed;      ///< Bytes written by m_writer
+    std::vector<char>    m_batch;        ///< Buffer of the appends
+    std::vector<char>    m_buffer;       ///< Buffer of the reads
+    uint32_t             m_next_id;      ///< Identifier of the next segment
+    size_type            m_num_reads;    ///< Items read from the disk
+    size_type            m_num_writes;   ///< Items appended
+    HashFunction         m_hasher;       ///< Hasher of the keys
+    KeyEqual             m_key_equal;    ///< Comparator of the keys
+    Serializer           m_serializer;   ///< Writes and reads the items
+};
+
+} // namespace mm
+
+#endif // _MM_SPILL_LOG_HPP_
@@ -0,0 +1,401 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_TIERED_CACHE_MAP_HPP_
+#define _MM_TIERED_CACHE_MAP_HPP_
+
+#include "cache_map.hpp"
+
+#include <type_traits>
+#include <utility>
+
+namespace mm
+{
+
+/** Discard function that demotes the discarded items to another container.
+ *
+ *  The items are moved into the container set with next(): until then,
+ *  they are dropped. The container must provide insert( value_type&& ).
+ */
+template <class V, class Next>
+class DiscardDemote
+{
+public:
+    DiscardDemote() : m_next( 0 ), m_demotions( 0 ) {}
+
+    void operator() ( V&& old_value, const V& new_value )
+    {
+        ( *this )( std::move( old_value ) );
+    }
+
+    /// Demotes an item: DiscardDemote can be the handler of a
+    /// write_behind queue too
+    void operator() ( V&& old_value )
+    {
+        if ( m_next )
+        {
+            m_next->insert( std::move( old_value ) );
+            ++m_demotions;
+        }
+    }
+
+    /// Sets the container that receives the discarded items
+    void next( Next* next ) { m_next = next; }
+
+    /// The container that receives the discarded items, or null
+    Next* next() const { return m_next; }
+
+    /// Number of items moved to the next container
+    size_t num_demotions() const { return m_demotions; }
+
+private:
+    Next*  m_next;      ///< Receives the discarded items
+    size_t m_demotions; ///< Number of demoted items
+};
+
+/** Tiered cache map
+ *
+ *  A small and fast first level cache_map in front of a bigger second
+ *  level. The items evicted from the first level are demoted to the second
+ *  one by the discard function (see DiscardDemote), and the items found in
+ *  the second level are promoted back to the first one, so each item is
+ *  held by a single level: the capacity is the sum of the two.
+ *
+ *  A lookup that hits the second level moves the item, and may demote
+ *  another item in its place, so find() copies the data out of the map,
+ *  like concurrent_cache_map.
+ *
+ *  The second level can in turn demote its victims to a last level, with
+ *  DiscardDemote as its discard function, set through next(). When the
+ *  last level provides @p find(key,data) returning bool, like spill_log,
+ *  the lookups that miss the second level search it too, the items found
+ *  are copied to the first level, and erase() and clear() reach it. A
+ *  copy left in the last level is hidden by the levels above, and
+ *  replaced when the item is demoted again.
+ *
+ *  <b>Template Parameters</b>
+ *
+ *  - @a Key, @a T : The key and data types.
+ *
+ *  - @a Next : The second level, with the interface of cache_map (find(),
+ *     insert( value_type&& ), erase(), clear(), size() and bucket_count())
+ *     and the same value_type. The default is a cache_map with 8-way sets.
+ *
+ *  - @a HashFunction, @a KeyEqual, @a Ways, @a EvictionPolicy : The
+ *     parameters of the first level, the same of cache_map.
+ *
+ *  @author Matteo Merli
+ *  @date $Date$
+ */
+template < class Key,
+           class T,
+           class Next = cache_map< Key, T, hash<Key>, std::equal_to<Key>,
+                                   DiscardIgnore< pair<Key,T> >,
+                                   std::allocator< pair<Key,T> >, 8 >,
+           class HashFunction = hash<Key>,
+           class KeyEqual = std::equal_to<Key>,
+           size_t Ways = 1,
+           class EvictionPolicy = EvictRandom
+>
+class tiered_cache_map
+{
+public:
+    /// The second level
+    typedef Next next_type;
+
+    /// The first level, that demotes its victims to the second one
+    typedef cache_map< Key, T, HashFunction, KeyEqual,
+                       DiscardDemote< pair<Key,T>, Next >,
+                       std::allocator< pair<Key,T> >, Ways, EvictionPolicy
+                     > first_type;
+
+    typedef typename first_type::key_type   key_type;
+    typedef T                               data_type;
+    typedef T                               mapped_type;
+    typedef typename first_type::value_type value_type;
+    typedef typename first_type::size_type  size_type;
+
+    static_assert( std::is_same< typename Next::value_type,
+                                 value_type >::value,
+                   "the levels of tiered_cache_map must hold the same items" );
+
+    /** Constructor.
+     *
+     *  @param n1 the number of buckets of the first level
+     *  @param n2 the number of buckets of the second level
+     */
+    tiered_cache_map( size_type n1, size_type n2 )
+        : m_next( n2 ),
+          m_first( n1 ),
+          m_first_hits( 0 ),
+          m_next_hits( 0 ),
+          m_last_hits( 0 ),
+          m_misses( 0 )
+    {
+        m_first.discard_funct().next( &m_next );
+    }
+
+    /** Finds the item with the given key and copies its data.
+     *
+     *  An item found in the second level is moved to the first one, unless
+     *  the eviction policy of the first level does not admit it.
+     *
+     *  @param key  the key of the item
+     *  @param data receives a copy of the data of the item, if found
+     *  @return true if the key was found
+     */
+    bool find( const key_type& key, data_type& data )
+    {
+        typename first_type::iterator it = m_first.find( key );
+        if ( it != m_first.end() )
+        {
+            ++m_first_hits;
+            data = it->second;
+            return true;
+        }
+
+        typename Next::iterator nit = m_next.find( key );
+        if ( nit == m_next.end() )
+        {
+            if ( ! find_last( key, data ) )
+            {
+                ++m_misses;
+                return false;
+            }
+
+            ++m_last_hits;
+            insert( key, data );
+            return true;
+        }
+
+        ++m_next_hits;
+        data = nit->second;
+
+        // Promote the item: it leaves the second level first, so that the
+        // victim of the first level can take its place
+        value_type item( std::move( *nit ) );
+        m_next.erase( nit );
+        if ( ! m_first.insert( std::move( item ) ).second )
+            m_next.insert( std::move( item ) );
+
+        return true;
+    }
+
+    /** Insert an item in the first level. Its victim, if any, is demoted to
+     *  the second level.
+     *
+     *  An older copy of the item in the second level is erased, or replaced
+     *  when the first level does not admit the new one.
+     */
+    void insert( const key_type& key, const data_type& data )
+    {
+        insert( value_type( key, data ) );
+    }
+
+    /** Insert an item in the first level.
+     *  @see insert( const key_type&, const data_type& )
+     */
+    void insert( const value_type& obj )
+    {
+        if ( m_first.insert( obj ).second )
+            m_next.erase( obj.first );
+        else
+            m_next.insert( value_type( obj ) );
+    }
+
+    /** Erases the element identified by the key, from all the levels.
+     *
+     *  @return the number of deleted items, either 1 or 0.
+     */
+    size_type erase( const key_type& key )
+    {
+        const size_type erased = m_first.erase( key ) + m_next.erase( key )
+                                 + erase_last( key );
+        return erased != 0;
+    }
+
+    /** Erases all of the elements, from all the levels. */
+    void clear()
+    {
+        m_first.clear();
+        m_next.clear();
+        clear_last();
+    }
+
+    /** Get the number of items in both levels. */
+    size_type size() const { return m_first.size() + m_next.size(); }
+
+    /** Test for empty. */
+    bool empty() const { return size() == 0; }
+
+    /** Get the number of buckets of both levels. */
+    size_type bucket_count() const
+    {
+        return m_first.bucket_count() + m_next.bucket_count();
+    }
+
+    /** The first level. */
+    const first_type& first() const { return m_first; }
+
+    /** The second level. */
+    const next_type& next() const { return m_next; }
+
+    /** The second level, to configure it (like setting its last level). */
+    next_type& next() { return m_next; }
+
+    /** Get the number of lookups. */
+    size_type num_lookups() const
+    {
+        return m_first_hits + m_next_hits + m_last_hits + m_misses;
+    }
+
+    /** Get the number of lookups that found the key in the first level. */
+    size_type num_first_hits() const { return m_first_hits; }
+
+    /** Get the number of lookups that found the key in the second level. */
+    size_type num_next_hits() const { return m_next_hits; }
+
+    /** Get the number of lookups that found the key in the last level. */
+    size_type num_last_hits() const { return m_last_hits; }
+
+    /** Get the number of lookups that did not find the key. */
+    size_type num_misses() const { return m_misses; }
+
+    /** Get the number of items demoted to the second level. */
+    size_type num_demotions() const
+    {
+        return m_first.discard_funct().num_demotions();
+    }
+
+    /** Fraction of the lookups that found the key in the first level. */
+    double first_hit_ratio() const
+    {
+        return ratio( m_first_hits, num_lookups() );
+    }
+
+    /** Fraction of the lookups missing the first level, that found the key
+     *  in the second level.
+     */
+    double next_hit_ratio() const
+    {
+        return ratio( m_next_hits, m_next_hits + m_last_hits + m_misses );
+    }
+
+    /** Fraction of the lookups missing the first two levels, that found
+     *  the key in the last level.
+     */
+    double last_hit_ratio() const
+    {
+        return ratio( m_last_hits, m_last_hits + m_misses );
+    }
+
+    /** Fraction of the lookups that found the key in any level. */
+    double hit_ratio() const
+    {
+        return ratio( m_first_hits + m_next_hits + m_last_hits,
+                      num_lookups() );
+    }
+
+    /** Resets the counters of the lookups. */
+    void reset_stats()
+    {
+        m_first_hits = m_next_hits = m_last_hits = m_misses = 0;
+    }
+
+private:
+    tiered_cache_map( const tiered_cache_map& );
+    tiered_cache_map& operator= ( const tiered_cache_map& );
+
+    /// Stands for a missing last level
+    struct no_last_level
+    {
+        bool find( const key_type& key, data_type& data ) { return false; }
+        size_type erase( const key_type& key ) { return 0; }
+        void clear() {}
+    };
+
+    /// The last level, if the discard function of the second level
+    /// demotes to a container that can be searched
+    template <class N>
+    static auto last_level( N& next, int )
+        -> typename std::enable_if<
+               std::is_same< decltype( next.discard_funct().next()->find(
+                                 std::declval<const key_type&>(),
+                                 std::declval<data_type&>() ) ),
+                             bool >::value,
+               decltype( next.discard_funct().next() ) >::type
+    {
+        return next.discard_funct().next();
+    }
+
+    template <class N>
+    static no_last_level* last_level( N& next, long ) { return 0; }
+
+    bool find_last( const key_type& key, data_type& data )
+    {
+        auto* last = last_level( m_next, 0 );
+        return last && last->find( key, data );
+    }
+
+    size_type erase_last( const key_type& key )
+    {
+        auto* last = last_level( m_next, 0 );
+        return last ? last->erase( key ) : 0;
+    }
+
+    void clear_last()
+    {
+        auto* last = last_level( m_next, 0 );
+        if ( last )
+            last->clear();
+    }
+
+    static double ratio( size_type n, size_type total )
+    {
+        return total ? double( n ) / total : 0.0;
+    }
+
+    next_type  m_next;       ///< Second level, built before the first
+    first_type m_first;      ///< First level
+    size_type  m_first_hits; ///< Lookups found in the first level
+    size_type  m_next_hits;  ///< Lookups found in the second level
+    size_type  m_last_hits;  ///< Lookups found in the last level
+    size_type  m_misses;     ///< Lookups not found
+};
+
+} // namespace mm
+
+#endif // _MM_TIERED_CACHE_MAP_HPP_
@@ -0,0 +1,264 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_TINYLFU_HPP_
+#define _MM_TINYLFU_HPP_
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "eviction_policy.hpp"
+
+namespace mm
+{
+
+/** Count-min sketch with 4-bit counters, used to estimate how often a key
+ *  has been seen recently.
+ *
+ *  The 4 counters of a key are all in the same 64 bytes block, so that an
+ *  update or an estimate touches a single cache line. After a number of
+ *  increments proportional to the sketch size (the sample size), all the
+ *  counters are halved, so that the estimates follow the recent history.
+ */
+class frequency_sketch
+{
+public:
+    frequency_sketch() : m_mask( 0 ), m_additions( 0 ), m_sample_size( 0 ) {}
+
+    /** Resizes the sketch and resets all the counters.
+     *
+     *  @param items the number of items whose frequency has to be tracked
+     */
+    void init( size_t items )
+    {
+        size_t words = BlockWords;
+        while ( words * 4 < items )
+            words <<= 1;
+
+        m_words.assign( words, 0 );
+        m_mask = words / BlockWords - 1;
+        m_additions = 0;
+        m_sample_size = 10 * items;
+    }
+
+    /// Records an occurrence of the key with the given hash value
+    void increment( size_t hash )
+    {
+        const uint64_t spread = mix( hash );
+        uint64_t* block = &m_words[ ( ( spread >> 32 ) & m_mask )
+                                    * BlockWords ];
+        bool added = false;
+        for ( int i = 0; i < 4; ++i )
+        {
+            uint64_t& word = block[ 2 * i + ( ( spread >> i ) & 1 ) ];
+            const int shift = ( ( spread >> ( 8 + 4 * i ) ) & 15 ) * 4;
+            if ( ( ( word >> shift ) & 15 ) != 15 )
+            {
+                word += uint64_t( 1 ) << shift;
+                added = true;
+            }
+        }
+
+        if ( added && ++m_additions == m_sample_size )
+            reset();
+    }
+
+    /// Estimates the number of occurrences of the key with the given hash
+    /// value (at most 15)
+    unsigned int frequency( size_t hash ) const
+    {
+        const uint64_t spread = mix( hash );
+        const uint64_t* block = &m_words[ ( ( spread >> 32 ) & m_mask )
+                                          * BlockWords ];
+        unsigned int freq = 15;
+        for ( int i = 0; i < 4; ++i )
+        {
+            const uint64_t word = block[ 2 * i + ( ( spread >> i ) & 1 ) ];
+            const int shift = ( ( spread >> ( 8 + 4 * i ) ) & 15 ) * 4;
+            const unsigned int count = ( word >> shift ) & 15;
+            if ( count < freq )
+                freq = count;
+        }
+
+        return freq;
+    }
+
+private:
+    /// Halves all the counters
+    void reset()
+    {
+        for ( size_t i = 0; i < m_words.size(); ++i )
+            m_words[ i ] = ( m_words[ i ] >> 1 ) & 0x7777777777777777ULL;
+
+        m_additions /= 2;
+    }
+
+    /// Spreads the bits of the hash value, which may be weak
+    static uint64_t mix( size_t hash )
+    {
+        return static_cast<uint64_t>( hash ) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    /// Number of 64 bits words in a block (a cache line)
+    static const size_t BlockWords = 8;
+
+    std::vector<uint64_t> m_words;       ///< The counters, 16 per word
+    size_t                m_mask;        ///< Mask used to calculate block
+    size_t                m_additions;   ///< Increments since last reset
+    size_t                m_sample_size; ///< Increments between resets
+};
+
+/** W-TinyLFU admission filter, on top of another eviction policy.
+ *
+ *  Every lookup and insertion is recorded in a frequency_sketch. In each
+ *  set, the most recently inserted item forms the admission window: it is
+ *  always admitted. When a new item arrives in a full set, the window item
+ *  either graduates, replacing the victim chosen by @a Policy if it has
+ *  been seen more often than the victim, or it is evicted itself. With
+ *  direct-mapped tables (1 way) there is no window: a new item is rejected
+ *  unless it has been seen more often than the item it would replace.
+ *
+ *  This keeps keys that are seen only once (eg: scans) from replacing
+ *  frequently used items.
+ *
+ *  The hash values of the resident items, folded to 32 bits, are recorded
+ *  by on_store() in a per-bucket array, so an admission does not hash the
+ *  keys of the window and of the victim again. Only the items whose hash
+ *  value was not at hand (adopted from persistent memory or a snapshot,
+ *  or kept in place by resize()) are hashed, the first time they are
+ *  compared.
+ */
+template <class Policy = EvictLRU>
+class TinyLFU : public Policy
+{
+public:
+    TinyLFU() : m_ways( 1 ) {}
+
+    void init( size_t buckets, size_t ways )
+    {
+        Policy::init( buckets, ways );
+        m_ways = ways;
+        m_window.assign( buckets / ways, NoWindow );
+        m_hashes.assign( buckets, NoHash );
+        m_sketch.init( buckets );
+    }
+
+    void on_access( size_t hash )
+    {
+        Policy::on_access( hash );
+        m_sketch.increment( fold( hash ) );
+    }
+
+    void on_store( size_t bucket, size_t hash )
+    {
+        Policy::on_store( bucket, hash );
+        m_hashes[ bucket ] = fold( hash );
+    }
+
+    void on_insert( size_t bucket )
+    {
+        Policy::on_insert( bucket );
+        m_window[ bucket / m_ways ] = bucket & ( m_ways - 1 );
+    }
+
+    void on_erase( size_t bucket )
+    {
+        Policy::on_erase( bucket );
+        if ( m_window[ bucket / m_ways ] == ( bucket & ( m_ways - 1 ) ) )
+            m_window[ bucket / m_ways ] = NoWindow;
+    }
+
+    template <class BucketHash>
+    size_t admit( size_t first, size_t way, size_t hash,
+                  const BucketHash& bucket_hash )
+    {
+        if ( m_ways == 1 )
+            return   m_sketch.frequency( fold( hash ) )
+                   > frequency( first + way, bucket_hash )
+                ? way : m_ways;
+
+        const size_t window = m_window[ first / m_ways ];
+        if ( window == NoWindow || window == way )
+            return way;
+
+        // The window item graduates only if it is more popular than the
+        // victim, otherwise it leaves room for the new item.
+        if (   frequency( first + window, bucket_hash )
+             > frequency( first + way, bucket_hash ) )
+            return way;
+
+        return window;
+    }
+
+    /// Get the frequency sketch used by the filter
+    const frequency_sketch& sketch() const { return m_sketch; }
+
+private:
+    /// Marks sets without a window item
+    enum { NoWindow = 0xFF };
+
+    /// Marks buckets whose hash value is not known
+    enum { NoHash = 0 };
+
+    /// The key of the sketch: the hash value folded to 32 bits, never
+    /// NoHash
+    static uint32_t fold( size_t hash )
+    {
+        const uint64_t h = hash;
+        const uint32_t folded = static_cast<uint32_t>( h ^ ( h >> 32 ) );
+        return folded + ( folded == NoHash );
+    }
+
+    /// Estimates the frequency of the item stored in a bucket
+    template <class BucketHash>
+    unsigned int frequency( size_t bucket, const BucketHash& bucket_hash )
+    {
+        if ( m_hashes[ bucket ] == NoHash )
+            m_hashes[ bucket ] = fold( bucket_hash( bucket ) );
+
+        return m_sketch.frequency( m_hashes[ bucket ] );
+    }
+
+    size_t                     m_ways;   ///< Number of buckets in each set
+    std::vector<unsigned char> m_window; ///< Way of the window item of sets
+    std::vector<uint32_t>      m_hashes; ///< Folded hash values of buckets
+    frequency_sketch           m_sketch; ///< Frequency of recent keys
+};
+
+} // namespace mm
+
+#endif // _MM_TINYLFU_HPP_
@@ -0,0 +1,373 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MM_WRITE_BEHIND_HPP_
+#define _MM_WRITE_BEHIND_HPP_
+
+#include "locks.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// Default number of items handed over to the handler at each round
+#define MM_WRITE_BEHIND_BATCH 64
+
+namespace mm
+{
+
+/// What a write_behind queue does with the items when it is full
+enum backpressure
+{
+    block_when_full,  ///< Wait for a free slot
+    drop_when_full,   ///< Destroy the item, without handling it
+    inline_when_full  ///< Call the handler in the inserting thread
+};
+
+/** Write-behind queue of discarded items.
+ *
+ *  A bounded lock-free ring buffer, drained by a background thread that
+ *  passes the items to a handler in batches: the discard function of a
+ *  table can then hand its victims over to a slow tier (like a spill_log)
+ *  without waiting for it. Any number of threads can push items, and
+ *  the handler is called by one thread at a time.
+ *
+ *  The handler is called as @p handler(std::move(item)), after the item
+ *  left the table: unlike a discard function, it does not get the new
+ *  item. It is called by the background thread, so the slow tier must not
+ *  be used by other threads at the same time, unless it is thread-safe or
+ *  they call flush() first.
+ *
+ *  The ring buffer is the bounded queue of D. Vyukov: each slot has a
+ *  sequence number telling whether it is free or holds an item, so
+ *  producers and the consumer only touch the slots they own.
+ */
+template <class V, class Handler>
+class write_behind
+{
+public:
+    /** Creates the queue and starts the background thread.
+     *
+     *  @param capacity the number of slots, rounded up to a power of 2
+     *  @param mode     what to do when the queue is full
+     *  @param handler  receives the items
+     *  @param batch    the maximum number of items dequeued at once
+     */
+    write_behind( size_t capacity, backpressure mode = block_when_full,
+                  const Handler& handler = Handler(),
+                  size_t batch = MM_WRITE_BEHIND_BATCH )
+        : m_mode( mode ),
+          m_handler( handler ),
+          m_batch( batch ),
+          m_enqueue_pos( 0 ),
+          m_dequeue_pos( 0 ),
+          m_queued( 0 ),
+          m_handled( 0 ),
+          m_dropped( 0 ),
+          m_inline( 0 ),
+          m_max_depth( 0 ),
+          m_sleeping( false ),
+          m_stop( false )
+    {
+        size_t slots = 2;
+        while ( slots < capacity )
+            slots <<= 1;
+
+        m_mask = slots - 1;
+        m_slots = new slot[ slots ];
+        for ( size_t i = 0; i < slots; ++i )
+            m_slots[ i ].seq.store( i, std::memory_order_relaxed );
+
+        m_thread = std::thread( &write_behind::run, this );
+    }
+
+    /// Handles the items left in the queue and stops the thread
+    ~write_behind()
+    {
+        {
+            std::lock_guard<std::mutex> guard( m_wake_mutex );
+            m_stop.store( true );
+        }
+        m_wake.notify_one();
+        m_thread.join();
+        delete [] m_slots;
+    }
+
+    /** Queues an item for the handler, moving it in.
+     *
+     *  @return false if the queue was full and the item was dropped or
+     *  handled inline, depending on the backpressure mode
+     */
+    bool push( V&& item )
+    {
+        while ( ! try_push( item ) )
+        {
+            if ( m_mode == drop_when_full )
+            {
+                m_dropped.fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+
+            if ( m_mode == inline_when_full )
+            {
+                std::lock_guard<std::mutex> guard( m_handler_mutex );
+                m_handler( std::move( item ) );
+                m_inline.fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+
+            wake();
+            std::this_thread::yield();
+        }
+
+        // The maximum only grows, whatever the order of the producers
+        const size_t depth = this->depth();
+        size_t max_depth = m_max_depth.load( std::memory_order_relaxed );
+        while ( depth > max_depth
+                && ! m_max_depth.compare_exchange_weak(
+                    max_depth, depth, std::memory_order_relaxed ) )
+            ;
+
+        // A sleeping thread is woken up when a whole batch is ready: the
+        // items pushed meanwhile wait for the timeout of the thread
+        if ( depth >= m_batch && m_sleeping.load() )
+            wake();
+
+        return true;
+    }
+
+    /** Waits for the handler to receive all the queued items. */
+    void flush()
+    {
+        const size_t queued = m_queued.load();
+        while ( m_handled.load( std::memory_order_acquire ) < queued )
+        {
+            wake();
+            std::this_thread::yield();
+        }
+    }
+
+    /** Get the number of items waiting in the queue, or in the batch being
+     *  handled: up to the capacity plus the size of a batch.
+     */
+    size_t depth() const
+    {
+        // The items are counted before they are published, so m_handled
+        // read first is never ahead of m_queued. It is read again, so that
+        // the two counters are taken at the same time.
+        for ( ;; )
+        {
+            const size_t handled = m_handled.load();
+            const size_t queued = m_queued.load();
+            if ( m_handled.load() == handled )
+                return queued - handled;
+        }
+    }
+
+    /** Get the highest number of items seen waiting in the queue. */
+    size_t max_depth() const { return m_max_depth.load(); }
+
+    /** Get the number of slots of the queue. */
+    size_t capacity() const { return m_mask + 1; }
+
+    /** Get the number of items queued. */
+    size_t num_queued() const { return m_queued.load(); }
+
+    /** Get the number of queued items passed to the handler. */
+    size_t num_handled() const { return m_handled.load(); }
+
+    /** Get the number of items dropped because the queue was full. */
+    size_t num_dropped() const { return m_dropped.load(); }
+
+    /** Get the number of items handled inline because the queue was full. */
+    size_t num_inline() const { return m_inline.load(); }
+
+    /** The handler. Must not be used while items are being handled. */
+    Handler& handler() { return m_handler; }
+
+private:
+    write_behind( const write_behind& );
+    write_behind& operator= ( const write_behind& );
+
+    struct slot
+    {
+        std::atomic<size_t> seq; ///< Position the slot is ready for
+        alignas( V ) unsigned char item[ sizeof( V ) ];
+    };
+
+    /// Moves the item in a free slot, unless the queue is full
+    bool try_push( V& item )
+    {
+        size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        for ( ;; )
+        {
+            slot& s = m_slots[ pos & m_mask ];
+            const size_t seq = s.seq.load( std::memory_order_acquire );
+            if ( seq == pos )
+            {
+                if ( m_enqueue_pos.compare_exchange_weak(
+                         pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    // Counted before the drain thread can see the item
+                    m_queued.fetch_add( 1 );
+                    new ( s.item ) V( std::move( item ) );
+                    s.seq.store( pos + 1, std::memory_order_release );
+                    return true;
+                }
+            }
+            else if ( seq < pos )
+                return false;
+            else
+                pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        }
+    }
+
+    /// Moves the next item out of its slot, unless the queue is empty
+    bool try_pop( std::vector<V>& items )
+    {
+        const size_t pos = m_dequeue_pos;
+        slot& s = m_slots[ pos & m_mask ];
+        if ( s.seq.load( std::memory_order_acquire ) != pos + 1 )
+            return false;
+
+        V* item = reinterpret_cast<V*>( s.item );
+        items.push_back( std::move( *item ) );
+        item->~V();
+        s.seq.store( pos + m_mask + 1, std::memory_order_release );
+        m_dequeue_pos = pos + 1;
+        return true;
+    }
+
+    void wake()
+    {
+        std::lock_guard<std::mutex> guard( m_wake_mutex );
+        m_wake.notify_one();
+    }
+
+    /// The background thread
+    void run()
+    {
+        std::vector<V> items;
+        items.reserve( m_batch );
+
+        for ( ;; )
+        {
+            while ( items.size() < m_batch && try_pop( items ) )
+                ;
+
+            if ( ! items.empty() )
+            {
+                std::lock_guard<std::mutex> guard( m_handler_mutex );
+                for ( size_t i = 0; i < items.size(); ++i )
+                    m_handler( std::move( items[ i ] ) );
+
+                m_handled.fetch_add( items.size(), std::memory_order_release );
+                items.clear();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard( m_wake_mutex );
+            if ( m_stop.load() && m_handled.load() == m_queued.load() )
+                return;
+
+            // The producers wake the thread up only if it is sleeping: the
+            // timeout covers the items pushed right before m_sleeping is
+            // set, and those that do not fill a batch
+            m_sleeping.store( true );
+            m_wake.wait_for( guard, std::chrono::milliseconds( 1 ) );
+            m_sleeping.store( false );
+        }
+    }
+
+    slot*                   m_slots;         ///< The ring buffer
+    size_t                  m_mask;          ///< Number of slots - 1
+    backpressure            m_mode;          ///< What to do when full
+    Handler                 m_handler;       ///< Receives the items
+    size_t                  m_batch;         ///< Items dequeued at once
+
+    alignas( MM_CACHE_LINE_SIZE )
+    std::atomic<size_t>     m_enqueue_pos;   ///< Next position to fill
+    alignas( MM_CACHE_LINE_SIZE )
+    size_t                  m_dequeue_pos;   ///< Next position to drain
+
+    alignas( MM_CACHE_LINE_SIZE )
+    std::atomic<size_t>     m_queued;        ///< Items queued
+    std::atomic<size_t>     m_handled;       ///< Queued items handled
+    std::atomic<size_t>     m_dropped;       ///< Items dropped
+    std::atomic<size_t>     m_inline;        ///< Items handled inline
+    std::atomic<size_t>     m_max_depth;     ///< Highest depth seen
+
+    std::atomic<bool>       m_sleeping;      ///< The thread is waiting
+    std::atomic<bool>       m_stop;          ///< The thread must stop
+    std::mutex              m_wake_mutex;    ///< Protects the wake-ups
+    std::condition_variable m_wake;          ///< Wakes the thread up
+    std::mutex              m_handler_mutex; ///< One handler at a time
+    std::thread             m_thread;        ///< The background thread
+};
+
+/** Discard function that queues the discarded items in a write_behind
+ *  queue, set with queue(): until then, they are dropped.
+ *
+ *  The handler of the queue runs in the background, so the latency of
+ *  the insertions does not depend on the speed of the tier behind it.
+ */
+template <class V, class Handler>
+class DiscardWriteBehind
+{
+public:
+    DiscardWriteBehind() : m_queue( 0 ) {}
+
+    void operator() ( V&& old_value, const V& new_value )
+    {
+        if ( m_queue )
+            m_queue->push( std::move( old_value ) );
+    }
+
+    /// Sets the queue that receives the discarded items
+    void queue( write_behind<V,Handler>* queue ) { m_queue = queue; }
+
+private:
+    write_behind<V,Handler>* m_queue; ///< Receives the discarded items
+};
+
+} // namespace mm
+
+#endif // _MM_WRITE_BEHIND_HPP_
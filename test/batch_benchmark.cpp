@@ -0,0 +1,158 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Compares single lookups with find_batch(), find_interleaved() and
+ * insert_batch() on a table much bigger than the last level cache.
+ *
+ * usage: batch_benchmark [buckets] [batch size]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <mm/cache_map.hpp>
+#include <mm/interleaved_find.hpp>
+
+typedef unsigned long long key_type;
+typedef std::pair<key_type, key_type> value_type;
+typedef mm::cache_map< key_type, key_type, mm::hash<key_type>,
+                       std::equal_to<key_type>,
+                       mm::DiscardIgnore<value_type>,
+                       std::allocator<value_type>, 4
+                     > map_type;
+
+typedef std::chrono::steady_clock timer;
+
+/// Keeps the compiler from discarding the measured loops
+static volatile size_t g_sink;
+
+static double elapsed_ns( timer::time_point start )
+{
+    return std::chrono::duration<double, std::nano>( timer::now() - start ).count();
+}
+
+/// xorshift generator
+static key_type next_key( key_type& seed )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+int main( int argc, char** argv )
+{
+    const size_t buckets = argc > 1 ? strtoul( argv[ 1 ], 0, 10 ) : 1 << 24;
+    const size_t batch   = argc > 2 ? strtoul( argv[ 2 ], 0, 10 ) : 64;
+    const size_t lookups = 1 << 22;
+
+    map_type m( buckets );
+    m.set_empty_key( 0 );
+
+    // Fill the table, remembering the keys
+    std::vector<key_type> keys;
+    key_type seed = 88172645463325252ULL;
+    for ( size_t i = 0; i < m.bucket_count(); ++i )
+    {
+        const key_type k = next_key( seed );
+        if ( m.insert( value_type( k, i ) ).second )
+            keys.push_back( k );
+    }
+
+    std::vector<key_type> probes( lookups );
+    for ( size_t i = 0; i < lookups; ++i )
+        probes[ i ] = keys[ next_key( seed ) % keys.size() ];
+
+    std::cout << m.bucket_count() << " buckets ("
+              << m.bucket_count() * sizeof( value_type ) / ( 1 << 20 )
+              << " MB), batches of " << batch << std::endl;
+
+    size_t hits = 0;
+    timer::time_point start = timer::now();
+    for ( size_t i = 0; i < lookups; ++i )
+        hits += ( m.find( probes[ i ] ) != m.end() );
+    const double single = elapsed_ns( start ) / lookups;
+
+    std::vector<map_type::iterator> out( batch );
+    start = timer::now();
+    for ( size_t i = 0; i + batch <= lookups; i += batch )
+    {
+        m.find_batch( &probes[ i ], batch, &out[0] );
+        for ( size_t j = 0; j < batch; ++j )
+            hits += ( out[ j ] != m.end() );
+    }
+    const double batched = elapsed_ns( start ) / lookups;
+    g_sink = hits;
+
+    std::cout << "find        " << single << " ns/key\n"
+              << "find_batch  " << batched << " ns/key\n";
+
+#ifdef MM_HAS_COROUTINES
+    start = timer::now();
+    for ( size_t i = 0; i + batch <= lookups; i += batch )
+    {
+        mm::find_interleaved( m, &probes[ i ], batch, &out[0] );
+        for ( size_t j = 0; j < batch; ++j )
+            hits += ( out[ j ] != m.end() );
+    }
+    const double interleaved = elapsed_ns( start ) / lookups;
+    g_sink = hits;
+
+    std::cout << "interleaved " << interleaved << " ns/key\n";
+#endif
+
+    std::vector<value_type> items( lookups );
+    for ( size_t i = 0; i < lookups; ++i )
+        items[ i ] = value_type( next_key( seed ), i );
+
+    start = timer::now();
+    for ( size_t i = 0; i < lookups / 2; ++i )
+        m.insert( items[ i ] );
+    const double single_insert = elapsed_ns( start ) / ( lookups / 2 );
+
+    start = timer::now();
+    for ( size_t i = lookups / 2; i + batch <= lookups; i += batch )
+        m.insert_batch( &items[ i ], batch );
+    const double batched_insert = elapsed_ns( start ) / ( lookups / 2 );
+
+    std::cout << "insert       " << single_insert << " ns/item\n"
+              << "insert_batch " << batched_insert << " ns/item\n";
+    return 0;
+}
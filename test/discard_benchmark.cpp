@@ -0,0 +1,227 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Measures the latency of insert() when the discard function feeds a slow
+ * tier, called synchronously or through a write_behind queue in each of
+ * its backpressure modes.
+ *
+ * The slow tier sleeps for a millisecond every 256 items, like a write to
+ * a disk. The items are inserted at a steady rate the tier can sustain.
+ *
+ * Then measures the latency of insert() with values that own many heap
+ * blocks, when the victims are destroyed in place or retired to a
+ * reclaimer.
+ *
+ * usage: discard_benchmark [items] [gap between inserts, in ns]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <mm/cache_map.hpp>
+#include <mm/reclaimer.hpp>
+#include <mm/write_behind.hpp>
+
+typedef unsigned long long key_type;
+typedef std::pair<key_type, key_type> value_type;
+
+typedef std::chrono::steady_clock timer;
+
+/// Keeps the compiler from discarding the measured loops
+static volatile size_t g_sink;
+
+/// The slow tier
+struct slow_tier
+{
+    slow_tier() : m_count( 0 ) {}
+
+    void operator() ( value_type&& item )
+    {
+        g_sink = item.second;
+        if ( ++m_count % 256 == 0 )
+            usleep( 1000 );
+    }
+
+    void operator() ( value_type&& old_value, const value_type& new_value )
+    {
+        ( *this )( std::move( old_value ) );
+    }
+
+    size_t m_count;
+};
+
+/// xorshift generator
+static key_type next_key( key_type& seed )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static void wait_until( timer::time_point t )
+{
+    while ( timer::now() < t )
+        ;
+}
+
+/// Prints the percentiles of the latencies
+static void print( const char* name, std::vector<double>& latency )
+{
+    std::sort( latency.begin(), latency.end() );
+    const size_t n = latency.size();
+    std::cout << name
+              << "  p50 " << latency[ n / 2 ]
+              << "  p99 " << latency[ n * 99 / 100 ]
+              << "  p99.9 " << latency[ n * 999 / 1000 ]
+              << "  max " << latency[ n - 1 ] << " ns";
+}
+
+/// Inserts the items in a full map, one every @a gap, and prints the
+/// percentiles of the insert latency
+template <class Map>
+void run( const char* name, Map& m, const std::vector<key_type>& keys,
+          std::chrono::nanoseconds gap )
+{
+    std::vector<double> latency( keys.size() );
+    timer::time_point next = timer::now();
+    for ( size_t i = 0; i < keys.size(); ++i )
+    {
+        wait_until( next );
+        next += gap;
+
+        const timer::time_point start = timer::now();
+        m.insert( value_type( keys[ i ], i ) );
+        latency[ i ] = std::chrono::duration<double, std::nano>(
+                           timer::now() - start ).count();
+    }
+
+    print( name, latency );
+}
+
+/// A value owning 256 heap blocks
+typedef std::pair< key_type, std::vector<std::string> > heavy_type;
+
+/// Inserts values owning many heap blocks in a full map, and prints the
+/// percentiles of the insert latency
+template <class Map>
+void run_heavy( const char* name, Map& m, const std::vector<key_type>& keys )
+{
+    const size_t n = keys.size() / 16;
+    std::vector<double> latency( n );
+    for ( size_t i = 0; i < n; ++i )
+    {
+        heavy_type item( keys[ i ], std::vector<std::string>(
+                                        256, std::string( 64, 'x' ) ) );
+
+        const timer::time_point start = timer::now();
+        m.insert( std::move( item ) );
+        latency[ i ] = std::chrono::duration<double, std::nano>(
+                           timer::now() - start ).count();
+    }
+
+    print( name, latency );
+    std::cout << "\n";
+}
+
+template <mm::backpressure Mode>
+void run_write_behind( const char* name, const std::vector<key_type>& keys,
+                       std::chrono::nanoseconds gap )
+{
+    typedef mm::cache_map< key_type, key_type, mm::hash<key_type>,
+                           std::equal_to<key_type>,
+                           mm::DiscardWriteBehind< value_type, slow_tier >
+                         > map_type;
+
+    mm::write_behind< value_type, slow_tier > queue( 4096, Mode );
+    map_type m( 1 << 16 );
+    m.discard_funct().queue( &queue );
+
+    run( name, m, keys, gap );
+    queue.flush();
+    std::cout << "  (max depth " << queue.max_depth()
+              << ", dropped " << queue.num_dropped()
+              << ", inline " << queue.num_inline() << ")\n";
+}
+
+int main( int argc, char** argv )
+{
+    const size_t items = argc > 1 ? strtoul( argv[ 1 ], 0, 10 ) : 1 << 20;
+    const std::chrono::nanoseconds gap(
+        argc > 2 ? strtoul( argv[ 2 ], 0, 10 ) : 10000 );
+
+    std::vector<key_type> keys( items );
+    key_type seed = 88172645463325252ULL;
+    for ( size_t i = 0; i < items; ++i )
+        keys[ i ] = next_key( seed );
+
+    std::cout << items << " inserts, one every " << gap.count() << " ns\n";
+
+    typedef mm::cache_map< key_type, key_type, mm::hash<key_type>,
+                           std::equal_to<key_type>, slow_tier
+                         > sync_map;
+    sync_map m( 1 << 16 );
+    run( "synchronous  ", m, keys, gap );
+    std::cout << "\n";
+
+    run_write_behind<mm::block_when_full>( "block        ", keys, gap );
+    run_write_behind<mm::drop_when_full>( "drop         ", keys, gap );
+    run_write_behind<mm::inline_when_full>( "inline       ", keys, gap );
+
+    std::cout << "\n" << keys.size() / 16
+              << " inserts of values owning 256 strings\n";
+
+    typedef mm::cache_map< key_type, std::vector<std::string> > inline_map;
+    inline_map im( 1 << 10 );
+    run_heavy( "destroy      ", im, keys );
+
+    typedef mm::cache_map< key_type, std::vector<std::string>,
+                           mm::hash<key_type>, std::equal_to<key_type>,
+                           mm::DiscardRetire<heavy_type>
+                         > retire_map;
+    mm::reclaimer<heavy_type> r;
+    retire_map rm( 1 << 10 );
+    rm.discard_funct().reclaimer( &r );
+    run_heavy( "retire       ", rm, keys );
+    return 0;
+}
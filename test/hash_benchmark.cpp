@@ -0,0 +1,167 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Compares the string hash with the per-character hash_range(), on the
+ * words of the 'words' file and on longer keys, both alone and as the
+ * hash function of a cache_map<std::string,int>.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mm/cache_map.hpp>
+#include <mm/hash_fun.hpp>
+
+using std::string;
+using std::vector;
+
+/// The string hash used before hash_bytes()
+struct range_hash
+{
+    size_t operator()( const string& s ) const
+    { return mm::hash_range( s.begin(), s.end() ); }
+};
+
+struct bytes_hash
+{
+    size_t operator()( const string& s ) const
+    { return mm::hash_bytes( s.data(), s.size() ); }
+};
+
+typedef std::chrono::steady_clock timer;
+
+/// Keeps the compiler from discarding the measured loops
+static volatile size_t g_sink;
+
+static double elapsed_ns( timer::time_point start )
+{
+    return std::chrono::duration<double, std::nano>( timer::now() - start ).count();
+}
+
+template <class Hash>
+static double bench_hash( const vector<string>& keys, size_t rounds )
+{
+    Hash h;
+    size_t sink = 0;
+    const timer::time_point start = timer::now();
+    for ( size_t r = 0; r < rounds; ++r )
+        for ( size_t i = 0; i < keys.size(); ++i )
+            sink += h( keys[ i ] );
+
+    const double ns = elapsed_ns( start );
+    g_sink = sink;
+    return ns / ( rounds * keys.size() );
+}
+
+template <class Hash>
+static double bench_find( const vector<string>& keys, size_t rounds )
+{
+    typedef mm::cache_map< string, int, Hash, std::equal_to<string>,
+                           mm::DiscardIgnore< std::pair<string,int> >,
+                           std::allocator< std::pair<string,int> >, 4
+                         > map_type;
+
+    map_type m( keys.size() * 2 );
+    m.set_empty_key( string() );
+    for ( size_t i = 0; i < keys.size(); ++i )
+        m.insert( std::make_pair( keys[ i ], int( i ) ) );
+
+    size_t hits = 0;
+    const timer::time_point start = timer::now();
+    for ( size_t r = 0; r < rounds; ++r )
+        for ( size_t i = 0; i < keys.size(); ++i )
+            hits += ( m.find( keys[ i ] ) != m.end() );
+
+    const double ns = elapsed_ns( start );
+    g_sink = hits;
+    return ns / ( rounds * keys.size() );
+}
+
+static void run( const char* name, const vector<string>& keys, size_t rounds )
+{
+    size_t bytes = 0;
+    for ( size_t i = 0; i < keys.size(); ++i )
+        bytes += keys[ i ].size();
+
+    std::cout << name << " (" << keys.size() << " keys, "
+              << bytes / keys.size() << " bytes on average)\n"
+              << "  hash  hash_range: " << bench_hash<range_hash>( keys, rounds )
+              << " ns   hash_bytes: " << bench_hash<bytes_hash>( keys, rounds )
+              << " ns\n"
+              << "  find  hash_range: " << bench_find<range_hash>( keys, rounds )
+              << " ns   hash_bytes: " << bench_find<bytes_hash>( keys, rounds )
+              << " ns\n";
+}
+
+/// Builds URL-like keys of about @a len bytes
+static vector<string> long_keys( const vector<string>& words, size_t len )
+{
+    vector<string> keys;
+    for ( size_t i = 0; i < words.size(); ++i )
+    {
+        string k = "http://www.example.com/";
+        for ( size_t j = i; k.size() < len; j = j * 31 + 7 )
+            k += words[ j % words.size() ] + "/";
+        keys.push_back( k );
+    }
+    return keys;
+}
+
+int main( int argc, char** argv )
+{
+    const char* file = argc > 1 ? argv[ 1 ] : "words";
+    std::ifstream in( file );
+    if ( ! in )
+    {
+        std::cerr << "Can't open " << file << std::endl;
+        return 1;
+    }
+
+    vector<string> words;
+    string w;
+    while ( in >> w )
+        words.push_back( w );
+
+    run( "words", words, 200 );
+    run( "url keys", long_keys( words, 64 ), 100 );
+    run( "long keys", long_keys( words, 512 ), 20 );
+    return 0;
+}
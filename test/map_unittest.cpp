@@ -34,16 +34,36 @@
 #include <time.h>              // for silly random-number-seed generator
 #include <math.h>              // for sqrt()
 #include <map>
+#include <algorithm>
 #include <set>
 #include <iterator>            // for insert_iterator
 #include <iostream>
 #include <iomanip>             // for setprecision()
 #include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
 
 
 #include <mm/cache_map.hpp>
 #include <mm/cache_set.hpp>
+#include <mm/atomic_cache_map.hpp>
+#include <mm/concurrent_cache_map.hpp>
+#include <mm/fixed_string.hpp>
 #include <mm/hash_fun.hpp>
+#include <mm/interleaved_find.hpp>
+#include <mm/mmap_allocator.hpp>
+#include <mm/numa.hpp>
+#include <mm/persistent_cache_map.hpp>
+#include <mm/reclaimer.hpp>
+#include <mm/shared_cache_map.hpp>
+#include <mm/spill_log.hpp>
+#include <mm/tiered_cache_map.hpp>
+#include <mm/write_behind.hpp>
+#include <mm/replicated_cache_map.hpp>
+#include <mm/tinylfu.hpp>
 
 using mm::cache_map;
 using mm::cache_set;
@@ -437,6 +457,1636 @@ void test()
     test_charptr<ht>();
 }
 
+// Identity hasher, used to control which set a key is mapped to
+struct identity_hash
+{
+    size_t operator()( int n ) const { return static_cast<size_t>( n ); }
+};
+
+void test_set_associative()
+{
+    typedef cache_set< int, identity_hash, equal_to<int>,
+                       mm::CacheSetDiscardIgnore<int>, allocator<int>, 4
+                     > set4;
+    typedef cache_map< int, int, identity_hash, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       allocator< pair<int,int> >, 4
+                     > map4;
+
+    // 16 sets of 4 ways: keys multiple of 16 are all mapped to set 0
+    set4 s( 64 );
+    s.set_empty_key( -1 );
+    CHECK( s.bucket_count() == 64 );
+
+    for ( int i = 0; i < 4; ++i )
+        s.insert( i * 16 );
+    CHECK( s.size() == 4 );
+    CHECK( s.num_collisions() == 0 );
+    for ( int i = 0; i < 4; ++i )
+        CHECK( s.find( i * 16 ) != s.end() );
+
+    // The set is full: one of the residents is evicted
+    s.insert( 64 );
+    CHECK( s.size() == 4 );
+    CHECK( s.num_collisions() == 1 );
+    CHECK( s.find( 64 ) != s.end() );
+    int found = 0;
+    for ( int i = 0; i < 4; ++i )
+        found += ( s.find( i * 16 ) != s.end() );
+    CHECK( found == 3 );
+
+    // Inserting a key already present does not create a duplicate
+    s.insert( 64 );
+    CHECK( s.size() == 4 );
+    CHECK( mm::distance( s.begin(), s.end() ) == 4 );
+
+    // Other sets are not affected
+    s.insert( 1 );
+    CHECK( s.size() == 5 );
+    CHECK( s.find( 1 ) != s.end() );
+    s.erase( 64 );
+    CHECK( s.size() == 4 );
+    CHECK( s.find( 64 ) == s.end() );
+
+    map4 m( 64 );
+    m.set_empty_key( -1 );
+    for ( int i = 0; i < 4; ++i )
+        m[ 5 + i * 16 ] = i;
+    CHECK( m.size() == 4 );
+    for ( int i = 0; i < 4; ++i )
+        CHECK( m[ 5 + i * 16 ] == i );
+    CHECK( m.size() == 4 );
+
+    // Growing the table keeps all the items
+    m.resize( 256 );
+    CHECK( m.bucket_count() == 256 );
+    for ( int i = 0; i < 4; ++i )
+        CHECK( m.find( 5 + i * 16 ) != m.end() );
+}
+
+// Strided keys must be spread over the whole table by the default hash
+void test_hash_mixing()
+{
+#ifndef MM_IDENTITY_HASH
+    cache_set<int> s( 4096 );
+    s.set_empty_key( -1 );
+    for ( int i = 0; i < 1024; ++i )
+        s.insert( i * 4096 );
+    CHECK( s.size() > 850 );
+
+    cache_set<long long> l( 4096 );
+    l.set_empty_key( -1 );
+    for ( long long i = 0; i < 1024; ++i )
+        l.insert( i << 32 );
+    CHECK( l.size() > 850 );
+
+    // Aligned pointers
+    static double values[ 1024 ];
+    cache_set<double*> p( 4096 );
+    p.set_empty_key( 0 );
+    for ( int i = 0; i < 1024; ++i )
+        p.insert( values + i );
+    CHECK( p.size() > 850 );
+
+    std::cout << "Strided keys kept: " << s.size() << " "
+              << l.size() << " " << p.size() << std::endl;
+#endif
+}
+
+// The string hash must read every byte of any length, without reading
+// outside of the string
+void test_string_hash()
+{
+    char buf[ 256 ];
+    for ( size_t i = 0; i < sizeof( buf ); ++i )
+        buf[ i ] = 'a' + i % 26;
+
+    std::set<size_t> seen;
+    for ( size_t len = 0; len < 200; ++len )
+    {
+        const string s( buf, len );
+        const size_t h = mm::hash_value( s );
+        CHECK( h == mm::hash_bytes( buf, len ) );
+        CHECK( h == mm::hash_value( s.c_str() ) );
+        CHECK( seen.insert( h ).second );
+
+        // Flipping any byte changes the hash value
+        for ( size_t i = 0; i < len; ++i )
+        {
+            string t( s );
+            t[ i ] ^= 1;
+            CHECK( mm::hash_value( t ) != h );
+        }
+    }
+
+    CHECK( mm::hash_bytes( buf, 10, 1 ) != mm::hash_bytes( buf, 10, 2 ) );
+}
+
+// Batches must give the same results of single lookups and insertions,
+// across several prefetch groups
+void test_batch()
+{
+    typedef cache_map< int, int, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       allocator< pair<int,int> >, 4
+                     > map4;
+    typedef map4::iterator iterator;
+
+    const int N = 5 * MM_PREFETCH_BATCH + 3;
+    std::vector< pair<int,int> > items;
+    for ( int i = 0; i < N; ++i )
+        items.push_back( pair<int,int>( i * 7, i ) );
+
+    map4 m( 4096 );
+    m.set_empty_key( -1 );
+    CHECK( m.insert_batch( &items[0], N ) == size_t( N ) );
+    CHECK( m.size() == size_t( N ) );
+
+    // Found and missing keys are interleaved
+    std::vector<int> keys;
+    for ( int i = 0; i < 2 * N; ++i )
+        keys.push_back( i * 7 + ( i & 1 ) );
+
+    std::vector<iterator> out( keys.size() );
+    m.find_batch( &keys[0], keys.size(), &out[0] );
+    for ( size_t i = 0; i < keys.size(); ++i )
+    {
+        CHECK( out[ i ] == m.find( keys[ i ] ) );
+        if ( keys[ i ] % 7 == 0 && keys[ i ] / 7 < N )
+            CHECK( out[ i ] != m.end() && out[ i ]->second == keys[ i ] / 7 );
+        else
+            CHECK( out[ i ] == m.end() );
+    }
+
+    const map4& cm = m;
+    std::vector<map4::const_iterator> cout( keys.size() );
+    cm.find_batch( &keys[0], keys.size(), &cout[0] );
+    for ( size_t i = 0; i < keys.size(); ++i )
+        CHECK( cout[ i ] == cm.find( keys[ i ] ) );
+
+    cache_set<int> s( 1024 );
+    s.set_empty_key( -1 );
+    s.insert_batch( &keys[0], N );
+    std::vector<cache_set<int>::iterator> sout( keys.size() );
+    s.find_batch( &keys[0], keys.size(), &sout[0] );
+    for ( size_t i = 0; i < keys.size(); ++i )
+        CHECK( sout[ i ] == s.find( keys[ i ] ) );
+}
+
+// Interleaved lookups must give the same results of find(), both for sets
+// that fit in the prefetched lines and for bigger ones
+template <size_t Ways>
+void test_interleaved()
+{
+#ifdef MM_HAS_COROUTINES
+    typedef pair< int, pair<long,long> > value;
+    typedef cache_map< int, pair<long,long>, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore<value>, allocator<value>, Ways
+                     > map_type;
+
+    map_type m( 2048 );
+    m.set_empty_key( -1 );
+    for ( int i = 0; i < 1000; ++i )
+        m.insert( i, pair<long,long>( i, -i ) );
+
+    std::vector<int> keys;
+    for ( int i = 0; i < 3000; i += 2 )
+        keys.push_back( i );
+
+    for ( size_t width = 0; width <= 64; width = width ? width * 4 : 1 )
+    {
+        std::vector<typename map_type::iterator> out( keys.size() );
+        mm::find_interleaved( m, &keys[0], keys.size(), &out[0], width );
+        for ( size_t i = 0; i < keys.size(); ++i )
+            CHECK( out[ i ] == m.find( keys[ i ] ) );
+    }
+
+    const map_type& cm = m;
+    std::vector<typename map_type::const_iterator> cout( keys.size() );
+    mm::find_interleaved( cm, &keys[0], keys.size(), &cout[0] );
+    size_t found = 0;
+    for ( size_t i = 0; i < keys.size(); ++i )
+    {
+        CHECK( cout[ i ] == cm.find( keys[ i ] ) );
+        found += ( cout[ i ] != cm.end() );
+    }
+    CHECK( found > 0 );
+
+    cache_set<int> s( 256 );
+    s.set_empty_key( -1 );
+    s.insert( keys.begin(), keys.begin() + 100 );
+    std::vector<cache_set<int>::iterator> sout( keys.size() );
+    mm::find_interleaved( s, &keys[0], keys.size(), &sout[0] );
+    for ( size_t i = 0; i < keys.size(); ++i )
+        CHECK( sout[ i ] == s.find( keys[ i ] ) );
+
+    // Empty batch
+    mm::find_interleaved( s, &keys[0], 0, &sout[0] );
+#endif
+}
+
+// Data type that counts its constructions and copies
+struct tracked
+{
+    static int constructed;
+    static int copied;
+    static int alive;
+
+    tracked() : value( 0 ) { ++constructed; ++alive; }
+    explicit tracked( int v ) : value( v ) { ++constructed; ++alive; }
+    tracked( const tracked& o ) : value( o.value ) { ++constructed; ++copied; ++alive; }
+    tracked( tracked&& o ) noexcept : value( o.value ) { ++constructed; ++alive; }
+    ~tracked() { --alive; }
+    tracked& operator= ( const tracked& o ) { value = o.value; ++copied; return *this; }
+    tracked& operator= ( tracked&& o ) noexcept { value = o.value; return *this; }
+
+    int value;
+};
+
+int tracked::constructed = 0;
+int tracked::copied = 0;
+int tracked::alive = 0;
+
+// Keeps the discarded items, moving them out of the table
+struct discard_keep
+{
+    static std::vector< pair<string,tracked> > kept;
+
+    void operator() ( pair<string,tracked>&& old_value,
+                      const pair<string,tracked>& new_value )
+    { kept.push_back( std::move( old_value ) ); }
+};
+
+std::vector< pair<string,tracked> > discard_keep::kept;
+
+void test_move_semantics()
+{
+    typedef cache_map< string, tracked, hash<string>, equal_to<string>,
+                       discard_keep > map_type;
+
+    map_type m( 1024 );
+    m.set_empty_key( string() );
+    tracked::copied = 0;
+
+    // rvalue insert
+    m.insert( pair<string,tracked>( "one", tracked( 1 ) ) );
+    CHECK( m.find( "one" )->second.value == 1 );
+    CHECK( tracked::copied == 0 );
+
+    // emplace
+    m.emplace( "two", tracked( 2 ) );
+    CHECK( m.find( "two" )->second.value == 2 );
+    CHECK( tracked::copied == 0 );
+
+    // try_emplace constructs nothing when the key is present
+    tracked::constructed = 0;
+    pair<map_type::iterator,bool> res = m.try_emplace( "one", 10 );
+    CHECK( ! res.second && res.first->second.value == 1 );
+    CHECK( tracked::constructed == 0 );
+
+    res = m.try_emplace( string( "three" ), 3 );
+    CHECK( res.second && res.first->second.value == 3 );
+    CHECK( tracked::constructed == 1 );
+
+    // insert_or_assign updates in place
+    tracked::constructed = 0;
+    res = m.insert_or_assign( "one", tracked( 11 ) );
+    CHECK( ! res.second && m.find( "one" )->second.value == 11 );
+    CHECK( tracked::constructed == 1 );
+    res = m.insert_or_assign( "four", tracked( 4 ) );
+    CHECK( res.second && m.find( "four" )->second.value == 4 );
+    CHECK( m.size() == 4 );
+
+    string key( "five" );
+    m[ std::move( key ) ].value = 5;
+    CHECK( m.find( "five" )->second.value == 5 );
+    CHECK( tracked::copied == 0 );
+
+    // The victims are moved to the discard function
+    map_type one( 1 );
+    one.set_empty_key( string() );
+    one.insert( pair<string,tracked>( "a", tracked( 1 ) ) );
+    discard_keep::kept.clear();
+    tracked::copied = 0;
+    one.try_emplace( "b", 2 );
+    CHECK( discard_keep::kept.size() == 1 );
+    CHECK( discard_keep::kept[0].first == "a" );
+    CHECK( discard_keep::kept[0].second.value == 1 );
+    one.insert( pair<string,tracked>( "c", tracked( 3 ) ) );
+    CHECK( discard_keep::kept.size() == 2 );
+    CHECK( discard_keep::kept[1].first == "b" );
+    CHECK( tracked::copied == 0 );
+    CHECK( one.size() == 1 && one.find( "c" )->second.value == 3 );
+
+    cache_set<string> s( 64 );
+    s.set_empty_key( string() );
+    string item( "item" );
+    s.insert( std::move( item ) );
+    s.emplace( 3, 'x' );
+    CHECK( s.find( "item" ) != s.end() && s.find( "xxx" ) != s.end() );
+}
+
+// Re-inserting a key is an in-place update, not an eviction
+void test_overwrites()
+{
+    typedef cache_map< string, tracked, hash<string>, equal_to<string>,
+                       discard_keep > map_type;
+
+    map_type m( 1 );
+    m.set_empty_key( string() );
+    discard_keep::kept.clear();
+
+    m.insert( pair<string,tracked>( "a", tracked( 1 ) ) );
+    pair<string,tracked> update( "a", tracked( 2 ) );
+    tracked::constructed = 0;
+    m.insert( std::move( update ) );
+    CHECK( tracked::constructed == 0 );
+    CHECK( m.find( "a" )->second.value == 2 );
+    CHECK( m.num_overwrites() == 1 );
+    CHECK( m.num_collisions() == 0 );
+    CHECK( discard_keep::kept.empty() );
+    CHECK( m.size() == 1 );
+
+    m.insert( pair<string,tracked>( "b", tracked( 3 ) ) );
+    CHECK( m.num_overwrites() == 1 );
+    CHECK( m.num_collisions() == 1 );
+    CHECK( discard_keep::kept.size() == 1 );
+    CHECK( discard_keep::kept[0].second.value == 2 );
+
+    m[ "b" ].value = 4;
+    CHECK( m.num_overwrites() == 1 );
+    CHECK( m.num_collisions() == 1 );
+
+    m.insert_or_assign( "b", tracked( 5 ) );
+    CHECK( m.find( "b" )->second.value == 5 );
+    CHECK( m.num_overwrites() == 2 && m.num_collisions() == 1 );
+    m.insert_or_assign( string( "c" ), tracked( 6 ) );
+    CHECK( m.num_overwrites() == 2 && m.num_collisions() == 2 );
+
+    cache_set<int> s( 64 );
+    s.set_empty_key( -1 );
+    s.insert( 5 );
+    s.insert( 5 );
+    CHECK( s.size() == 1 );
+    CHECK( s.num_overwrites() == 1 && s.num_collisions() == 0 );
+
+    mm::concurrent_cache_map<int, int> c( 1024 );
+    c.set_empty_key( -1 );
+    c.insert( 1, 1 );
+    c.insert( 1, 2 );
+    CHECK( c.num_overwrites() == 1 && c.num_collisions() == 0 );
+}
+
+// Empty buckets hold no object and are skipped by the iterators
+void test_occupancy()
+{
+    // No empty key: every key can be stored
+    typedef cache_map<int, tracked> map_type;
+    {
+        const int alive = tracked::alive;
+        map_type m( 1 << 20 );
+        CHECK( tracked::alive == alive + 1 );      // the default item only
+
+        const int keys[] = { 0, -1, 5, 1 << 19, ( 1 << 20 ) - 1, 77777 };
+        const int n = sizeof( keys ) / sizeof( *keys );
+        for ( int i = 0; i < n; ++i )
+            m[ keys[ i ] ].value = i;
+        CHECK( m.size() == size_t( n ) );
+        CHECK( mm::distance( m.begin(), m.end() ) == n );
+        CHECK( tracked::alive == alive + 1 + n );
+        for ( int i = 0; i < n; ++i )
+            CHECK( m.find( keys[ i ] )->second.value == i );
+
+        m.erase( 0 );
+        CHECK( m.find( 0 ) == m.end() );
+        CHECK( mm::distance( m.begin(), m.end() ) == n - 1 );
+
+        m.clear();
+        CHECK( m.empty() && m.begin() == m.end() );
+        CHECK( tracked::alive == alive + 1 );
+
+        m[ 3 ].value = 3;
+        CHECK( mm::distance( m.begin(), m.end() ) == 1 );
+        CHECK( m.begin()->first == 3 );
+    }
+
+    // Shrinking keeps the bitmap consistent with the items
+    cache_map<int, int> s( 256 );
+    for ( int i = 0; i < 256; ++i )
+        s[ i ] = i;
+    s.resize( 16 );
+    CHECK( s.bucket_count() == 16 );
+    CHECK( mm::distance( s.begin(), s.end() ) == ptrdiff_t( s.size() ) );
+    for ( cache_map<int, int>::iterator it = s.begin(); it != s.end(); ++it )
+        CHECK( s.find( it->first ) == it );
+
+    cache_set<int> one( 1 );
+    CHECK( one.begin() == one.end() );
+    one.insert( 0 );
+    CHECK( mm::distance( one.begin(), one.end() ) == 1 );
+}
+
+// clear() only starts a new epoch: stale items read as empty and are
+// destroyed when their set is reused or by sweep()
+void test_lazy_clear()
+{
+    typedef cache_map< int, tracked, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,tracked> >,
+                       allocator< pair<int,tracked> >, 4, mm::EvictLRU
+                     > map_type;
+
+    const int alive = tracked::alive;
+    {
+        map_type m( 1024 );
+        m.enable_lazy_clear();
+        for ( int i = 0; i < 500; ++i )
+            m[ i ].value = i;
+        const int stored = int( m.size() );
+        CHECK( tracked::alive == alive + 1 + stored );
+
+        m.clear();
+        CHECK( m.size() == 0 && m.empty() );
+        CHECK( m.begin() == m.end() );
+        CHECK( m.find( 7 ) == m.end() );
+        CHECK( m.erase( 7 ) == 0 );
+        CHECK( tracked::alive == alive + 1 + stored );   // not yet destroyed
+
+        // New items reclaim their set
+        for ( int i = 1000; i < 1100; ++i )
+            m[ i ].value = i;
+        CHECK( m.size() == 100 );
+        CHECK( mm::distance( m.begin(), m.end() ) == 100 );
+        for ( map_type::iterator it = m.begin(); it != m.end(); ++it )
+            CHECK( it->first >= 1000 && it->second.value == it->first );
+        for ( int i = 0; i < 500; ++i )
+            CHECK( m.find( i ) == m.end() );
+
+        // The sweeper destroys the rest
+        size_t rounds = 0;
+        while ( ! m.sweep( 16 ) )
+            ++rounds;
+        CHECK( rounds == m.bucket_count() / 4 / 16 - 1 );
+        CHECK( tracked::alive == alive + 1 + 100 );
+        CHECK( m.size() == 100 );
+
+        // Stale items do not survive a resize or a copy
+        m.clear();
+        m[ 5 ].value = 5;
+        map_type copy( m );
+        CHECK( copy.size() == 1 && copy.find( 5 ) != copy.end() );
+        m.resize( 4096 );
+        CHECK( m.size() == 1 && m.find( 5 )->second.value == 5 );
+        CHECK( mm::distance( m.begin(), m.end() ) == 1 );
+        m.clear();
+        CHECK( m.begin() == m.end() );
+    }
+    // The destructor destroys the stale items too
+    CHECK( tracked::alive == alive );
+
+    mm::concurrent_cache_map<int, int> c( 1024 );
+    c.enable_lazy_clear();
+    c.insert( 1, 1 );
+    c.clear();
+    int v;
+    CHECK( ! c.find( 1, v ) && c.size() == 0 );
+    c.insert( 1, 2 );
+    CHECK( c.find( 1, v ) && v == 2 );
+    while ( ! c.sweep( 4 ) )
+        ;
+    CHECK( c.size() == 1 );
+}
+
+// Resident memory of the process, in bytes, or 0 where unknown
+static size_t resident_memory()
+{
+    size_t size = 0, resident = 0;
+#ifdef __linux__
+    FILE* f = fopen( "/proc/self/statm", "r" );
+    if ( f )
+    {
+        if ( fscanf( f, "%zu %zu", &size, &resident ) != 2 )
+            resident = 0;
+        fclose( f );
+    }
+    resident *= sysconf( _SC_PAGESIZE );
+#endif
+    return resident;
+}
+
+void test_mmap_allocator()
+{
+    typedef cache_map< int, int, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       mm::mmap_allocator< pair<int,int> >, 8
+                     > map_type;
+
+    // 128 MB of buckets: only the pages in use become resident
+    const size_t before = resident_memory();
+    map_type m( 1 << 24 );
+    CHECK( m.bucket_count() == ( 1 << 24 ) && m.empty() );
+    CHECK( m.begin() == m.end() );
+    CHECK( resident_memory() - before < ( 8 << 20 ) );
+
+    for ( int i = 0; i < 1000; ++i )
+        m[ i ] = i * 2;
+    CHECK( m.size() == 1000 );
+    for ( int i = 0; i < 1000; ++i )
+        CHECK( m.find( i ) != m.end() && m.find( i )->second == i * 2 );
+    CHECK( m.find( 1000 ) == m.end() );
+    CHECK( resident_memory() - before < ( 32 << 20 ) );
+
+    m.enable_lazy_clear();
+    m.clear();
+    CHECK( m.empty() && m.find( 1 ) == m.end() );
+    m[ 1 ] = 1;
+    m.resize( 1 << 25 );
+    CHECK( m.size() == 1 && m.find( 1 )->second == 1 );
+    CHECK( resident_memory() - before < ( 32 << 20 ) );
+    m.clear();
+    CHECK( m.begin() == m.end() );
+}
+
+template <mm::page_mode Pages>
+void test_huge_pages()
+{
+    typedef cache_map< int, int, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       mm::mmap_allocator< pair<int,int>, Pages >, 8
+                     > map_type;
+
+    // Whatever the system provides, the table falls back to a working
+    // page size
+    map_type m( 1 << 20 );
+    const size_t page = m.get_allocator().page_size();
+    CHECK( page == size_t( sysconf( _SC_PAGESIZE ) ) || page == ( 2 << 20 ) );
+
+    for ( int i = 0; i < 1000; ++i )
+        m[ i ] = i;
+    for ( int i = 0; i < 1000; ++i )
+        CHECK( m.find( i ) != m.end() && m.find( i )->second == i );
+    m.resize( 1 << 22 );
+    CHECK( m.size() == 1000 && m.find( 999 )->second == 999 );
+}
+
+void test_numa()
+{
+    const int nodes = mm::numa_node_count();
+    CHECK( nodes >= 1 );
+    const int node = mm::numa_current_node();
+    CHECK( node >= 0 && node < nodes );
+
+    // Both the interleaved and the single node placements work, whether
+    // or not the kernel supports NUMA
+    typedef mm::numa_allocator< pair<int,int> > alloc_type;
+    typedef cache_map< int, int, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >, alloc_type, 4
+                     > map_type;
+    map_type interleaved( 1 << 16 );
+    map_type local( 1 << 16, hash<int>(), equal_to<int>(), alloc_type( 0 ) );
+    CHECK( interleaved.get_allocator().node() == mm::numa_interleaved );
+    CHECK( local.get_allocator().node() == 0 );
+    for ( int i = 0; i < 1000; ++i )
+    {
+        interleaved[ i ] = i;
+        local[ i ] = i;
+    }
+    for ( int i = 0; i < 1000; ++i )
+        CHECK( interleaved.find( i )->second == i
+               && local.find( i )->second == i );
+
+    // Out of range nodes are refused, and their allocators fall back on
+    // first touch placement
+    CHECK( ! mm::numa_prefer( 0, 0, -2 ) );
+    CHECK( ! mm::numa_prefer( 0, 0, MM_NUMA_MAX_NODES ) );
+    map_type far( 1 << 10, hash<int>(), equal_to<int>(), alloc_type( 1000 ) );
+    far[ 1 ] = 1;
+    CHECK( far.find( 1 )->second == 1 );
+
+    // The node survives copies and resizes
+    map_type copy( local );
+    copy.resize( 1 << 18 );
+    CHECK( copy.get_allocator().node() == 0 && copy.find( 7 )->second == 7 );
+
+    typedef mm::concurrent_cache_map<
+        int, int, hash<int>, equal_to<int>,
+        mm::DiscardIgnore< pair<int,int> >, alloc_type, 4 > concurrent_type;
+    mm::replicated_cache_map<concurrent_type> r( 1 << 12, 4 );
+    CHECK( int( r.replica_count() ) == nodes );
+    CHECK( r.replica( 0 ).get_allocator().node() == 0 );
+    CHECK( r.insert( 1, 10 ) );
+    int v;
+    CHECK( r.find( 1, v ) && v == 10 );
+    for ( int i = 0; i < nodes; ++i )
+        CHECK( r.replica( i ).find( 1, v ) && v == 10 );
+    CHECK( r.insert( 1, 20 ) && r.find( 1, v ) && v == 20 );
+    CHECK( r.size() == 1 );
+    CHECK( r.erase( 1 ) == 1 && ! r.find( 1, v ) );
+    r.insert( 2, 2 );
+    r.clear();
+    CHECK( r.empty() );
+}
+
+void test_snapshot()
+{
+    typedef cache_map< int, int, hash<int>, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       allocator< pair<int,int> >, 4, mm::EvictLRU
+                     > map_type;
+    typedef cache_map< int, int, identity_hash, equal_to<int>,
+                       mm::DiscardIgnore< pair<int,int> >,
+                       allocator< pair<int,int> >, 4
+                     > other_hash_map;
+    const char* path = "snapshot.tmp";
+
+    map_type m( 4096 );
+    for ( int i = 0; i < 1000; ++i )
+        m[ i ] = i * 3;
+    CHECK( m.save( path ) );
+
+    // Same layout: the arrays are read back as they are
+    map_type same( 4096 );
+    same[ 5000 ] = 1;
+    CHECK( same.load( path ) );
+    CHECK( same.size() == m.size() && same.find( 5000 ) == same.end() );
+    for ( map_type::iterator it = m.begin(); it != m.end(); ++it )
+        CHECK( same.find( it->first )->second == it->second );
+
+    // Different sizes and hash functions: the items are rehashed
+    map_type bigger( 1 << 16 );
+    CHECK( bigger.load( path ) && bigger.size() == m.size() );
+    for ( map_type::iterator it = m.begin(); it != m.end(); ++it )
+        CHECK( bigger.find( it->first )->second == it->second );
+
+    map_type smaller( 256 );
+    CHECK( smaller.load( path ) && smaller.size() == 256 );
+    for ( map_type::iterator it = smaller.begin(); it != smaller.end(); ++it )
+        CHECK( it->second == it->first * 3 );
+
+    other_hash_map other( 4096 );
+    CHECK( other.load( path ) && other.size() == m.size() );
+    for ( map_type::iterator it = m.begin(); it != m.end(); ++it )
+        CHECK( other.find( it->first )->second == it->second );
+
+    // Items cleared lazily are not saved
+    m.enable_lazy_clear();
+    m.clear();
+    m[ 7 ] = 70;
+    CHECK( m.save( path ) );
+    CHECK( same.load( path ) && same.size() == 1 );
+    CHECK( same.find( 7 )->second == 70 && same.find( 8 ) == same.end() );
+    CHECK( mm::distance( same.begin(), same.end() ) == 1 );
+
+    // Strings, one item at a time
+    cache_map<string, string> strings( 1024 );
+    strings[ "key" ] = "value";
+    strings[ "" ] = "empty";
+    strings[ "long" ] = string( 1000, 'x' );
+    CHECK( strings.save( path ) );
+
+    cache_map<string, string> loaded( 64 );
+    CHECK( loaded.load( path ) && loaded.size() == 3 );
+    CHECK( loaded[ "key" ] == "value" && loaded[ "" ] == "empty" );
+    CHECK( loaded[ "long" ] == string( 1000, 'x' ) );
+
+    // Snapshots of other types are rejected
+    CHECK( ! m.load( path ) && m.size() == 1 );
+    CHECK( ! m.load( "no such file" ) );
+
+    remove( path );
+}
+
+template <class Map>
+concept can_reallocate = requires( Map& m )
+{
+    m.resize( 1 );
+} || requires( Map& m ) {
+    m.enable_lazy_clear();
+} || requires( Map& m ) {
+    m.swap( m );
+} || requires( Map& m ) {
+    swap( m, m );
+};
+
+void test_persistent()
+{
+    typedef mm::fixed_string<16> key_type;
+    typedef mm::persistent_cache_map< key_type, int, hash<key_type>,
+                                      equal_to<key_type>,
+                                      mm::DiscardIgnore< pair<key_type,int> >,
+                                      4 > map_type;
+    const char* path = "persistent.tmp";
+    remove( path );
+
+    // The operations that reallocate or exchange the arrays do not compile
+    static_assert( ! can_reallocate<map_type>
+                   && can_reallocate< cache_map<int,int> > );
+
+    key_type k( "abc" );
+    CHECK( k.size() == 3 && k.str() == "abc" && k == key_type( "abc" ) );
+    CHECK( hash<key_type>()( k ) == hash<string>()( string( "abc" ) ) );
+    CHECK( key_type( string( 16, 'x' ) ).size() == 16 );
+    bool thrown = false;
+    try { key_type( string( 17, 'x' ) ); }
+    catch ( const std::length_error& ) { thrown = true; }
+    CHECK( thrown );
+
+    size_t stored;
+    {
+        map_type m( path, 1024 );
+        CHECK( m.created() && m.empty() );
+        for ( int i = 0; i < 500; ++i )
+            m[ std::to_string( i ) ] = i;
+        stored = m.size();
+
+        // The file is locked while attached
+        thrown = false;
+        try { map_type other( path, 1024 ); }
+        catch ( const std::runtime_error& ) { thrown = true; }
+        CHECK( thrown );
+    }
+
+    // The items survive the map
+    {
+        map_type m( path, 1024 );
+        CHECK( ! m.created() && m.size() == stored );
+        CHECK( size_t( mm::distance( m.begin(), m.end() ) ) == stored );
+        for ( map_type::iterator it = m.begin(); it != m.end(); ++it )
+            CHECK( std::to_string( it->second ) == it->first.str() );
+        m.erase( key_type( "1" ) );
+        stored = m.size();
+    }
+
+    // A different layout or hash function cannot attach the file
+    thrown = false;
+    try { map_type m( path, 2048 ); }
+    catch ( const std::runtime_error& ) { thrown = true; }
+    CHECK( thrown );
+    thrown = false;
+    try { map_type m( path, 1024, map_type::default_hash_id() + 1 ); }
+    catch ( const std::runtime_error& ) { thrown = true; }
+    CHECK( thrown );
+
+    {
+        map_type m( path, 1024 );
+        CHECK( m.size() == stored && m.find( key_type( "1" ) ) == m.end() );
+
+        // Snapshots are loaded in the mapped arrays, and a file that is
+        // not a snapshot leaves the map untouched
+        CHECK( m.save( "persistent.snap" ) );
+        m.clear();
+        CHECK( m.load( "persistent.snap" ) && m.size() == stored );
+        CHECK( m.find( key_type( "2" ) )->second == 2 );
+        CHECK( ! m.load( path ) && m.size() == stored );
+        remove( "persistent.snap" );
+    }
+
+    // A process that dies while attached leaves a dirty file, which is
+    // emptied
+    if ( fork() == 0 )
+    {
+        map_type m( path, 1024 );
+        m[ key_type( "child" ) ] = 1;
+        _exit( 0 );
+    }
+    int status;
+    wait( &status );
+    {
+        map_type m( path, 1024 );
+        CHECK( m.created() && m.empty() );
+    }
+
+    remove( path );
+}
+
+void test_shared()
+{
+    typedef mm::shared_cache_map< int, int, hash<int>, equal_to<int>, 4 >
+        map_type;
+    const char* name = "/mm_map_unittest";
+    map_type::remove( name );
+
+    map_type m( name, 4096 );
+    CHECK( m.created() && m.empty() && m.bucket_count() == 4096 );
+
+    // A different layout cannot open the segment
+    bool thrown = false;
+    try { map_type other( name, 8192 ); }
+    catch ( const std::runtime_error& ) { thrown = true; }
+    CHECK( thrown );
+
+    // The items inserted by other processes are found
+    for ( int c = 0; c < 4; ++c )
+        if ( fork() == 0 )
+        {
+            map_type child( name, 4096 );
+            for ( int i = c; i < 2000; i += 4 )
+                child.insert( i, i * 3 );
+            _exit( child.created() ? 1 : 0 );
+        }
+    int status;
+    for ( int c = 0; c < 4; ++c )
+    {
+        wait( &status );
+        CHECK( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+    }
+
+    int found = 0;
+    for ( int i = 0; i < 2000; ++i )
+    {
+        int data = -1;
+        if ( m.find( i, data ) )
+        {
+            CHECK( data == i * 3 );
+            ++found;
+        }
+    }
+    CHECK( found > 1000 && size_t( found ) == m.size() );
+
+    int data;
+    const bool had = m.find( 0, data );
+    CHECK( m.erase( 0 ) == size_t( had ) && ! m.find( 0, data ) );
+    m.clear();
+    CHECK( m.empty() );
+
+    // A process killed while writing does not block the others
+    pid_t pid = fork();
+    if ( pid == 0 )
+    {
+        map_type child( name, 4096 );
+        for ( int i = 0; ; ++i )
+            child.insert( i & 0xffff, i );
+    }
+    usleep( 50000 );
+    kill( pid, SIGKILL );
+    waitpid( pid, &status, 0 );
+
+    for ( int i = 0; i < 4096; ++i )
+        m.insert( i, -i );
+    for ( int i = 0; i < 4096; ++i )
+    {
+        int data = 1;
+        if ( m.find( i, data ) )
+            CHECK( data <= 0 || data % 0x10000 == i );
+    }
+
+    // The repair of a set left half written keeps the count exact, when
+    // the dead writer was adding or removing an item
+    for ( int k = 0; k < 100; ++k )
+    {
+        m.clear();
+        pid = fork();
+        if ( pid == 0 )
+        {
+            map_type child( name, 4096 );
+            for ( int i = 0; ; ++i )
+            {
+                child.insert( i & 0xff, i );
+                child.erase( i & 0xff );
+            }
+        }
+        usleep( 5000 );
+        kill( pid, SIGKILL );
+        waitpid( pid, &status, 0 );
+
+        m.clear();
+        CHECK( m.empty() );
+    }
+    for ( int i = 0; i < 1024; ++i )
+    {
+        int data = 1;
+        m.insert( i, -i );
+        CHECK( m.find( i, data ) && data == -i );
+    }
+
+    // Nor does a process killed while clearing
+    pid = fork();
+    if ( pid == 0 )
+    {
+        map_type child( name, 4096 );
+        for ( ;; )
+            child.clear();
+    }
+    usleep( 50000 );
+    kill( pid, SIGKILL );
+    waitpid( pid, &status, 0 );
+
+    for ( int i = 0; i < 4096; ++i )
+    {
+        int data = 1;
+        m.insert( i, i );
+        CHECK( m.find( i, data ) && data == i );
+    }
+    m.clear();
+    CHECK( m.empty() );
+
+    CHECK( map_type::remove( name ) );
+}
+
+void test_tiered()
+{
+    typedef mm::tiered_cache_map<int, int> map_type;
+    map_type m( 64, 4096 );
+    CHECK( m.empty() && m.bucket_count() == 64 + 4096 );
+
+    // The victims of the first level are kept by the second one
+    for ( int i = 0; i < 1000; ++i )
+        m.insert( i, i * 2 );
+    CHECK( m.first().size() <= 64 && m.num_demotions() > 0 );
+    CHECK( m.size() == m.first().size() + m.next().size() );
+
+    int found = 0;
+    for ( int i = 0; i < 1000; ++i )
+    {
+        int data = -1;
+        if ( m.find( i, data ) )
+        {
+            CHECK( data == i * 2 );
+            ++found;
+        }
+    }
+    CHECK( found > 900 && m.num_lookups() == 1000 );
+    CHECK( m.num_first_hits() + m.num_next_hits() == size_t( found ) );
+    CHECK( m.hit_ratio() == found / 1000.0 );
+
+    // A hit in the second level promotes the item, each key is in a single
+    // level
+    m.reset_stats();
+    int data;
+    const int key = m.next().begin()->first;
+    CHECK( m.find( key, data ) && m.num_next_hits() == 1 );
+    CHECK( m.first().find( key ) != m.first().end() );
+    CHECK( m.next().find( key ) == m.next().end() );
+    CHECK( m.find( key, data ) && m.num_first_hits() == 1 );
+    CHECK( m.first_hit_ratio() == 0.5 && m.next_hit_ratio() == 1.0 );
+
+    // A new value replaces the demoted one, which leaves the second level
+    const int old = m.next().begin()->first;
+    const size_t size = m.size(), next_size = m.next().size();
+    m.insert( old, -1 );
+    CHECK( m.next().find( old ) == m.next().end() );
+    CHECK( m.size() == size && m.next().size() <= next_size );
+    CHECK( m.size() == m.first().size() + m.next().size() );
+    CHECK( m.find( old, data ) && data == -1 );
+    for ( int i = 1000; i < 1200; ++i )
+        m.insert( i, i * 2 );
+    CHECK( ! m.find( old, data ) || data == -1 );
+
+    CHECK( m.erase( key ) == 1 && ! m.find( key, data ) );
+    CHECK( m.num_misses() == 1 );
+    m.clear();
+    CHECK( m.empty() && ! m.find( 1, data ) );
+}
+
+void test_spill()
+{
+    typedef mm::spill_log<int, string> log_type;
+    typedef mm::cache_map< int, string, hash<int>, equal_to<int>,
+                           mm::DiscardDemote< pair<int,string>, log_type >
+                         > map_type;
+    const char* dir = "spill.tmp";
+
+    {
+        // The victims of the map are spilled to the log
+        log_type log( dir, 1 << 14, 1 << 20, 64 << 10, 4096 );
+        map_type m( 64 );
+        m.discard_funct().next( &log );
+
+        for ( int i = 0; i < 1000; ++i )
+            m[ i ] = string( 100 + i % 50, 'a' + i % 26 );
+        CHECK( log.size() == m.discard_funct().num_demotions() );
+        CHECK( log.size() + m.size() == 1000 && log.segment_count() > 1 );
+
+        for ( int i = 0; i < 1000; ++i )
+        {
+            string data;
+            const bool found = ( m.find( i ) != m.end() )
+                               || log.find( i, data );
+            CHECK( found );
+            CHECK( data.empty()
+                   || data == string( 100 + i % 50, 'a' + i % 26 ) );
+        }
+        CHECK( log.num_reads() == log.size() );
+
+        // A new item replaces the old one, whose space is garbage
+        int key = 0;
+        string data;
+        while ( ! log.find( key, data ) )
+            ++key;
+        const uint64_t live = log.live_size();
+        CHECK( log.insert( key, "new" ) && log.live_size() < live );
+        CHECK( log.find( key, data ) && data == "new" );
+        CHECK( log.erase( key ) == 1 && ! log.find( key, data ) );
+        CHECK( log.erase( key ) == 0 );
+
+        // The segments beyond the capacity are removed
+        for ( int i = 0; i < 20000; ++i )
+            log.insert( i, string( 200, 'x' ) );
+        CHECK( log.segment_count() <= 16 && log.disk_size() <= ( 1 << 20 ) );
+        CHECK( log.live_size() <= log.disk_size() );
+        CHECK( log.find( 19999, data ) && data == string( 200, 'x' ) );
+        CHECK( ! log.find( 0, data ) );
+
+        log.clear();
+        CHECK( log.empty() && log.disk_size() == 0 );
+        CHECK( ! log.find( 19999, data ) );
+
+        // The live items of a segment that is mostly garbage are copied to
+        // the current one when the segment is removed: every segment keeps
+        // a few items, among many replaced ones
+        for ( int i = 0; i < 20000; ++i )
+            if ( i % 100 == 0 )
+                CHECK( log.insert( -1 - i / 100, std::to_string( i ) ) );
+            else
+                log.insert( i % 100, string( 200, 'y' ) );
+        CHECK( log.segment_count() <= 16 && log.disk_size() <= ( 1 << 20 ) );
+        CHECK( log.size() == 99 + 200 );
+        for ( int i = 0; i < 20000; i += 100 )
+            CHECK( log.find( -1 - i / 100, data )
+                   && data == std::to_string( i ) );
+        CHECK( log.find( 99, data ) && data == string( 200, 'y' ) );
+        CHECK( log.live_size() <= log.disk_size() );
+        log.clear();
+    }
+
+    {
+        // When a new segment cannot be created, the items keep going to
+        // the current one and the map does not see an error
+        log_type log( dir, 1 << 14, 1 << 20, 4096, 4096 );
+        map_type m( 64 );
+        m.discard_funct().next( &log );
+
+        CHECK( rename( dir, "spill.moved" ) == 0 );
+        for ( int i = 0; i < 1000; ++i )
+            m[ i ] = string( 100 + i % 50, 'a' + i % 26 );
+        CHECK( log.segment_count() == 1 && log.size() + m.size() == 1000 );
+        for ( int i = 0; i < 1000; ++i )
+        {
+            string data;
+            if ( m.find( i ) != m.end() )
+                data = m.find( i )->second;
+            else
+                CHECK( log.find( i, data ) );
+            CHECK( data == string( 100 + i % 50, 'a' + i % 26 ) );
+        }
+
+        // The segments are rotated again once they can be created
+        CHECK( rename( "spill.moved", dir ) == 0 );
+        CHECK( log.insert( 1000, "x" ) && log.segment_count() == 2 );
+    }
+
+    {
+        // Under a tiered_cache_map, the misses are served from the log
+        typedef mm::cache_map< int, string, hash<int>, equal_to<int>,
+                               mm::DiscardDemote< pair<int,string>,
+                                                  log_type >,
+                               std::allocator< pair<int,string> >, 8
+                             > next_type;
+        typedef mm::tiered_cache_map< int, string, next_type > tiered_type;
+
+        log_type log( dir, 1 << 14, 1 << 20 );
+        tiered_type t( 16, 64 );
+        t.next().discard_funct().next( &log );
+
+        for ( int i = 0; i < 1000; ++i )
+            t.insert( i, std::to_string( i ) );
+        CHECK( log.size() >= 1000 - t.size() );
+
+        string data;
+        for ( int i = 0; i < 1000; ++i )
+            CHECK( t.find( i, data ) && data == std::to_string( i ) );
+        CHECK( t.num_last_hits() > 900 && t.num_misses() == 0 );
+        CHECK( t.last_hit_ratio() == 1.0 && t.hit_ratio() == 1.0 );
+
+        CHECK( t.erase( 0 ) == 1 && ! t.find( 0, data ) );
+        CHECK( t.erase( 0 ) == 0 && t.num_misses() == 1 );
+        t.clear();
+        CHECK( t.empty() && log.empty() && ! t.find( 1, data ) );
+    }
+
+    CHECK( rmdir( dir ) == 0 );
+}
+
+// Handler of the write-behind tests, slowed down by @a delay microseconds
+struct collect_handler
+{
+    collect_handler( std::vector<int>* keys = 0, int delay = 0 )
+        : m_keys( keys ), m_delay( delay ) {}
+
+    void operator() ( pair<int,int>&& item )
+    {
+        CHECK( item.second == item.first * 2 );
+        m_keys->push_back( item.first );
+        if ( m_delay )
+            usleep( m_delay );
+    }
+
+    std::vector<int>* m_keys;
+    int               m_delay;
+};
+
+template <mm::backpressure Mode>
+void test_write_behind( int delay )
+{
+    typedef mm::write_behind< pair<int,int>, collect_handler > queue_type;
+    typedef mm::cache_map< int, int, hash<int>, equal_to<int>,
+                           mm::DiscardWriteBehind< pair<int,int>,
+                                                   collect_handler >
+                         > map_type;
+
+    std::vector<int> keys;
+    size_t discarded;
+    {
+        queue_type queue( 16, Mode, collect_handler( &keys, delay ), 4 );
+        CHECK( queue.capacity() == 16 );
+        map_type m( 64 );
+        m.discard_funct().queue( &queue );
+
+        for ( int i = 0; i < 1000; ++i )
+            m.insert( i, i * 2 );
+        discarded = 1000 - m.size();
+
+        queue.flush();
+        CHECK( queue.depth() == 0 && queue.max_depth() <= 16 + 4 );
+        CHECK( queue.num_handled() == queue.num_queued() );
+        CHECK( queue.num_queued() + queue.num_dropped() + queue.num_inline()
+               == discarded );
+        CHECK( keys.size() == discarded - queue.num_dropped() );
+
+        if ( Mode == mm::block_when_full )
+            CHECK( queue.num_dropped() == 0 && queue.num_inline() == 0 );
+        if ( Mode == mm::drop_when_full )
+            CHECK( queue.num_dropped() > 0 && queue.num_inline() == 0 );
+        if ( Mode == mm::inline_when_full )
+            CHECK( queue.num_inline() > 0 && queue.num_dropped() == 0 );
+
+        for ( size_t i = 0; i < keys.size(); ++i )
+            CHECK( m.find( keys[ i ] ) == m.end() );
+    }
+
+    std::sort( keys.begin(), keys.end() );
+    CHECK( std::unique( keys.begin(), keys.end() ) == keys.end() );
+}
+
+// Many threads push in a write-behind queue, without locks
+void test_write_behind_threads()
+{
+    typedef mm::write_behind< pair<int,int>, collect_handler > queue_type;
+
+    std::vector<int> keys;
+    queue_type queue( 64, mm::block_when_full, collect_handler( &keys ), 8 );
+
+    const int threads = 4;
+    std::atomic<int> running( threads );
+    std::vector<std::thread> producers;
+    for ( int t = 0; t < threads; ++t )
+        producers.push_back( std::thread( [&queue, &running, t] {
+            for ( int i = t; i < 40000; i += threads )
+                queue.push( pair<int,int>( i, i * 2 ) );
+            --running;
+        } ) );
+
+    while ( running > 0 )
+        CHECK( queue.depth() <= 64 + 8 );
+    for ( int t = 0; t < threads; ++t )
+        producers[ t ].join();
+
+    queue.flush();
+    CHECK( queue.num_queued() == 40000 && queue.num_handled() == 40000 );
+    CHECK( queue.depth() == 0 && queue.max_depth() <= 64 + 8 );
+
+    std::sort( keys.begin(), keys.end() );
+    for ( int i = 0; i < 40000; ++i )
+        CHECK( keys[ i ] == i );
+}
+
+// A value owning heap memory, that counts where it is freed
+struct heavy
+{
+    static std::atomic<int> s_freed_here;
+    static std::atomic<int> s_freed_elsewhere;
+    static std::thread::id  s_here;
+
+    heavy() {}
+    heavy( int n ) : m_strings( n, string( 100, 'x' ) ) {}
+    heavy( const heavy& ) = default;
+    heavy( heavy&& ) = default;
+    heavy& operator= ( const heavy& ) = default;
+    heavy& operator= ( heavy&& ) = default;
+
+    ~heavy()
+    {
+        if ( m_strings.empty() )
+            return;
+        if ( std::this_thread::get_id() == s_here )
+            ++s_freed_here;
+        else
+            ++s_freed_elsewhere;
+    }
+
+    std::vector<string> m_strings;
+};
+
+std::atomic<int> heavy::s_freed_here;
+std::atomic<int> heavy::s_freed_elsewhere;
+std::thread::id  heavy::s_here;
+
+void test_reclaimer()
+{
+    typedef mm::reclaimer< pair<int,heavy> > reclaimer_type;
+    typedef mm::cache_map< int, heavy, hash<int>, equal_to<int>,
+                           mm::DiscardRetire< pair<int,heavy> >
+                         > map_type;
+    heavy::s_here = std::this_thread::get_id();
+
+    // The victims are destroyed by the background thread
+    {
+        reclaimer_type r( true, 16 );
+        map_type m( 64 );
+        m.discard_funct().reclaimer( &r );
+
+        for ( int i = 0; i < 1000; ++i )
+            m.insert( pair<int,heavy>( i, heavy( 10 ) ) );
+        const size_t evicted = 1000 - m.size();
+        CHECK( heavy::s_freed_here == 0 );
+
+        m.discard_funct().flush();
+        r.flush();
+        CHECK( r.num_retired() == evicted && r.pending() == 0 );
+        CHECK( r.num_reclaimed() == evicted );
+        CHECK( heavy::s_freed_here == 0
+               && size_t( heavy::s_freed_elsewhere ) == evicted );
+    }
+
+    // Without the thread, the victims wait for reclaim()
+    heavy::s_freed_elsewhere = 0;
+    reclaimer_type r( false, 16 );
+    {
+        map_type m( 64 );
+        m.discard_funct().reclaimer( &r );
+        for ( int i = 0; i < 1000; ++i )
+            m.insert( pair<int,heavy>( i, heavy( 1 ) ) );
+
+        const int live = m.size();
+        heavy::s_freed_here = 0;
+        const size_t pending = r.pending();
+        CHECK( pending > 0 && pending <= size_t( 1000 - live ) );
+        r.reclaim();
+        CHECK( size_t( heavy::s_freed_here ) == pending && r.pending() == 0 );
+    }
+
+    // The table hands over its last items when destroyed, and flush()
+    // destroys them without the thread
+    CHECK( r.pending() > 0 && r.num_retired() == r.num_reclaimed()
+                                                 + r.pending() );
+    r.flush();
+    CHECK( r.pending() == 0 && heavy::s_freed_elsewhere == 0 );
+}
+
+// A 4-ways set, with 16 sets: keys multiple of 16 are all mapped to set 0
+template <class Policy>
+struct policy_set
+{
+    typedef cache_set< int, identity_hash, equal_to<int>,
+                       mm::CacheSetDiscardIgnore<int>, allocator<int>, 4,
+                       Policy
+                     > type;
+};
+
+void test_eviction_policies()
+{
+    // LRU: the least recently used item of the set is evicted
+    {
+        policy_set<mm::EvictLRU>::type s( 64 );
+        for ( int i = 0; i < 4; ++i )
+            s.insert( i * 16 );
+        CHECK( s.find( 0 ) != s.end() );
+        s.insert( 64 );
+        CHECK( s.find( 16 ) == s.end() );
+        CHECK( s.find( 0 ) != s.end() );
+        s.insert( 80 );
+        CHECK( s.find( 32 ) == s.end() );
+        CHECK( s.size() == 4 );
+    }
+
+    // CLOCK: items used since the last sweep of the hand survive
+    {
+        policy_set<mm::EvictClock>::type s( 64 );
+        for ( int i = 0; i < 4; ++i )
+            s.insert( i * 16 );
+        s.insert( 64 );
+        CHECK( s.find( 0 ) == s.end() );
+        CHECK( s.find( 32 ) != s.end() );
+        s.insert( 80 );
+        s.insert( 96 );
+        CHECK( s.find( 32 ) != s.end() );
+        CHECK( s.find( 16 ) == s.end() );
+        CHECK( s.find( 48 ) == s.end() );
+        CHECK( s.size() == 4 );
+    }
+
+    // LFU: the least frequently used item of the set is evicted
+    {
+        policy_set<mm::EvictLFU>::type s( 64 );
+        for ( int i = 0; i < 4; ++i )
+            s.insert( i * 16 );
+        for ( int i = 0; i < 3; ++i )
+        {
+            s.find( i * 16 );
+            s.find( i * 16 );
+        }
+        s.insert( 64 );
+        CHECK( s.find( 48 ) == s.end() );
+        s.insert( 80 );
+        CHECK( s.find( 64 ) == s.end() );
+        for ( int i = 0; i < 3; ++i )
+            CHECK( s.find( i * 16 ) != s.end() );
+    }
+
+    // Random: any item can be evicted, but the set is always full
+    {
+        policy_set<mm::EvictRandom>::type s( 64 );
+        for ( int i = 0; i < 100; ++i )
+            s.insert( i * 16 );
+        CHECK( s.size() == 4 );
+        CHECK( s.num_collisions() == 96 );
+    }
+}
+
+// Identity hasher that counts its calls
+struct counting_hash
+{
+    size_t operator()( int n ) const { ++calls; return n; }
+
+    static size_t calls;
+};
+
+size_t counting_hash::calls = 0;
+
+void test_tinylfu()
+{
+    // Direct-mapped: a new key is admitted only if it is more popular than
+    // the resident one
+    {
+        typedef cache_map< int, int, identity_hash, equal_to<int>,
+                           mm::DiscardIgnore< pair<int,int> >,
+                           allocator< pair<int,int> >, 1,
+                           mm::TinyLFU<>
+                         > map1;
+        map1 m( 64 );
+        CHECK( m.insert( 1, 1 ).second );
+        for ( int i = 0; i < 5; ++i )
+            CHECK( m.find( 1 ) != m.end() );
+
+        // 65 is mapped to the same bucket of 1
+        CHECK( ! m.insert( 65, 65 ).second );
+        CHECK( m.find( 65 ) == m.end() );
+        CHECK( m.find( 1 ) != m.end() );
+
+        // Once it is seen often enough, it is admitted
+        for ( int i = 0; i < 10; ++i )
+            m.find( 65 );
+        CHECK( m.insert( 65, 65 ).second );
+        CHECK( m.find( 65 ) != m.end() );
+        CHECK( m.num_collisions() == 1 );
+
+        // operator[] always admits the key
+        m[ 1 ] = 2;
+        CHECK( m.find( 1 ) != m.end() );
+    }
+
+    // Set-associative: a scan only churns the window item of the set
+    {
+        policy_set< mm::TinyLFU<mm::EvictLRU> >::type s( 64 );
+        for ( int i = 0; i < 4; ++i )
+            s.insert( i * 16 );
+        for ( int n = 0; n < 3; ++n )
+            for ( int i = 0; i < 4; ++i )
+                s.find( i * 16 );
+
+        for ( int i = 4; i < 100; ++i )
+            s.insert( i * 16 );
+        CHECK( s.size() == 4 );
+
+        int found = 0;
+        for ( int i = 0; i < 4; ++i )
+            found += ( s.find( i * 16 ) != s.end() );
+        CHECK( found == 3 );
+        CHECK( s.find( 99 * 16 ) != s.end() );
+    }
+
+    // The admission compares the resident items without hashing their keys
+    // again
+    {
+        typedef cache_map< int, int, counting_hash, equal_to<int>,
+                           mm::DiscardIgnore< pair<int,int> >,
+                           allocator< pair<int,int> >, 4,
+                           mm::TinyLFU<mm::EvictLRU>
+                         > map4;
+        map4 m( 64 );
+        for ( int i = 0; i < 4; ++i )
+            m.insert( i * 16, i );
+
+        counting_hash::calls = 0;
+        for ( int i = 4; i < 100; ++i )
+            m.insert( i * 16, i );
+        CHECK( counting_hash::calls == 96 && m.size() == 4 );
+    }
+}
+
+// Each thread inserts its own keys, then checks that every key it finds
+// has the right value.
+template <class cmap>
+void concurrent_worker( cmap* m, int id, int* found )
+{
+    const int n = 20000;
+    for ( int i = 0; i < n; ++i )
+        m->insert( id * n + i, ( id * n + i ) * 2 );
+
+    *found = 0;
+    for ( int i = 0; i < n; ++i )
+    {
+        int value = -1;
+        if ( m->find( id * n + i, value ) )
+        {
+            CHECK( value == ( id * n + i ) * 2 );
+            ++*found;
+        }
+    }
+
+    for ( int i = 0; i < n; i += 2 )
+        m->erase( id * n + i );
+}
+
+template <class cmap>
+void test_concurrent()
+{
+    const int threads = 4;
+    cmap m( 1 << 16, 16 );
+    CHECK( m.shard_count() == 16 );
+    CHECK( m.bucket_count() == 1 << 16 );
+
+    std::vector<std::thread> workers;
+    int found[ threads ];
+    for ( int i = 0; i < threads; ++i )
+        workers.push_back( std::thread( concurrent_worker<cmap>, &m, i,
+                                        &found[ i ] ) );
+    for ( int i = 0; i < threads; ++i )
+        workers[ i ].join();
+
+    for ( int i = 0; i < threads; ++i )
+        CHECK( found[ i ] > 0 );
+    CHECK( m.size() <= m.bucket_count() );
+    CHECK( m.size() + m.num_collisions() <= size_t( threads * 20000 ) );
+
+    int value = 0;
+    CHECK( m.insert( -5, 7 ) );
+    CHECK( m.find( -5, value ) && value == 7 );
+    CHECK( m.erase( -5 ) == 1 );
+    CHECK( ! m.find( -5, value ) );
+    m.clear();
+    CHECK( m.empty() );
+}
+
+// With seq_lock, readers must never see an item half-written.
+void test_seq_lock()
+{
+    typedef pair<long,long> data;
+    typedef mm::concurrent_cache_map<
+        int, data, hash<int>, equal_to<int>,
+        mm::DiscardIgnore< pair<int,data> >, allocator< pair<int,data> >,
+        4, mm::EvictRandom, mm::seq_lock > cmap;
+
+    cmap m( 256, 4 );
+    std::atomic<bool> done( false );
+    std::atomic<long> reads( 0 );
+
+    std::thread writer( [&]() {
+        for ( long i = 0; i < 200000; ++i )
+            m.insert( i % 512, data( i, -i ) );
+        done = true;
+    } );
+
+    std::vector<std::thread> readers;
+    for ( int t = 0; t < 3; ++t )
+        readers.push_back( std::thread( [&]() {
+            data d;
+            while ( ! done )
+                for ( int k = 0; k < 512; ++k )
+                    if ( m.find( k, d ) )
+                    {
+                        CHECK( d.first == -d.second );
+                        CHECK( d.first % 512 == k );
+                        ++reads;
+                    }
+        } ) );
+
+    writer.join();
+    for ( size_t t = 0; t < readers.size(); ++t )
+        readers[ t ].join();
+
+    std::cout << "Consistent reads: " << reads << std::endl;
+}
+
+// Writers store values derived from the key, readers must never see a value
+// that does not belong to the key.
+template <class amap>
+void test_atomic()
+{
+    typedef typename amap::key_type    K;
+    typedef typename amap::mapped_type V;
+
+    amap m( 1000 );
+    CHECK( m.bucket_count() == 1024 );
+    CHECK( m.empty() );
+
+    V v;
+    m.insert( 1, 10 );
+    CHECK( m.find( 1, v ) && v == 10 );
+    CHECK( ! m.find( 2, v ) );
+    m.insert( 1, 11 );
+    CHECK( m.find( 1, v ) && v == 11 );
+
+    // Look for a key that goes in the same slot of 1
+    const size_t mask = m.bucket_count() - 1;
+    K other = 2;
+    while ( ( m.hash_funct()( other ) & mask ) != ( m.hash_funct()( 1 ) & mask ) )
+        ++other;
+
+    m.insert( other, 12 );
+    CHECK( ! m.find( 1, v ) );
+    CHECK( m.size() == 1 );
+    CHECK( m.erase( 1 ) == 0 );
+    CHECK( m.erase( other ) == 1 );
+    CHECK( m.empty() );
+
+    // Key 0 can be used once another empty key is chosen
+    amap z( 16 );
+    z.set_empty_key( K( -1 ) );
+    z.insert( 0, 5 );
+    CHECK( z.find( 0, v ) && v == 5 );
+    CHECK( z.size() == 1 );
+
+    std::atomic<bool> done( false );
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < 2; ++t )
+        threads.push_back( std::thread( [&m, t]() {
+            for ( K i = 1; i < 200000; ++i )
+                m.insert( i * 2 + t, V( i * 2 + t ) * 3 );
+        } ) );
+    for ( int t = 0; t < 2; ++t )
+        threads.push_back( std::thread( [&m, &done]() {
+            V value;
+            while ( ! done )
+                for ( K k = 1; k < 4096; ++k )
+                    if ( m.find( k, value ) )
+                        CHECK( value == V( k ) * 3 );
+        } ) );
+
+    threads[ 0 ].join();
+    threads[ 1 ].join();
+    done = true;
+    threads[ 2 ].join();
+    threads[ 3 ].join();
+    CHECK( m.size() == m.bucket_count() );
+    m.clear();
+    CHECK( m.empty() );
+}
+
+// Checks the lookups that compare the tags of a whole set at once.
+template <size_t Ways>
+void test_tags()
+{
+    typedef cache_set< string, hash<string>, equal_to<string>,
+                       mm::CacheSetDiscardIgnore<string>, allocator<string>,
+                       Ways
+                     > set_type;
+
+    set_type s( 4 * Ways );
+    s.set_empty_key( "-*- empty key -*-" );
+
+    // The empty key is never found, not even in empty buckets
+    CHECK( s.find( "-*- empty key -*-" ) == s.end() );
+
+    // Fill the table, then check that every key in it can be found.
+    std::set<string> all;
+    char key[ 32 ];
+    for ( int i = 0; i < 1000; ++i )
+    {
+        sprintf( key, "key-%d", i );
+        s.insert( key );
+        all.insert( key );
+    }
+    CHECK( s.size() == s.bucket_count() );
+    CHECK( all.size() == s.size() + s.num_collisions() );
+
+    size_t found = 0;
+    for ( std::set<string>::const_iterator it = all.begin();
+          it != all.end(); ++it )
+        found += ( s.find( *it ) != s.end() );
+    CHECK( found == s.size() );
+    CHECK( s.find( "not a key" ) == s.end() );
+}
+
 void print_bin( size_t n )
 {
     const int hash_size = 29;
@@ -473,6 +2123,55 @@ int main( int argc, char **argv )
            cache_set<int>
          >();
 
+    std::cout << "\n\nTEST SET ASSOCIATIVE\n\n";
+    test_set_associative();
+    test_tags<1>();
+    test_tags<4>();
+    test_tags<8>();
+    test_tags<16>();
+    test_tags<32>();
+    test_hash_mixing();
+    test_string_hash();
+    test_batch();
+    test_interleaved<1>();
+    test_interleaved<8>();
+    test_move_semantics();
+    test_overwrites();
+    test_occupancy();
+    test_lazy_clear();
+    test_mmap_allocator();
+    test_huge_pages<mm::transparent_huge_pages>();
+    test_huge_pages<mm::huge_pages_2mb>();
+    test_numa();
+    test_snapshot();
+    test_persistent();
+    test_shared();
+    test_tiered();
+    test_spill();
+    test_write_behind<mm::block_when_full>( 10 );
+    test_write_behind<mm::drop_when_full>( 100 );
+    test_write_behind<mm::inline_when_full>( 100 );
+    test_write_behind_threads();
+    test_reclaimer();
+    test_eviction_policies();
+    test_tinylfu();
+
+    std::cout << "\n\nTEST CONCURRENT CACHE_MAP\n\n";
+    test_concurrent< mm::concurrent_cache_map<int, int> >();
+    test_concurrent< mm::concurrent_cache_map<
+        int, int, hash<int>, equal_to<int>,
+        mm::DiscardIgnore< pair<int,int> >, allocator< pair<int,int> >,
+        8, mm::EvictLRU, mm::rw_lock > >();
+    test_concurrent< mm::concurrent_cache_map<
+        int, int, hash<int>, equal_to<int>,
+        mm::DiscardIgnore< pair<int,int> >, allocator< pair<int,int> >,
+        4, mm::EvictClock, mm::seq_lock > >();
+    test_seq_lock();
+
+    std::cout << "\n\nTEST ATOMIC CACHE_MAP\n\n";
+    test_atomic< mm::atomic_cache_map<uint32_t, uint32_t> >();
+    test_atomic< mm::atomic_cache_map<uint64_t, uint64_t> >();
+
     std::cout << "\nAll tests pass.\n";
 
     std::cout << std::endl;
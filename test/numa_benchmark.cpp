@@ -0,0 +1,180 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Compares the placements of a shared concurrent_cache_map on a NUMA
+ * system: first touch by a thread of node 0, pages interleaved over all
+ * the nodes, and one replica per node. Threads are pinned to the nodes
+ * round robin, and the lookup time is reported for each node.
+ *
+ * usage: numa_benchmark [buckets] [threads]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <mm/concurrent_cache_map.hpp>
+#include <mm/numa.hpp>
+#include <mm/replicated_cache_map.hpp>
+
+typedef unsigned long long key_type;
+typedef std::pair<key_type, key_type> value_type;
+
+template <class Allocator>
+struct map_of
+{
+    typedef mm::concurrent_cache_map< key_type, key_type,
+                                      mm::hash<key_type>,
+                                      std::equal_to<key_type>,
+                                      mm::DiscardIgnore<value_type>,
+                                      Allocator, 4, mm::EvictRandom,
+                                      mm::seq_lock
+                                    > type;
+};
+
+typedef map_of< std::allocator<value_type> >::type          first_touch_map;
+typedef map_of< mm::numa_allocator<value_type> >::type      numa_map;
+typedef mm::replicated_cache_map<numa_map>                  replicated_map;
+
+typedef std::chrono::steady_clock timer;
+
+/// Keeps the compiler from discarding the measured loops
+static volatile size_t g_sink;
+
+static const size_t g_lookups = 1 << 21;
+
+/// xorshift generator
+static key_type next_key( key_type& seed )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+/// Fills the map from a thread of node 0, so that first touch places the
+/// pages there
+template <class Map>
+static void fill( Map& m, size_t buckets )
+{
+    std::thread t( [&m, buckets]() {
+        mm::numa_run_on_node( 0 );
+        key_type seed = 88172645463325252ULL;
+        for ( size_t i = 0; i < buckets; ++i )
+            m.insert( next_key( seed ), i );
+    } );
+    t.join();
+}
+
+template <class Map>
+static void run( const char* name, Map& m, size_t buckets, int threads )
+{
+    const int nodes = mm::numa_node_count();
+    std::vector<double> node_ns( nodes, 0 );
+    std::vector<int> node_threads( nodes, 0 );
+    std::vector<double> ns( threads );
+
+    std::vector<std::thread> workers;
+    for ( int t = 0; t < threads; ++t )
+    {
+        workers.emplace_back( [&m, &ns, t, nodes, buckets]() {
+            mm::numa_run_on_node( t % nodes );
+
+            // Look up keys of the fill sequence, in random order
+            std::vector<key_type> keys( buckets );
+            key_type seed = 88172645463325252ULL;
+            for ( size_t i = 0; i < buckets; ++i )
+                keys[ i ] = next_key( seed );
+
+            seed += t;
+            size_t hits = 0;
+            key_type data;
+            const timer::time_point start = timer::now();
+            for ( size_t i = 0; i < g_lookups; ++i )
+                hits += m.find( keys[ next_key( seed ) % buckets ], data );
+            ns[ t ] = std::chrono::duration<double, std::nano>(
+                timer::now() - start ).count() / g_lookups;
+            g_sink = hits;
+        } );
+    }
+
+    for ( int t = 0; t < threads; ++t )
+    {
+        workers[ t ].join();
+        node_ns[ t % nodes ] += ns[ t ];
+        ++node_threads[ t % nodes ];
+    }
+
+    std::cout << name;
+    for ( int node = 0; node < nodes; ++node )
+        if ( node_threads[ node ] )
+            std::cout << "  node " << node << ": "
+                      << node_ns[ node ] / node_threads[ node ] << " ns/key";
+    std::cout << std::endl;
+}
+
+int main( int argc, char** argv )
+{
+    const size_t buckets = argc > 1 ? strtoul( argv[ 1 ], 0, 10 ) : 1 << 24;
+    const int nodes = mm::numa_node_count();
+    const int threads = argc > 2 ? atoi( argv[ 2 ] ) : 2 * nodes;
+
+    std::cout << nodes << " nodes, " << threads << " threads, "
+              << buckets << " buckets ("
+              << buckets * sizeof( value_type ) / ( 1 << 20 ) << " MB)\n";
+
+    {
+        first_touch_map m( buckets );
+        fill( m, buckets );
+        run( "first touch", m, buckets, threads );
+    }
+    {
+        numa_map m( buckets );
+        fill( m, buckets );
+        run( "interleaved", m, buckets, threads );
+    }
+    {
+        replicated_map m( buckets );
+        fill( m, buckets );
+        run( "replicated ", m, buckets, threads );
+    }
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ *
+ *  $Id$
+ *
+ *  $URL$
+ *
+ *  Copyright (C) 2006 Matteo Merli <matteo.merli@gmail.com>
+ *
+ *
+ *  BSD License
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *   o Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *   o Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ *  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ *  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ *  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *  NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ *  THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Compares random lookups on a table backed by base pages, transparent
+ * huge pages and hugetlb pages. The dTLB misses are counted with the
+ * performance counters, where available.
+ *
+ * usage: tlb_benchmark [buckets]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <mm/cache_map.hpp>
+#include <mm/mmap_allocator.hpp>
+
+typedef unsigned long long key_type;
+typedef std::pair<key_type, key_type> value_type;
+
+typedef std::chrono::steady_clock timer;
+
+/// Keeps the compiler from discarding the measured loops
+static volatile size_t g_sink;
+
+static double elapsed_ns( timer::time_point start )
+{
+    return std::chrono::duration<double, std::nano>( timer::now() - start ).count();
+}
+
+/// xorshift generator
+static key_type next_key( key_type& seed )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+/// Counter of the dTLB load misses of this thread, or -1
+static int open_dtlb_counter()
+{
+    perf_event_attr attr;
+    std::memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+                  | ( PERF_COUNT_HW_CACHE_OP_READ << 8 )
+                  | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+template <mm::page_mode Pages>
+static void run( const char* name, size_t buckets, int counter )
+{
+    typedef mm::cache_map< key_type, key_type, mm::hash<key_type>,
+                           std::equal_to<key_type>,
+                           mm::DiscardIgnore<value_type>,
+                           mm::mmap_allocator<value_type, Pages>, 4
+                         > map_type;
+    const size_t lookups = 1 << 22;
+
+    map_type m( buckets );
+
+    std::vector<key_type> keys;
+    key_type seed = 88172645463325252ULL;
+    for ( size_t i = 0; i < m.bucket_count(); ++i )
+    {
+        const key_type k = next_key( seed );
+        if ( m.insert( value_type( k, i ) ).second )
+            keys.push_back( k );
+    }
+
+    std::vector<key_type> probes( lookups );
+    for ( size_t i = 0; i < lookups; ++i )
+        probes[ i ] = keys[ next_key( seed ) % keys.size() ];
+
+    if ( counter >= 0 )
+    {
+        ioctl( counter, PERF_EVENT_IOC_RESET, 0 );
+        ioctl( counter, PERF_EVENT_IOC_ENABLE, 0 );
+    }
+
+    size_t hits = 0;
+    timer::time_point start = timer::now();
+    for ( size_t i = 0; i < lookups; ++i )
+        hits += ( m.find( probes[ i ] ) != m.end() );
+    const double ns = elapsed_ns( start ) / lookups;
+    g_sink = hits;
+
+    long long misses = -1;
+    if ( counter >= 0 )
+    {
+        ioctl( counter, PERF_EVENT_IOC_DISABLE, 0 );
+        if ( read( counter, &misses, sizeof( misses ) ) != sizeof( misses ) )
+            misses = -1;
+    }
+
+    std::cout << name << " (" << m.get_allocator().page_size() / 1024
+              << " KB pages)  " << ns << " ns/key  ";
+    if ( misses >= 0 )
+        std::cout << double( misses ) / lookups << " dTLB misses/key\n";
+    else
+        std::cout << "dTLB misses n/a\n";
+}
+
+int main( int argc, char** argv )
+{
+    const size_t buckets = argc > 1 ? strtoul( argv[ 1 ], 0, 10 ) : 1 << 25;
+    const int counter = open_dtlb_counter();
+
+    std::cout << buckets << " buckets ("
+              << buckets * sizeof( value_type ) / ( 1 << 20 ) << " MB)\n";
+
+    run<mm::small_pages>( "small pages      ", buckets, counter );
+    run<mm::transparent_huge_pages>( "transparent huge ", buckets, counter );
+    run<mm::huge_pages_2mb>( "hugetlb 2 MB     ", buckets, counter );
+
+    if ( counter >= 0 )
+        close( counter );
+    return 0;
+}